@@ -99,6 +99,21 @@ if(NOT Microsoft.GSL_FOUND AND _do_download)
 endif()
 list(APPEND TOXFS_DEPS GSL)
 
+# ================================
+# liburing (optional)
+# ================================
+if(ENABLE_IO_URING)
+    pkg_check_modules(liburing liburing>=2.0 IMPORTED_TARGET)
+endif()
+if(liburing_FOUND)
+    add_library(toxfsdep::uring INTERFACE IMPORTED)
+    target_link_libraries(toxfsdep::uring INTERFACE PkgConfig::liburing)
+    set(TOXFS_liburing_DEP_TYPE "System (${liburing_VERSION})")
+else()
+    set(TOXFS_liburing_DEP_TYPE "Disabled")
+endif()
+list(APPEND TOXFS_DEPS liburing)
+
 # Print out all dependencies
 message(STATUS "Toxfs Dependencies Summary:")
 foreach(dep IN LISTS TOXFS_DEPS)
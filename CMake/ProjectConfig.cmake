@@ -19,6 +19,8 @@
 
 set(BUILD_TOXFSD ON CACHE BOOL "Build toxfsd")
 set(BUILD_TOXFUSE ON CACHE BOOL "Build toxfuse")
+set(ENABLE_IO_URING ON CACHE BOOL "Use io_uring for file I/O when liburing is available")
+set(BUILD_BENCHMARKS OFF CACHE BOOL "Build the microbenchmarks")
 
 # Put built all executables in build/bin
 set(CMAKE_RUNTIME_OUTPUT_DIRECTORY ${CMAKE_BINARY_DIR}/bin)
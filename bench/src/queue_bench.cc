@@ -0,0 +1,160 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Compares the queues used between the tox threads: items go from some
+ * producer threads to one consumer thread through a queue of the size the
+ * tox queues have.
+ */
+
+#include "toxfs/util/message_queue.hh"
+#include "toxfs/util/ring_queue.hh"
+
+#include <fmt/core.h>
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+constexpr size_t k_queue_size = 512;
+
+/* Items moved per push_bulk and most items per pop_up_to when batching */
+constexpr size_t k_push_batch = 16;
+constexpr size_t k_pop_batch = 64;
+
+/* About the size of a small tox message */
+struct item_t
+{
+    uint64_t value;
+    std::array<std::byte, 56> payload;
+};
+
+template<class Queue>
+double run(size_t producers, uint64_t items_per_producer, bool batched)
+{
+    Queue queue;
+    auto const start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; p++)
+    {
+        threads.emplace_back([&queue, items_per_producer, batched]()
+        {
+            if (!batched)
+            {
+                for (uint64_t i = 0; i < items_per_producer; i++)
+                    queue.push(item_t{i, {}});
+                return;
+            }
+
+            std::vector<item_t> items;
+            for (uint64_t i = 0; i < items_per_producer; i++)
+            {
+                items.push_back(item_t{i, {}});
+                if (items.size() == k_push_batch || i + 1 == items_per_producer)
+                {
+                    queue.push_bulk(items.begin(), items.end());
+                    items.clear();
+                }
+            }
+        });
+    }
+
+    uint64_t const total = producers * items_per_producer;
+    uint64_t sum = 0;
+    if (!batched)
+    {
+        for (uint64_t i = 0; i < total; i++)
+            sum += queue.pop().value;
+    }
+    else
+    {
+        std::vector<item_t> items;
+        for (uint64_t received = 0; received < total;)
+        {
+            items.clear();
+            received += queue.pop_up_to(items, k_pop_batch,
+                    std::chrono::steady_clock::now() + std::chrono::seconds{1});
+            for (auto const& item : items)
+                sum += item.value;
+        }
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Every item arrived exactly once
+    if (sum != producers * (items_per_producer * (items_per_producer - 1) / 2))
+    {
+        fmt::print(stderr, "Items went missing!\n");
+        std::exit(1);
+    }
+
+    return static_cast<double>(total) / elapsed;
+}
+
+void report(std::string_view name, bool batched, size_t producers, double rate, double baseline)
+{
+    fmt::print("{:<16} {:<8} {:>2} producers {:>8.2f} M items/s {:>6.2f}x\n",
+            name, batched ? "batched" : "single", producers, rate / 1e6, rate / baseline);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    uint64_t const items = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2'000'000;
+
+    // Everything is compared to single items through message_queue
+    for (size_t producers : {1u, 2u, 4u})
+    {
+        auto const per_producer = items / producers;
+        auto const locked = run<toxfs::message_queue<item_t, k_queue_size>>(producers, per_producer, false);
+
+        for (bool batched : {false, true})
+        {
+            auto const locked_run = batched
+                ? run<toxfs::message_queue<item_t, k_queue_size>>(producers, per_producer, true)
+                : locked;
+            report("message_queue", batched, producers, locked_run, locked);
+
+            auto const mpsc = run<toxfs::mpsc_ring_queue<item_t, k_queue_size>>(producers, per_producer, batched);
+            report("mpsc_ring_queue", batched, producers, mpsc, locked);
+
+            if (producers == 1)
+            {
+                auto const spsc = run<toxfs::spsc_ring_queue<item_t, k_queue_size>>(producers, per_producer, batched);
+                report("spsc_ring_queue", batched, producers, spsc, locked);
+            }
+        }
+    }
+
+    return 0;
+}
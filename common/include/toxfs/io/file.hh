@@ -0,0 +1,159 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gsl/span>
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+namespace toxfs::io
+{
+
+enum class open_mode_t
+{
+    /* Open an existing file for reading */
+    read,
+    /* Open or create a file for writing, keeping existing contents */
+    write,
+    /* Open or create a file for writing, discarding existing contents */
+    truncate
+};
+
+/**
+ * A file opened as a raw file descriptor with positional I/O.
+ *
+ * None of the I/O functions use or modify the file offset, so they carry
+ * no stream state and can be called concurrently from multiple threads on
+ * the same file.
+ */
+class file_t
+{
+public:
+    /**
+     * @brief ctor, creates a closed file
+     */
+    file_t() noexcept = default;
+
+    /**
+     * @brief ctor, opens the file
+     * @param[in] path - the path to the file
+     * @param[in] mode - how to open the file
+     * @throws if the file could not be opened
+     */
+    file_t(std::filesystem::path const& path, open_mode_t mode);
+
+    ~file_t() noexcept;
+
+    file_t(file_t&& other) noexcept;
+    file_t& operator=(file_t&& other) noexcept;
+
+    file_t(file_t const&) = delete;
+    file_t& operator=(file_t const&) = delete;
+
+    /**
+     * @brief check if the file is open
+     */
+    bool is_open() const noexcept { return fd_ >= 0; }
+
+    /**
+     * @brief get the underlying file descriptor, -1 if closed
+     */
+    int fd() const noexcept { return fd_; }
+
+    /**
+     * @brief get the path the file was opened with
+     */
+    std::filesystem::path const& path() const noexcept { return path_; }
+
+    /**
+     * @brief get the current size of the file
+     * @throws on error
+     */
+    uint64_t size() const;
+
+    /**
+     * @brief read from a position, retrying short reads until EOF
+     * @param[in] pos - the position in the file
+     * @param[out] data - the buffer to read into
+     * @return the number of bytes read, less than data.size() only at EOF
+     * @throws on error
+     */
+    size_t read_at(uint64_t pos, gsl::span<std::byte> data) const;
+
+    /**
+     * @brief write all of data to a position
+     * @param[in] pos - the position in the file
+     * @param[in] data - the data to write
+     * @throws on error
+     */
+    void write_at(uint64_t pos, gsl::span<std::byte const> data) const;
+
+    /**
+     * @brief vectored read from a position, retrying short reads until EOF
+     * @param[in] pos - the position in the file
+     * @param[in] iov - the buffers to read into, in order
+     * @return the number of bytes read, less than the total only at EOF
+     * @throws on error
+     */
+    size_t readv_at(uint64_t pos, gsl::span<iovec const> iov) const;
+
+    /**
+     * @brief vectored write of all buffers to a position
+     * @param[in] pos - the position in the file
+     * @param[in] iov - the buffers to write, in order
+     * @throws on error
+     */
+    void writev_at(uint64_t pos, gsl::span<iovec const> iov) const;
+
+    /**
+     * @brief flush written data to the disk (fdatasync)
+     * @throws on error
+     */
+    void sync_data() const;
+
+    /**
+     * @brief reserve disk space for the first size bytes of the file without
+     *        changing its size, so later writes cannot run out of space and
+     *        the file is laid out in large extents
+     * @param[in] size - the size to reserve, sizes that do not fit in off_t are skipped
+     * @throws on error, including if the disk is full
+     */
+    void allocate(uint64_t size) const;
+
+    /**
+     * @brief hint to the kernel that the file will be read sequentially
+     */
+    void advise_sequential() const noexcept;
+
+    /**
+     * @brief close the file, does nothing if already closed
+     */
+    void close() noexcept;
+
+private:
+    int fd_ = -1;
+    std::filesystem::path path_{};
+};
+
+} // namespace toxfs::io
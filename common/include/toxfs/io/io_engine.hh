@@ -0,0 +1,117 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "toxfs/io/file.hh"
+#include "toxfs/util/buffer.hh"
+#include "toxfs/util/buffer_chain.hh"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace toxfs::io
+{
+
+enum class io_engine_type_t
+{
+    /* Run each request to completion on the submitting thread */
+    sync,
+    /* Submit requests in batches to io_uring, completing asynchronously */
+    uring
+};
+
+/**
+ * The result of a read or write request
+ */
+struct io_completion_t
+{
+    /* The request's buffer, for reads the size is set to the bytes read */
+    buffer_t buffer;
+    /* The position in the file of the request */
+    uint64_t position;
+    /* 0 on success, otherwise the errno of the failure */
+    int error;
+};
+
+using io_callback_t = std::function<void(io_completion_t&&)>;
+
+/**
+ * Interface for submitting file reads and writes.
+ *
+ * Callbacks may be invoked on any thread (including the submitting thread,
+ * before submit returns), the file is kept alive until the callback is done.
+ */
+class io_engine_t
+{
+public:
+    virtual ~io_engine_t() noexcept = default;
+
+    /**
+     * @brief submit a read of buffer.capacity() bytes
+     * @param[in] file - the file to read from
+     * @param[in] pos - the position in the file
+     * @param[in] buffer - the buffer to read into
+     * @param[in] callback - called on completion
+     */
+    virtual void submit_read(std::shared_ptr<file_t const> file, uint64_t pos,
+            buffer_t buffer, io_callback_t callback) = 0;
+
+    /**
+     * @brief submit a write of buffer.size() bytes
+     * @param[in] file - the file to write to
+     * @param[in] pos - the position in the file
+     * @param[in] buffer - the data to write
+     * @param[in] callback - called on completion
+     */
+    virtual void submit_write(std::shared_ptr<file_t const> file, uint64_t pos,
+            buffer_t buffer, io_callback_t callback) = 0;
+
+    /**
+     * @brief submit a vectored write of a chain, one iovec per segment
+     * @param[in] file - the file to write to
+     * @param[in] pos - the position in the file
+     * @param[in] data - the data to write
+     * @param[in] callback - called on completion, the completion's buffer is empty
+     */
+    virtual void submit_writev(std::shared_ptr<file_t const> file, uint64_t pos,
+            buffer_chain_t data, io_callback_t callback) = 0;
+
+    /**
+     * @brief push any batched requests to the kernel
+     */
+    virtual void flush() = 0;
+
+    /**
+     * @brief get the type of the engine
+     */
+    virtual io_engine_type_t type() const noexcept = 0;
+};
+
+/**
+ * @brief create an I/O engine, falling back to sync if the type is unavailable
+ * @param[in] type - the requested type of engine
+ * @param[in] queue_depth - the maximum number of requests submitted at once
+ * @return the engine
+ */
+std::unique_ptr<io_engine_t> make_io_engine(io_engine_type_t type, unsigned queue_depth);
+
+} // namespace toxfs::io
@@ -0,0 +1,94 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "toxfs/io/file.hh"
+#include "toxfs/util/buffer.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+namespace toxfs::io
+{
+
+/**
+ * A read-only memory mapping of a whole file, handing out refcounted views
+ * of it as buffer_t so data can be sent without copying it first.
+ *
+ * If the file is truncated while mapped, touching a page past the new end
+ * raises SIGBUS. Views must therefore only be read with guarded_copy(), which
+ * fails the copy instead and marks the mapping as truncated, after which no
+ * more views are handed out.
+ */
+class mapped_file_t : public std::enable_shared_from_this<mapped_file_t>
+{
+    struct private_tag_t {};
+
+public:
+    /**
+     * @brief map a file
+     * @param[in] file - the file to map, must be opened for reading
+     * @return the mapping, nullptr if the file cannot be mapped
+     */
+    static std::shared_ptr<mapped_file_t> map(file_t const& file) noexcept;
+
+    mapped_file_t(private_tag_t, std::byte *base, uint64_t size, size_t slot) noexcept;
+
+    ~mapped_file_t() noexcept;
+
+    mapped_file_t(mapped_file_t const&) = delete;
+    mapped_file_t& operator=(mapped_file_t const&) = delete;
+
+    /**
+     * @brief get the size of the mapping
+     */
+    uint64_t size() const noexcept { return size_; }
+
+    /**
+     * @brief check if the file was found to be truncated while mapped
+     */
+    bool truncated() const noexcept;
+
+    /**
+     * @brief get a view of part of the file, the view must not be written to
+     * @param[in] pos - the position in the file
+     * @param[in] size - the size of the view
+     * @return the view, none if out of range or the file was truncated
+     */
+    std::optional<buffer_t> view(uint64_t pos, size_t size);
+
+    /**
+     * @brief copy memory that may be a view of a mapping, safe against the file being truncated
+     * @param[in] dst - where to copy to
+     * @param[in] src - where to copy from
+     * @param[in] size - the number of bytes
+     * @return false if src is past the end of a truncated file, dst is then partly written
+     */
+    static bool guarded_copy(std::byte *dst, std::byte const *src, size_t size) noexcept;
+
+private:
+    std::byte *base_;
+    uint64_t size_;
+    size_t slot_;
+};
+
+} // namespace toxfs::io
@@ -0,0 +1,152 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "toxfs/io/file.hh"
+#include "toxfs/io/io_engine.hh"
+#include "toxfs/util/buffer_chain.hh"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+
+namespace toxfs::io
+{
+
+struct read_ahead_config_t
+{
+    /* Read ahead for sequential readers */
+    bool enabled{true};
+    /* Size of each read ahead block, blocks are aligned to this in the file */
+    size_t block_size{256u << 10u};
+    /* Bounds on the number of blocks kept ahead of the reader */
+    size_t min_blocks{2};
+    size_t max_blocks{32};
+};
+
+/**
+ * The result of a read through read ahead
+ */
+struct read_result_t
+{
+    /* The data, views of the read ahead blocks it came from */
+    buffer_chain_t data;
+    /* The position in the file of the read */
+    uint64_t position;
+    /* 0 on success, otherwise the errno of the failure */
+    int error;
+};
+
+using read_callback_t = std::function<void(read_result_t&&)>;
+
+/**
+ * Reads large blocks of a file ahead of a sequential reader and answers the
+ * reader's small reads from those blocks.
+ *
+ * Once the reads are seen to be sequential, blocks ahead of the read frontier
+ * are kept in flight. The number of blocks (the window) follows the measured
+ * consume rate and block read latency, so enough data is in flight to hide the
+ * disk latency. Reads that are not sequential go straight to the engine.
+ *
+ * Must only be used from one thread, the post function is used to get block
+ * completions back onto it.
+ */
+class read_ahead_t : public std::enable_shared_from_this<read_ahead_t>
+{
+public:
+    using post_fn_t = std::function<void(std::function<void()>)>;
+
+    /**
+     * @brief ctor
+     * @param[in] file - the file to read
+     * @param[in] file_size - the size of the file
+     * @param[in] engine - the engine to read with, must outlive this
+     * @param[in] post - runs a function on the thread that owns this
+     * @param[in] config - read ahead settings
+     */
+    read_ahead_t(std::shared_ptr<file_t const> file, uint64_t file_size, io_engine_t& engine,
+            post_fn_t post, read_ahead_config_t const& config);
+
+    read_ahead_t(read_ahead_t const&) = delete;
+    read_ahead_t& operator=(read_ahead_t const&) = delete;
+
+    /**
+     * @brief read part of the file
+     * @param[in] pos - the position in the file
+     * @param[in] size - the number of bytes
+     * @param[in] callback - called with the data on the thread that owns this
+     */
+    void read(uint64_t pos, size_t size, read_callback_t callback);
+
+    /**
+     * @brief get the current number of blocks read ahead
+     */
+    size_t window() const noexcept { return window_; }
+
+private:
+    using clock_t = std::chrono::steady_clock;
+
+    struct block_t
+    {
+        buffer_t data{0};
+        bool ready = false;
+        bool failed = false;
+        clock_t::time_point submitted{};
+    };
+
+    struct pending_t
+    {
+        uint64_t position;
+        size_t size;
+        read_callback_t callback;
+    };
+
+    void schedule_();
+    void on_block_read_(uint64_t generation, uint64_t index, io_completion_t&& c);
+    void serve_pending_();
+    void drop_consumed_();
+    void update_window_();
+
+    std::shared_ptr<file_t const> file_;
+    uint64_t file_size_;
+    io_engine_t& engine_;
+    post_fn_t post_;
+    read_ahead_config_t config_;
+
+    /* End of the last read, where a sequential reader reads next */
+    uint64_t next_pos_ = 0;
+    unsigned sequential_ = 0;
+    /* Bumped whenever the blocks are dropped so stale completions are ignored */
+    uint64_t generation_ = 0;
+    std::map<uint64_t, block_t> blocks_;
+    std::deque<pending_t> pending_;
+
+    size_t window_;
+    /* Moving averages, in bytes per second and seconds */
+    double consume_rate_ = 0.0;
+    double read_latency_ = 0.0;
+    clock_t::time_point last_consumed_{clock_t::now()};
+};
+
+} // namespace toxfs::io
@@ -0,0 +1,144 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "toxfs/io/file.hh"
+#include "toxfs/io/io_engine.hh"
+#include "toxfs/util/buffer_chain.hh"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+
+namespace toxfs::io
+{
+
+enum class durability_t
+{
+    /* Leave flushing to disk up to the kernel */
+    none,
+    /* fdatasync once all data is written */
+    sync_at_end,
+    /* fdatasync every sync_interval while writing, and at the end */
+    periodic
+};
+
+struct write_behind_config_t
+{
+    /* Buffer writes instead of writing each chunk */
+    bool enabled{true};
+    /* Buffered data is written in extents aligned to this size */
+    size_t extent_size{1u << 20u};
+    /* Data is written out at the latest after this long */
+    std::chrono::milliseconds max_delay{500};
+    durability_t durability{durability_t::none};
+    std::chrono::milliseconds sync_interval{5000};
+};
+
+/**
+ * Collects small writes to a file and writes them out as large extents.
+ *
+ * Chunks are kept in position order, so chunks that arrive slightly out of
+ * order still join up. Once enough is buffered, every contiguous run is
+ * written up to its last extent boundary with one vectored write, the rest
+ * waits for more data or for max_delay to pass.
+ *
+ * Must only be used from one thread, the post function is used to get write
+ * completions back onto it. The object keeps itself alive until all writes
+ * it submitted are done.
+ */
+class write_behind_t : public std::enable_shared_from_this<write_behind_t>
+{
+public:
+    using post_fn_t = std::function<void(std::function<void()>)>;
+    using written_fn_t = std::function<void(uint64_t pos, uint64_t size)>;
+    using error_fn_t = std::function<void(int error)>;
+
+    /**
+     * @brief ctor
+     * @param[in] file - the file to write
+     * @param[in] engine - the engine to write with, must outlive this
+     * @param[in] post - runs a function on the thread that owns this
+     * @param[in] on_written - called on the owning thread for each range written
+     * @param[in] on_failed - called on the owning thread with the errno of the first write that fails
+     * @param[in] config - write behind settings
+     */
+    write_behind_t(std::shared_ptr<file_t const> file, io_engine_t& engine,
+            post_fn_t post, written_fn_t on_written, error_fn_t on_failed, write_behind_config_t const& config);
+
+    write_behind_t(write_behind_t const&) = delete;
+    write_behind_t& operator=(write_behind_t const&) = delete;
+
+    /**
+     * @brief buffer a write
+     * @param[in] pos - the position in the file
+     * @param[in] data - the data
+     */
+    void write(uint64_t pos, buffer_chain_t data);
+
+    /**
+     * @brief write out data that has been buffered for too long, call periodically
+     */
+    void poll();
+
+    /**
+     * @brief write out everything and sync if the durability policy asks for it
+     * @param[in] on_done - called on the owning thread once every write is done
+     *                      and synced, with the errno of the first failure or 0.
+     *                      May be called before finish returns.
+     */
+    void finish(error_fn_t on_done);
+
+    /**
+     * @brief get the number of bytes buffered
+     */
+    size_t buffered() const noexcept { return buffered_; }
+
+private:
+    using clock_t = std::chrono::steady_clock;
+
+    void flush_(bool all);
+    void submit_(uint64_t pos, buffer_chain_t data);
+    void on_written_(uint64_t pos, uint64_t size, int error);
+    void sync_();
+    void done_();
+
+    std::shared_ptr<file_t const> file_;
+    io_engine_t& engine_;
+    post_fn_t post_;
+    written_fn_t written_fn_;
+    error_fn_t failed_fn_;
+    error_fn_t done_fn_{};
+    write_behind_config_t config_;
+
+    std::map<uint64_t, buffer_chain_t> chunks_;
+    size_t buffered_ = 0;
+    clock_t::time_point oldest_{};
+    clock_t::time_point last_sync_{clock_t::now()};
+    unsigned in_flight_ = 0;
+    bool finishing_ = false;
+    /* The errno of the first write or sync that failed */
+    int error_ = 0;
+};
+
+} // namespace toxfs::io
@@ -0,0 +1,353 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "toxfs/exception.hh"
+#include "toxfs/io/file.hh"
+#include "toxfs/tox/tox_if.hh"
+#include "toxfs/util/buffer_chain.hh"
+#include "toxfs/util/message_queue.hh"
+
+#include <gsl/span>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace toxfs::rpc
+{
+
+namespace codec
+{
+class reader_t;
+class writer_t;
+} // namespace codec
+
+enum class file_type_t : uint8_t
+{
+    regular,
+    directory,
+    symlink,
+    other
+};
+
+struct file_stat_t
+{
+    file_type_t type;
+    uint64_t size;
+    /* Last modification in nanoseconds since the epoch */
+    int64_t mtime;
+    /* Permission bits */
+    uint32_t mode;
+};
+
+struct dir_entry_t
+{
+    std::string name;
+    file_type_t type;
+};
+
+/**
+ * Part of a directory listing, as much as fits in one packet
+ */
+struct dir_page_t
+{
+    std::vector<dir_entry_t> entries;
+    /* The offset to ask for the next page at, none once the listing is complete */
+    std::optional<uint64_t> next;
+};
+
+struct file_handle_t
+{
+    uint64_t id;
+};
+
+/**
+ * An error returned by the friend, or a request that failed to get an answer
+ */
+class rpc_error : public toxfs::runtime_error
+{
+public:
+    explicit rpc_error(std::string const& what, const char *file, int line, int errc)
+        : toxfs::runtime_error(what, file, line)
+        , errc_(errc)
+    {}
+
+    ~rpc_error() noexcept override = default;
+
+    rpc_error(rpc_error const&) noexcept = default;
+    rpc_error& operator=(rpc_error const&) noexcept = default;
+
+    /**
+     * @brief Get the errno value of the error
+     */
+    int error_code() const noexcept
+    {
+        return errc_;
+    }
+
+private:
+    int errc_;
+};
+
+struct rpc_config_t
+{
+    /* The directory served to friends, paths of requests are relative to it */
+    std::filesystem::path root_dir{};
+    /* Requests without an answer after this long fail */
+    std::chrono::milliseconds request_timeout{30000};
+    /* Requests to one friend that may be waiting for an answer at once, more are queued */
+    unsigned max_in_flight{32};
+    /* Files one friend may have open at once */
+    unsigned max_open_files{64};
+};
+
+/**
+ * Metadata operations on the files of a friend, and serving them on the
+ * files of root_dir.
+ *
+ * Requests and answers are custom lossless packets, so they bypass the
+ * file transfer machinery and its per file setup. Every request has an id
+ * its answer carries, so many requests can be in flight at once and are
+ * answered in any order. A request that arrives while the server is too
+ * far behind is answered with EBUSY rather than holding up the tox
+ * message thread.
+ */
+class rpc_t : public tox::packet_callback_if
+{
+public:
+    /**
+     * @brief ctor
+     * @param[in] tox_if - tox_if
+     * @param[in] config - the rpc config
+     */
+    rpc_t(std::shared_ptr<tox::tox_if> tox_if, rpc_config_t config);
+
+    ~rpc_t() noexcept override;
+
+    rpc_t(rpc_t const&) = delete;
+    rpc_t& operator=(rpc_t const&) = delete;
+
+    /**
+     * @brief get the metadata of a file of a friend, symlinks are followed
+     * @param[in] fr_id - the friend
+     * @param[in] path - the path relative to the friend's root dir
+     */
+    std::future<file_stat_t> stat(tox::friend_id_t fr_id, std::string path);
+
+    /**
+     * @brief list a directory of a friend, one page at a time
+     * @param[in] fr_id - the friend
+     * @param[in] path - the path relative to the friend's root dir
+     * @param[in] offset - 0 for the first page, then the next of the previous page
+     */
+    std::future<dir_page_t> readdir(tox::friend_id_t fr_id, std::string path, uint64_t offset = 0);
+
+    /**
+     * @brief open a file of a friend for reading
+     * @param[in] fr_id - the friend
+     * @param[in] path - the path relative to the friend's root dir
+     */
+    std::future<file_handle_t> open(tox::friend_id_t fr_id, std::string path);
+
+    /**
+     * @brief read part of an open file, large reads are split into
+     *        requests that are all sent at once
+     * @param[in] fr_id - the friend
+     * @param[in] handle - the file
+     * @param[in] position - the position to read at
+     * @param[in] size - the size to read
+     * @return the data, a segment per part, short only at the end of the file
+     */
+    std::future<buffer_chain_t> read(tox::friend_id_t fr_id, file_handle_t handle, uint64_t position, size_t size);
+
+    /**
+     * @brief close an open file
+     * @param[in] fr_id - the friend
+     * @param[in] handle - the file
+     */
+    std::future<void> close(tox::friend_id_t fr_id, file_handle_t handle);
+
+private:
+
+    /* tox::packet_callback_if */
+
+    void on_tox_lossless_packet(tox::friend_id_t id, std::vector<std::byte> packet) noexcept override;
+
+    void on_tox_lossless_packet_error(tox::friend_id_t id, std::vector<std::byte> packet, tox::tox_error err) noexcept override;
+
+    /* END tox::packet_callback_if */
+
+    enum class op_t : uint8_t
+    {
+        stat = 1,
+        readdir = 2,
+        open = 3,
+        read = 4,
+        close = 5
+    };
+
+    /**
+     * Called once with the payload of the answer, or with the error if
+     * the request failed
+     */
+    using complete_t = std::function<void(std::exception_ptr, gsl::span<std::byte const>)>;
+
+    struct pending_t
+    {
+        tox::friend_id_t fr_id;
+        std::chrono::steady_clock::time_point deadline;
+        complete_t complete;
+        /* Set until the request is sent */
+        bool sent = false;
+    };
+
+    struct friend_state_t
+    {
+        unsigned in_flight = 0;
+        /* Requests waiting for one in flight to finish */
+        std::deque<std::pair<uint32_t, std::vector<std::byte>>> backlog{};
+    };
+
+    struct dir_listing_t
+    {
+        std::filesystem::path path;
+        std::vector<dir_entry_t> entries;
+    };
+
+    /* An encoded answer waiting to be sent by the server thread */
+    struct answer_t
+    {
+        tox::friend_id_t fr_id;
+        std::vector<std::byte> packet;
+        std::chrono::steady_clock::time_point due;
+    };
+
+    /**
+     * @brief send a request, or queue it if too many are in flight
+     * @param[in] fr_id - the friend
+     * @param[in] op - the operation
+     * @param[in] args - the encoded arguments
+     * @param[in] complete - called with the answer
+     */
+    void call_(tox::friend_id_t fr_id, op_t op, std::vector<std::byte> args, complete_t complete);
+
+    /**
+     * @brief hand a request to tox, fails it if that throws
+     */
+    void send_(tox::friend_id_t fr_id, uint32_t request_id, std::vector<std::byte> packet) noexcept;
+
+    /**
+     * @brief finish a request and send the next queued one to its friend
+     * @param[in] fr_id - the friend the answer or error is about, ignored
+     *                    unless it is the one the request was sent to
+     * @param[in] request_id - the request
+     * @param[in] error - the error, null if answered
+     * @param[in] payload - the payload of the answer
+     */
+    void finish_(tox::friend_id_t fr_id, uint32_t request_id, std::exception_ptr error,
+            gsl::span<std::byte const> payload) noexcept;
+
+    /**
+     * @brief fail requests that have not been answered in time
+     */
+    void expire_() noexcept;
+
+    void server_run_() noexcept;
+
+    /**
+     * @brief answer a request, run on the server thread
+     */
+    void serve_(tox::friend_id_t fr_id, std::vector<std::byte> const& packet) noexcept;
+
+    /**
+     * @brief queue an answer for the server thread to send, dropped if too many are queued
+     * @param[in] answer - the answer
+     */
+    void queue_answer_(answer_t answer) noexcept;
+
+    /**
+     * @brief queue an answer that failed to send to be sent again shortly,
+     *        until the request it answers would have timed out on the client
+     * @param[in] fr_id - the friend
+     * @param[in] packet - the encoded answer
+     */
+    void retry_answer_(tox::friend_id_t fr_id, std::vector<std::byte> packet) noexcept;
+
+    /**
+     * @brief send the queued answers that are due, run on the server thread
+     * @return when the next queued answer is due
+     */
+    std::chrono::steady_clock::time_point send_answers_() noexcept;
+
+    /* Operations, they read the arguments and write the result or throw */
+    void serve_stat_(tox::friend_id_t fr_id, codec::reader_t& args, codec::writer_t& result);
+    void serve_readdir_(tox::friend_id_t fr_id, codec::reader_t& args, codec::writer_t& result);
+    void serve_open_(tox::friend_id_t fr_id, codec::reader_t& args, codec::writer_t& result);
+    void serve_read_(tox::friend_id_t fr_id, codec::reader_t& args, codec::writer_t& result);
+    void serve_close_(tox::friend_id_t fr_id, codec::reader_t& args, codec::writer_t& result);
+
+    /**
+     * @brief map a path of a request into root_dir
+     * @throws if the path does not exist or leads outside of root_dir
+     */
+    std::filesystem::path resolve_path_(std::string const& path) const;
+
+    std::shared_ptr<tox::tox_if> tox_if_;
+    rpc_config_t config_;
+
+    /* Client side */
+    std::mutex mutex_;
+    std::atomic<uint32_t> next_request_id_{0};
+    std::unordered_map<uint32_t, pending_t> pending_;
+    std::unordered_map<uint32_t, friend_state_t> friends_;
+
+    /* Server side, only touched by the server thread */
+    message_queue<std::function<void()>, 256> server_queue_;
+    bool stop_ = false;
+    uint64_t next_handle_ = 1;
+    std::unordered_map<uint32_t, std::unordered_map<uint64_t, io::file_t>> open_files_;
+    std::unordered_map<uint32_t, dir_listing_t> dir_listings_;
+    std::thread server_thread_;
+
+    /*
+     * Answers not sent from serve_, busy answers to requests the server
+     * had no room for and answers being retried. Pushed from any thread.
+     */
+    std::mutex answers_mutex_;
+    std::deque<answer_t> answers_;
+    /* When the client gives up on an answer being retried, by friend and request id */
+    std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> answer_deadlines_;
+};
+
+} // namespace toxfs::rpc
@@ -22,14 +22,23 @@
 #include "toxfs/tox/tox_types.hh"
 #include "toxfs/tox/tox_error.hh"
 
-#include "toxfs/util/buffer.hh"
+#include "toxfs/util/buffer_chain.hh"
 
+#include <array>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <functional>
+#include <vector>
 
 namespace toxfs::tox
 {
 
+constexpr size_t k_file_hash_size = 32;
+
+/* What toxcore calls the file id, identifies a file across transfers and restarts */
+using file_hash_t = std::array<std::byte, k_file_hash_size>;
+
 struct file_id_t
 {
     uint32_t id;
@@ -62,6 +71,65 @@ struct file_info_t
 {
     std::string filename;
     uint64_t filesize;
+    /* All zero lets toxcore pick a random one */
+    file_hash_t hash{};
+};
+
+/* The congestion state of a file being sent, for inspection */
+struct chunk_window_state_t
+{
+    /* Blocks allowed to be read ahead of toxcore */
+    unsigned window;
+    bool slow_start;
+    /* Smoothed and lowest time from a block being released to toxcore having taken it */
+    std::chrono::microseconds srtt;
+    std::chrono::microseconds min_rtt;
+    /* Chunks toxcore refused with a full send queue */
+    uint64_t sendq_events;
+};
+
+/* What the scheduler has given a file being sent */
+struct file_share_t
+{
+    unique_file_id_t id;
+    unsigned weight;
+    /* Bytes of chunk requests released */
+    uint64_t bytes;
+};
+
+/* What the scheduler has given a friend, across the files it is being sent */
+struct friend_share_t
+{
+    friend_id_t id;
+    unsigned weight;
+    /* Bytes of chunk requests released */
+    uint64_t bytes;
+    std::vector<file_share_t> files;
+};
+
+enum class transfer_direction_t
+{
+    upload,
+    download
+};
+
+struct rate_limit_t
+{
+    /* Bytes per second, 0 for no limit */
+    uint64_t rate = 0;
+    /* Bytes that may go at once after being idle, 0 for a quarter second at rate */
+    uint64_t burst = 0;
+};
+
+/* The limits of one direction */
+struct rate_limits_t
+{
+    /* All friends together */
+    rate_limit_t total{};
+    /* Each friend, unless set for the friend at runtime */
+    rate_limit_t per_friend{};
+    /* Each file, unless set for the file at runtime */
+    rate_limit_t per_file{};
 };
 
 struct file_chunk_request_t
@@ -73,7 +141,8 @@ struct file_chunk_request_t
 struct file_chunk_t
 {
     uint64_t position;
-    buffer_t data;
+    /* A chain so data can be sent straight from the blocks it was read into */
+    buffer_chain_t data;
 };
 
 } // namespace toxfs::tox
@@ -26,19 +26,58 @@
 #include "toxfs/tox/tox_types.hh"
 #include "toxfs/tox/tox_if.hh"
 
+#include <cstdint>
 #include <memory>
 #include <filesystem>
+#include <string>
+#include <vector>
 
 namespace toxfs::tox
 {
 
+struct bootstrap_node_t
+{
+    std::string host;
+    uint16_t port;
+    /* The DHT key of the node, in hex */
+    std::string key;
+};
+
 struct tox_config_t
 {
     address_t local_address{};
     std::filesystem::path root_dir{};
+    /* Save file of the first instance, the others add .1, .2 and so on */
     std::filesystem::path save_file{};
+    /*
+     * Number of Tox instances, each with its own identity, thread and save
+     * file, so toxcore's work is spread over that many cores. Friends are
+     * served by the instance they added. The total rate limits are split
+     * evenly and statically, an instance can only use its own part.
+     */
+    unsigned instances{1};
+    /*
+     * For peers on the same network or host: local discovery is on and the
+     * public bootstrap nodes are not used, only bootstrap_nodes
+     */
+    bool lan_mode{false};
+    /* UDP ports to bind, 0 for toxcore's defaults. Local discovery only looks at 33445 to 33545 */
+    uint16_t udp_start_port{0};
+    uint16_t udp_end_port{0};
+    /* Use the bootstrap nodes as TCP relays too, for networks that block UDP, ignored in LAN mode */
+    bool tcp_relays{false};
+    /* Bootstrapped from as well as the public nodes, such as the other peers in LAN mode */
+    std::vector<bootstrap_node_t> bootstrap_nodes{};
+    /* Chunks toxcore asks for are read from files being sent in blocks of this size */
+    size_t chunk_block_size{256u << 10u};
+    /* Bandwidth of files being sent, can be changed at runtime through tox_if */
+    rate_limits_t upload_limits{};
+    /* Bandwidth of files being received, can be changed at runtime through tox_if */
+    rate_limits_t download_limits{};
 };
 
+class tox_if_impl;
+
 class tox_t : public std::enable_shared_from_this<tox_t>
 {
 public:
@@ -59,7 +98,8 @@ public:
 
     struct impl_t;
 private:
-    std::unique_ptr<impl_t> impl_;
+    std::shared_ptr<tox_if_impl> if_impl_;
+    std::vector<std::unique_ptr<impl_t>> instances_;
 };
 
 } // namespace toxfs::tox
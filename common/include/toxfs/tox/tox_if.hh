@@ -21,8 +21,12 @@
 
 #include "toxfs/tox/tox_types.hh"
 #include "toxfs/tox/file_types.hh"
+#include "toxfs/tox/tox_error.hh"
 
+#include <functional>
 #include <future>
+#include <optional>
+#include <vector>
 
 namespace toxfs::tox
 {
@@ -60,9 +64,10 @@ public:
     virtual void on_tox_file_control(unique_file_id_t id, file_control_t control) noexcept = 0;
 
     /**
-     * @brief callback for file chunk requests
+     * @brief callback for file chunk requests, for files being sent these
+     *        cover many toxcore chunks and may go past the end of the file
      * @param[in] id - the file id
-     * @param[in] request - the chunk request
+     * @param[in] request - the chunk request, a size of 0 when the file is done
      */
     virtual void on_tox_file_chunk_request(unique_file_id_t id, file_chunk_request_t request) noexcept = 0;
 
@@ -81,6 +86,32 @@ public:
     virtual void on_tox_file_error(unique_file_id_t id, tox_error err) noexcept = 0;
 };
 
+class packet_callback_if
+{
+public:
+    virtual ~packet_callback_if() noexcept = default;
+
+    /**
+     * @brief callback for a custom lossless packet received from a friend
+     * @param[in] id - the friend
+     * @param[in] packet - the packet, including its id byte
+     */
+    virtual void on_tox_lossless_packet(friend_id_t id, std::vector<std::byte> packet) noexcept = 0;
+
+    /**
+     * @brief callback for a lossless packet that could not be sent
+     * @param[in] id - the friend
+     * @param[in] packet - the packet
+     * @param[in] err - the error
+     */
+    virtual void on_tox_lossless_packet_error(friend_id_t id, std::vector<std::byte> packet, tox_error err) noexcept = 0;
+};
+
+/**
+ * Called with the ready result of an asynchronous send_file
+ */
+using file_send_callback_t = std::function<void(std::future<unique_file_id_t>)>;
+
 /**
  * Interface for tox
  */
@@ -95,7 +126,7 @@ public:
      */
     virtual std::future<connection_t> get_connection_status() = 0;
 
-    /* TEMPORARY */
+    /* TEMPORARY, only ever called from one thread */
     virtual friend_message_t get_message() = 0;
 
     virtual std::future<message_id_t> send_message(friend_id_t id, std::string message) = 0;
@@ -124,6 +155,26 @@ public:
      */
     virtual void unregister_file_callback_if(file_callback_if& file_if) = 0;
 
+    /**
+     * @brief register the packet callback if
+     * @param[in] packet_if - the packet callback if
+     */
+    virtual void register_packet_callback_if(packet_callback_if& packet_if) = 0;
+
+    /**
+     * @brief unregister the packet callback if
+     * @param[in] packet_if - the packet callback if
+     */
+    virtual void unregister_packet_callback_if(packet_callback_if& packet_if) = 0;
+
+    /**
+     * @brief send a custom lossless packet, failures go to the packet callback if
+     * @param[in] id - the friend to send to
+     * @param[in] packet - the packet, its first byte in the range of k_lossless_packet_id_min
+     *                     to k_lossless_packet_id_max and at most k_max_lossless_packet_size long
+     */
+    virtual void send_lossless_packet(friend_id_t id, std::vector<std::byte> packet) = 0;
+
     /**
      * @brief send a file
      * @param[in] fr_id - friend to send to
@@ -132,6 +183,14 @@ public:
      */
     virtual std::future<unique_file_id_t> send_file(friend_id_t fr_id, file_info_t file) = 0;
 
+    /**
+     * @brief send a file without waiting for the file id
+     * @param[in] fr_id - friend to send to
+     * @param[in] info - info on the file to send
+     * @param[in] callback - called on the interface's message thread once the file id is known
+     */
+    virtual void send_file(friend_id_t fr_id, file_info_t file, file_send_callback_t callback) = 0;
+
     /**
      * @brief send a file control
      * @param[in] id - the file id
@@ -140,9 +199,65 @@ public:
     virtual void send_file_control(unique_file_id_t id, file_control_t control) = 0;
 
     /**
-     * @brief send a file chunk
+     * @brief skip the start of a file being received, only before it is resumed the first time
+     * @param[in] id - the file id
+     * @param[in] position - the position to receive from
+     */
+    virtual void send_file_seek(unique_file_id_t id, uint64_t position) = 0;
+
+    /**
+     * @brief get the congestion state of a file being sent
+     * @param[in] id - the file id
+     * @return the state, none if the file is not being sent
+     */
+    virtual std::future<std::optional<chunk_window_state_t>> get_chunk_window(unique_file_id_t id) = 0;
+
+    /**
+     * @brief set the share of outgoing file data a friend gets relative to other friends
+     * @param[in] id - the friend
+     * @param[in] weight - the weight, 1 by default
+     */
+    virtual void set_friend_weight(friend_id_t id, unsigned weight) = 0;
+
+    /**
+     * @brief set the share a file being sent gets relative to other files to the same friend
+     * @param[in] id - the file id
+     * @param[in] weight - the weight, 1 by default
+     */
+    virtual void set_file_weight(unique_file_id_t id, unsigned weight) = 0;
+
+    /**
+     * @brief get the weights and the data scheduled for every friend and file being sent
+     */
+    virtual std::future<std::vector<friend_share_t>> get_shares() = 0;
+
+    /**
+     * @brief limit the bandwidth of all friends together, with several instances
+     *        each gets a fixed even part of it
+     * @param[in] direction - sending or receiving
+     * @param[in] limit - the limit, a rate of 0 removes it
+     */
+    virtual void set_rate_limit(transfer_direction_t direction, rate_limit_t limit) = 0;
+
+    /**
+     * @brief limit the bandwidth of one friend
+     * @param[in] id - the friend
+     * @param[in] direction - sending or receiving
+     * @param[in] limit - the limit, a rate of 0 removes it
+     */
+    virtual void set_friend_rate_limit(friend_id_t id, transfer_direction_t direction, rate_limit_t limit) = 0;
+
+    /**
+     * @brief limit the bandwidth of one file being sent or received
+     * @param[in] id - the file id
+     * @param[in] limit - the limit, a rate of 0 removes it
+     */
+    virtual void set_file_rate_limit(unique_file_id_t id, rate_limit_t limit) = 0;
+
+    /**
+     * @brief send a file chunk in answer to a chunk request
      * @param[in] id - the file id
-     * @param[in] chunk - the file chunk
+     * @param[in] chunk - the file chunk, short or empty at the end of the file
      */
     virtual void send_file_chunk(unique_file_id_t id, file_chunk_t chunk) = 0;
 };
@@ -32,6 +32,11 @@ constexpr size_t k_nospam_size = 4;
 constexpr size_t k_checksum_size = 2;
 constexpr size_t k_address_size = k_public_key_size + k_nospam_size + k_checksum_size;
 
+/* Largest custom lossless packet, its first byte has to be in the range toxcore leaves to applications */
+constexpr size_t k_max_lossless_packet_size = 1373;
+constexpr std::byte k_lossless_packet_id_min{160};
+constexpr std::byte k_lossless_packet_id_max{191};
+
 using public_key_t = std::array<std::byte, k_public_key_size>;
 using nospam_t = std::array<std::byte, k_nospam_size>;
 using checksum_t = std::array<std::byte, k_checksum_size>;
@@ -0,0 +1,122 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "toxfs/io/file.hh"
+#include "toxfs/tox/file_types.hh"
+#include "toxfs/util/chunked_progress.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+namespace toxfs::transfer
+{
+
+/**
+ * A persistent record of which ranges of a received file are on disk, so an
+ * interrupted transfer can carry on where it stopped.
+ *
+ * The journal is a header (file hash and size) followed by appended ranges.
+ * Ranges are buffered in memory and only appended by commit(), which first
+ * syncs the data file so the journal never claims data that is not on disk.
+ * Once enough appends pile up the journal is rewritten from the merged ranges.
+ *
+ * Nothing is written until the first commit, so the journal can be created
+ * on one thread and then only used from another that may block on the disk.
+ */
+class transfer_journal_t
+{
+public:
+    /**
+     * @brief get the path of the journal kept for a file
+     */
+    static std::filesystem::path path_for(std::filesystem::path const& file);
+
+    /**
+     * @brief check if a path is a journal or a journal being rewritten
+     */
+    static bool is_journal(std::filesystem::path const& path);
+
+    /**
+     * @brief read the progress from an existing journal
+     * @param[in] path - the journal path
+     * @param[in] hash - the hash of the file, must match the journal
+     * @param[in] filesize - the size of the file, must match the journal
+     * @return the progress, none if there is no matching journal
+     */
+    static std::optional<chunked_progress> load(std::filesystem::path const& path,
+            tox::file_hash_t const& hash, uint64_t filesize) noexcept;
+
+    /**
+     * @brief ctor, the journal is written from scratch by the first commit
+     * @param[in] path - the journal path
+     * @param[in] hash - the hash of the file
+     * @param[in] filesize - the size of the file
+     */
+    transfer_journal_t(std::filesystem::path path, tox::file_hash_t const& hash, uint64_t filesize);
+
+    transfer_journal_t(transfer_journal_t const&) = delete;
+    transfer_journal_t& operator=(transfer_journal_t const&) = delete;
+
+    /**
+     * @brief buffer a range that has been written to the data file
+     * @param[in] pos - the position
+     * @param[in] size - the length
+     */
+    void record(uint64_t pos, uint64_t size);
+
+    /**
+     * @brief check if there are buffered ranges to commit
+     */
+    bool pending() const noexcept { return !pending_.empty(); }
+
+    /**
+     * @brief sync the data file and append the buffered ranges
+     * @param[in] data - the data file
+     * @param[in] progress - the current progress, used if the journal is rewritten
+     * @param[in] sync_data - false to leave flushing the data file to the kernel,
+     *                        the journal then only survives a crash of the process
+     * @throws on error
+     */
+    void commit(io::file_t const& data, chunked_progress const& progress, bool sync_data = true);
+
+    /**
+     * @brief delete the journal, once the file is complete
+     */
+    void remove() noexcept;
+
+private:
+    void rewrite_(chunked_progress const& progress);
+
+    std::filesystem::path path_;
+    tox::file_hash_t hash_;
+    uint64_t filesize_;
+    io::file_t file_{};
+    /* Where the next record goes */
+    uint64_t end_ = 0;
+    /* Records in the journal */
+    size_t records_ = 0;
+    std::vector<byte_range_t> pending_{};
+};
+
+} // namespace toxfs::transfer
@@ -17,43 +17,147 @@
  * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#pragma once
+
 #include "toxfs/tox/tox_if.hh"
 #include "toxfs/util/message_queue.hh"
+#include "toxfs/util/wakeup.hh"
 #include "toxfs/util/chunked_progress.hh"
+#include "toxfs/io/file.hh"
+#include "toxfs/io/io_engine.hh"
+#include "toxfs/io/mapped_file.hh"
+#include "toxfs/io/read_ahead.hh"
+#include "toxfs/io/write_behind.hh"
+#include "toxfs/transfer/journal.hh"
 
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <future>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <thread>
 #include <functional>
-#include <fstream>
 #include <string_view>
 
 namespace toxfs::transfer
 {
 
+struct transfer_config_t
+{
+    /* The directory files are served from and saved to */
+    std::filesystem::path root_dir{};
+    /* The engine used for disk reads and writes, falls back to sync if unavailable */
+    io::io_engine_type_t io_engine{io::io_engine_type_t::uring};
+    /* Maximum number of disk requests submitted at once */
+    unsigned io_queue_depth{128};
+    /* Send files by mapping them instead of reading them */
+    bool mmap_send{true};
+    /* Only files at least this big are mapped */
+    uint64_t mmap_min_size{4u << 20u};
+    /* Read ahead for sends that are not mapped */
+    io::read_ahead_config_t read_ahead{};
+    /* Write behind for received files */
+    io::write_behind_config_t write_behind{};
+    /* Reserve the disk space of received files up front, files are still received if it fails */
+    bool preallocate{true};
+    /*
+     * Keep a journal of received files so interrupted transfers can be resumed,
+     * only for files offered by a toxfs sender as only those keep their id when
+     * offered again
+     */
+    bool resume{true};
+    /*
+     * How often journals are brought up to date, on a thread of their own. Each
+     * time syncs the file, unless write_behind.durability is none
+     */
+    std::chrono::milliseconds journal_interval{2000};
+    /* Number of transfer worker threads, 0 for one per core */
+    unsigned worker_threads{0};
+    /* Files of one send_path that may be starting or sending at once, toxcore allows 256 per friend */
+    unsigned send_max_outstanding{32};
+};
+
+struct send_status_t
+{
+    /* Files found so far */
+    uint64_t files_found = 0;
+    /* Files the friend has been offered */
+    uint64_t files_started = 0;
+    /* Files sent completely */
+    uint64_t files_done = 0;
+    /* Files that could not be sent or were cancelled */
+    uint64_t files_failed = 0;
+    /* No more files will be found or sent */
+    bool done = false;
+};
+
+/**
+ * A handle to a send_path in progress, can be copied and outlive the send
+ */
+class send_handle_t
+{
+public:
+    send_handle_t() = default;
+
+    /**
+     * @brief get a snapshot of the progress of the send
+     */
+    send_status_t status() const noexcept;
+
+    /**
+     * @brief stop sending, files in progress are cancelled
+     */
+    void cancel() noexcept;
+
+private:
+    friend class transfer_ctrl;
+
+    struct state_t
+    {
+        std::atomic<uint64_t> files_found{0};
+        std::atomic<uint64_t> files_started{0};
+        std::atomic<uint64_t> files_done{0};
+        std::atomic<uint64_t> files_failed{0};
+        std::atomic<bool> done{false};
+        std::atomic<bool> cancel{false};
+    };
+
+    explicit send_handle_t(std::shared_ptr<state_t> state) noexcept
+        : state_(std::move(state))
+    {}
+
+    std::shared_ptr<state_t> state_;
+};
+
 class transfer_ctrl : public tox::file_callback_if
 {
 public:
     /**
      * @brief ctor
      * @param[in] tox_if - tox_if
-     * @param[in] root_dir - the root directory
+     * @param[in] config - the transfer config
      */
     transfer_ctrl(
         std::shared_ptr<tox::tox_if> tox_if,
-        std::filesystem::path root_dir);
+        transfer_config_t config);
 
     ~transfer_ctrl() noexcept override;
 
     /**
-     * @brief send a file or directory of files to a friend
+     * @brief send a file or directory of files to a friend, returns without
+     *        waiting for the files to be found or offered
      * @param[in] fr_id - the friend id to send to
      * @param[in] filepath - the file/dir to send
-     * @return TODO
+     * @return a handle to follow or cancel the send
+     * @throws if the path cannot be sent
      */
-    void send_path(tox::friend_id_t fr_id, std::string_view path_str);
+    send_handle_t send_path(tox::friend_id_t fr_id, std::string_view path_str);
 
 private:
 
@@ -71,8 +175,6 @@ private:
 
     /* END tox::file_callback_if */
 
-    void work_thread_run_() noexcept;
-
     // TODO: these are probably be moved outside
     enum transfer_type_t
     {
@@ -83,21 +185,194 @@ private:
     struct transfer_t
     {
         transfer_type_t transfer_type;
-        std::fstream stream;
-        std::fstream::pos_type lastPos = 0u;
+        std::shared_ptr<io::file_t const> file;
+        /* Set when sending straight from a mapping of the file */
+        std::shared_ptr<io::mapped_file_t> mapping;
+        /* Set when sending through read ahead */
+        std::shared_ptr<io::read_ahead_t> read_ahead;
+        /* Set when receiving through write behind */
+        std::shared_ptr<io::write_behind_t> write_behind;
+        /* Writes submitted without write behind that have not completed */
+        unsigned writes_in_flight = 0;
+        /* All data has been received, completes once it is written */
+        bool finishing = false;
         chunked_progress progress;
         bool active = false;
+        /* The send job this transfer belongs to, 0 for none */
+        uint64_t send_job = 0;
+        /* Set when receiving with resume enabled, only used on the journal thread */
+        std::shared_ptr<transfer_journal_t> journal;
+        /* Ranges written since the journal was last committed */
+        std::vector<byte_range_t> journal_pending{};
+        std::chrono::steady_clock::time_point journal_commit{};
 
-        transfer_t(transfer_type_t t, std::filesystem::path const& path, uint64_t filesize);
+        transfer_t(transfer_type_t t, std::filesystem::path const& path, uint64_t filesize, io::open_mode_t mode);
     };
 
-    std::shared_ptr<tox::tox_if> tox_if_;
-    std::filesystem::path root_dir_;
-    std::unordered_map<tox::unique_file_id_t, transfer_t> transfers_;
+    struct send_job_t
+    {
+        tox::friend_id_t fr_id;
+        std::shared_ptr<send_handle_t::state_t> state;
+        /* The file to send when sending a single file */
+        std::optional<std::filesystem::path> file{};
+        /* Walks the directory when sending a directory */
+        std::filesystem::recursive_directory_iterator dir_it{};
+        /* Files offered or being offered that have not finished */
+        unsigned outstanding = 0;
+        bool cancelled = false;
+        /* Transfers of this job that are in progress, they live on other shards */
+        std::unordered_set<tox::unique_file_id_t> transfers{};
+    };
+
+    using transfer_map_t = std::unordered_map<tox::unique_file_id_t, transfer_t>;
+
+    /**
+     * A worker thread and the state only it touches. Each transfer lives on
+     * the shard picked by the hash of its id, so all work on one transfer
+     * runs in order on one thread and shards never share a lock.
+     */
+    struct shard_t
+    {
+        /* Work from the tox_if dispatcher, the only thread that may block on it */
+        message_queue<std::function<void()>, 256> queue{};
+        /* Work posted by every other thread, which must not block on queue */
+        locked_queue<std::function<void()>> mailbox{};
+        /* The thread sleeps on this until queue or mailbox have work or a tick is due */
+        wakeup_t wakeup{};
+        transfer_map_t transfers{};
+        std::unordered_map<uint64_t, send_job_t> send_jobs{};
+        std::thread thread{};
+    };
+
+    void shard_run_(shard_t& shard) noexcept;
+
+    /**
+     * @brief get the shard a transfer lives on
+     */
+    shard_t& shard_for_(tox::unique_file_id_t id) noexcept;
+
+    /**
+     * @brief get the shard a send job lives on
+     */
+    shard_t& job_shard_(uint64_t job_id) noexcept;
+
+    /**
+     * @brief periodic housekeeping, run on the shard's thread
+     */
+    void tick_(shard_t& shard);
+
+    /**
+     * @brief run a function on a shard's thread, inline if already on it
+     *        and otherwise without blocking
+     */
+    void run_on_shard_(shard_t& shard, std::function<void()> func);
 
-    // TODO: proper multi-threading
-    message_queue<std::function<void()>, 256> work_queue_;
-    std::thread work_thread_;
+    /**
+     * @brief record completed I/O of a transfer, must be on the shard's thread
+     */
+    void update_progress_(shard_t& shard, tox::unique_file_id_t id, uint64_t pos, uint64_t size);
+
+    /**
+     * @brief handle a completed write of a receive without write behind
+     */
+    void on_recv_written_(shard_t& shard, tox::unique_file_id_t id, uint64_t pos, uint64_t size, int error);
+
+    /**
+     * @brief complete a receive once all of its data is written
+     * @param[in] error - the errno of the first write that failed, 0 if none did
+     */
+    void finish_recv_(shard_t& shard, tox::unique_file_id_t id, int error);
+
+    /**
+     * @brief cancel a receive after a write failed, its journal keeps what was written
+     */
+    void fail_recv_(shard_t& shard, tox::unique_file_id_t id, int error);
+
+    /**
+     * @brief bring the journal of a transfer up to date on the journal thread
+     */
+    void commit_journal_(transfer_t& tr);
+
+    /**
+     * @brief delete the journal of a transfer on the journal thread, once
+     *        the file is complete or the sender gave up on it
+     */
+    void remove_journal_(transfer_t& tr);
+
+    /**
+     * @brief run a function on the journal thread, after everything posted before
+     */
+    void run_on_journal_(std::function<void()> func);
+
+    void journal_run_() noexcept;
+
+    /**
+     * @brief remove a transfer and let its send job move on
+     * @param[in] shard - the shard of the transfer
+     * @param[in] it - the transfer
+     * @param[in] completed - true if the file was transferred completely
+     */
+    void erase_transfer_(shard_t& shard, transfer_map_t::iterator it, bool completed);
+
+    /**
+     * @brief open a received file and accept it, run on the shard of the transfer
+     *        once no other transfer receives the same path
+     */
+    void start_recv_(shard_t& shard, tox::unique_file_id_t id, std::filesystem::path const& path,
+            uint64_t filesize, tox::file_hash_t const& hash);
+
+    /**
+     * @brief unregister the path of a received file, unless a newer transfer took it over
+     */
+    void forget_recv_path_(std::filesystem::path const& path, tox::unique_file_id_t id);
+
+    /**
+     * @brief offer more files of a send job until it has enough outstanding
+     */
+    void pump_send_job_(shard_t& shard, uint64_t job_id);
+
+    /**
+     * @brief get the next file of a send job to offer
+     */
+    std::optional<std::filesystem::path> next_send_file_(send_job_t& job);
+
+    /**
+     * @brief register a file of a send job once tox has given it an id,
+     *        run on the shard of the transfer
+     */
+    void on_file_send_started_(uint64_t job_id, std::shared_ptr<send_handle_t::state_t> const& state,
+            std::filesystem::path const& path, uint64_t filesize, tox::unique_file_id_t id);
+
+    /**
+     * @brief record that a file of a send job is sending, run on the job's shard
+     */
+    void send_job_file_started_(shard_t& shard, uint64_t job_id, tox::unique_file_id_t id);
+
+    /**
+     * @brief record that a file of a send job is no longer outstanding, run on the job's shard
+     * @param[in] id - the transfer, none if the file never got one
+     * @param[in] completed - true if the file was sent completely
+     */
+    void send_job_file_finished_(shard_t& shard, uint64_t job_id,
+            std::optional<tox::unique_file_id_t> id, bool completed);
+
+    /**
+     * @brief stop the files of send jobs that have been cancelled
+     */
+    void check_send_jobs_cancelled_(shard_t& shard);
+
+    std::shared_ptr<tox::tox_if> tox_if_;
+    transfer_config_t config_;
+    std::unique_ptr<io::io_engine_t> io_engine_;
+    std::atomic<uint64_t> next_send_job_{1};
+    std::vector<std::unique_ptr<shard_t>> shards_;
+    /* The transfer receiving each path, shared by all shards */
+    std::mutex recv_paths_mutex_;
+    std::unordered_map<std::string, tox::unique_file_id_t> recv_paths_;
+    /* Journal commits sync data files, so they run here rather than on the shards */
+    locked_queue<std::function<void()>> journal_queue_{};
+    wakeup_t journal_wakeup_{};
+    std::thread journal_thread_;
 };
 
 } // namespace toxfs::transfer
@@ -17,6 +17,10 @@
  * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#pragma once
+
+#include "toxfs/util/buffer_pool.hh"
+
 #include <memory>
 
 namespace toxfs
@@ -30,16 +34,30 @@ class buffer_t
 {
 public:
     /**
-     * @brief ctor
+     * @brief ctor, the memory comes from buffer_pool_t
      * @param[in] capacity - the capacity of the buffer
      */
     explicit buffer_t(size_t capacity)
-        // TODO: make_shared is more efficient but only works with arrays in C++20
-        : buffer_(capacity > 0 ? new std::byte[capacity] : nullptr)
+        : buffer_(capacity > 0 ? buffer_pool_t::instance().make_shared(capacity) : nullptr)
         , size_(0)
         , capacity_(capacity)
     {}
 
+    /**
+     * @brief ctor, a view of memory owned by something else
+     * @param[in] owner - kept alive for as long as the view (or a copy of it) is
+     * @param[in] data - the start of the memory
+     * @param[in] size - the size of the memory, also used as the capacity
+     * @param[in] mapped - true for a view of a file mapping, which must only be
+     *                     read through mapped_file_t::guarded_copy
+     */
+    buffer_t(std::shared_ptr<void const> const& owner, std::byte* data, size_t size, bool mapped = false) noexcept
+        : buffer_(owner, data)
+        , size_(size)
+        , capacity_(size)
+        , mapped_(mapped)
+    {}
+
     ~buffer_t() noexcept = default;
 
     buffer_t(buffer_t const&) = default;
@@ -62,10 +80,27 @@ public:
 
     size_t set_size(size_t s) noexcept { return size_ = s; }
 
+    /**
+     * @brief check if this is a view of a file mapping, which may fault on access
+     */
+    bool mapped() const noexcept { return mapped_; }
+
+    /**
+     * @brief get a view of part of the buffer that shares ownership of it
+     * @param[in] offset - the start of the view
+     * @param[in] size - the size of the view
+     * @return the view
+     */
+    buffer_t slice(size_t offset, size_t size) const noexcept
+    {
+        return buffer_t{buffer_, buffer_.get() + offset, size, mapped_};
+    }
+
 private:
     std::shared_ptr<std::byte[]> buffer_;
     size_t size_;
     size_t capacity_;
+    bool mapped_ = false;
 };
 
 } // namespace toxfs
@@ -0,0 +1,103 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "toxfs/util/buffer.hh"
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <vector>
+
+namespace toxfs
+{
+
+/**
+ * A sequence of bytes made of views of buffers, back to back.
+ *
+ * Each segment shares ownership of the memory it views, so chains can be
+ * cut and joined without copying and handed to writev as they are.
+ */
+class buffer_chain_t
+{
+public:
+    buffer_chain_t() = default;
+
+    /**
+     * @brief ctor, a chain of one buffer
+     * @param[in] buffer - the buffer, its size is used
+     */
+    explicit buffer_chain_t(buffer_t buffer);
+
+    /**
+     * @brief add a buffer to the end, empty buffers are skipped
+     * @param[in] buffer - the buffer, its size is used
+     */
+    void append(buffer_t buffer);
+
+    /**
+     * @brief add all segments of another chain to the end
+     * @param[in] chain - the chain
+     */
+    void append(buffer_chain_t chain);
+
+    /**
+     * @brief get the total number of bytes
+     */
+    size_t size() const noexcept { return size_; }
+
+    bool empty() const noexcept { return size_ == 0; }
+
+    /**
+     * @brief get the segments, none of them are empty
+     */
+    std::vector<buffer_t> const& segments() const noexcept { return segments_; }
+
+    /**
+     * @brief get a chain of part of this one that shares ownership of it
+     * @param[in] offset - the start of the part
+     * @param[in] size - the size of the part, offset + size must not be past the end
+     * @return the part
+     */
+    buffer_chain_t slice(size_t offset, size_t size) const;
+
+    /**
+     * @brief get an iovec for each segment, valid as long as the chain is
+     */
+    std::vector<iovec> iovecs() const;
+
+    /**
+     * @brief copy all bytes to memory of at least size() bytes
+     * @param[in] out - where to copy to
+     */
+    void copy_to(std::byte *out) const noexcept;
+
+    /**
+     * @brief get the bytes as one buffer, copied only if there is more than one segment
+     */
+    buffer_t flatten() const;
+
+private:
+    std::vector<buffer_t> segments_{};
+    size_t size_ = 0;
+};
+
+} // namespace toxfs
@@ -0,0 +1,196 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace toxfs
+{
+
+struct buffer_pool_config_t
+{
+    /* Free memory all threads together keep for reuse, beyond it memory is freed */
+    size_t max_cached_bytes{64u << 20u};
+    /* Free memory each thread keeps for itself per size, at least 2 buffers */
+    size_t thread_cache_bytes{1u << 20u};
+    /* Carve the sizes of bulk transfers from slabs on huge pages, which are never freed */
+    bool huge_pages{false};
+};
+
+struct buffer_pool_stats_t
+{
+    /* Allocations served with memory that was freed before */
+    uint64_t hits = 0;
+    /* Allocations that needed new memory, including those too large to pool */
+    uint64_t misses = 0;
+    /* Free memory in the shared cache, not counting the caches of threads or slabs */
+    uint64_t cached_bytes = 0;
+    /* Memory taken for huge page slabs, in use or free */
+    uint64_t slab_bytes = 0;
+};
+
+/**
+ * Recycles the memory of buffers, so moving millions of chunks does not
+ * churn malloc.
+ *
+ * Sizes are rounded up to a power of 2 size class. Every thread keeps some
+ * free buffers of each class for itself, and moves half of them at a time
+ * to or from a shared cache when it has too many or none.
+ */
+class buffer_pool_t
+{
+public:
+    /* The smallest and largest pooled sizes, larger ones go straight to the allocator */
+    static constexpr size_t k_min_class_shift = 6;
+    static constexpr size_t k_max_class_shift = 20;
+    static constexpr size_t k_num_classes = k_max_class_shift - k_min_class_shift + 1;
+
+    /**
+     * @brief get the pool, it lives until the process exits
+     */
+    static buffer_pool_t& instance() noexcept;
+
+    /**
+     * @brief change the config, only before the first allocation
+     */
+    void configure(buffer_pool_config_t config) noexcept;
+
+    /**
+     * @brief get a snapshot of the statistics
+     */
+    buffer_pool_stats_t stats() const noexcept;
+
+    /**
+     * @brief get memory of at least size bytes
+     * @param[in] size - the size, not 0
+     */
+    std::byte* allocate(size_t size);
+
+    /**
+     * @brief give back memory from allocate
+     * @param[in] p - the memory
+     * @param[in] size - the size it was allocated with
+     */
+    void deallocate(std::byte *p, size_t size) noexcept;
+
+    /**
+     * @brief allocate a shared array, its control block comes from the pool as well
+     * @param[in] size - the size, not 0
+     */
+    std::shared_ptr<std::byte[]> make_shared(size_t size);
+
+    buffer_pool_t(buffer_pool_t const&) = delete;
+    buffer_pool_t& operator=(buffer_pool_t const&) = delete;
+
+private:
+    friend struct thread_cache_t;
+
+    buffer_pool_t() = default;
+
+    struct size_class_t
+    {
+        std::mutex mutex{};
+        std::vector<std::byte*> free{};
+        /* Buffers carved from slabs, free has room for all of them so they are never dropped */
+        size_t slab_buffers = 0;
+    };
+
+    /**
+     * @brief get the class of a size, k_num_classes if too large
+     */
+    static size_t class_of_(size_t size) noexcept;
+
+    static constexpr size_t class_size_(size_t cls) noexcept
+    {
+        return size_t{1} << (cls + k_min_class_shift);
+    }
+
+    /**
+     * @brief the most free buffers of a class a thread keeps
+     */
+    size_t thread_cache_count_(size_t cls) const noexcept;
+
+    /**
+     * @brief true if a class is carved from huge page slabs
+     */
+    bool from_slab_(size_t cls) const noexcept;
+
+    /**
+     * @brief get new memory for a class
+     */
+    std::byte* allocate_new_(size_t cls);
+
+    /**
+     * @brief move free buffers into the shared cache, freeing what does not fit,
+     *        slab buffers always fit
+     */
+    void release_(size_t cls, std::byte **first, size_t count) noexcept;
+
+    /**
+     * @brief take up to count free buffers from the shared cache
+     * @return the number taken
+     */
+    size_t acquire_(size_t cls, std::byte **out, size_t count) noexcept;
+
+    buffer_pool_config_t config_{};
+    size_class_t classes_[k_num_classes];
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> cached_bytes_{0};
+    std::atomic<uint64_t> slab_bytes_{0};
+};
+
+/**
+ * An allocator on top of buffer_pool_t, for the control blocks of shared_ptr
+ */
+template<class T>
+struct pool_allocator_t
+{
+    using value_type = T;
+
+    pool_allocator_t() noexcept = default;
+
+    template<class U>
+    pool_allocator_t(pool_allocator_t<U> const&) noexcept {}
+
+    T* allocate(size_t n)
+    {
+        return reinterpret_cast<T*>(buffer_pool_t::instance().allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n) noexcept
+    {
+        buffer_pool_t::instance().deallocate(reinterpret_cast<std::byte*>(p), n * sizeof(T));
+    }
+
+    template<class U>
+    bool operator==(pool_allocator_t<U> const&) const noexcept { return true; }
+
+    template<class U>
+    bool operator!=(pool_allocator_t<U> const&) const noexcept { return false; }
+};
+
+} // namespace toxfs
@@ -17,16 +17,27 @@
  * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#pragma once
+
 #include <cstdint>
-#include <array>
+#include <map>
+#include <optional>
+#include <vector>
 
 namespace toxfs
 {
 
+struct byte_range_t
+{
+    uint64_t pos;
+    uint64_t size;
+};
+
 /**
  * A class that tracks the read/write progress of a finite sized contiguous piece of
- * data (usually a file). To a certain extent it can handle operations happening out of
- * linear order.
+ * data (usually a file). Operations can happen in any order, the exact set of byte
+ * ranges done is kept as a list of disjoint intervals, so memory only grows with the
+ * number of holes and not with the size of the data.
  */
 class chunked_progress
 {
@@ -34,7 +45,6 @@ public:
     /**
      * @brief ctor
      * @param[in] size - the total size of the data.
-     * @throws if size exceeds the maximum trackable size
      */
     explicit chunked_progress(uint64_t size);
 
@@ -45,14 +55,15 @@ public:
     chunked_progress& operator=(chunked_progress const& other) = default;
 
     /**
-     * @brief update the progress with a new read/write
+     * @brief update the progress with a new read/write, O(log n) plus the
+     *        number of ranges it merges
      * @param[in] pos - the position
      * @param[in] size - the length
      */
-    void update(uint64_t pos, uint64_t size) noexcept;
+    void update(uint64_t pos, uint64_t size);
 
     /**
-     * @brief returns the total
+     * @brief returns the number of bytes done
      */
     uint64_t progress() const noexcept;
 
@@ -61,11 +72,45 @@ public:
      */
     uint64_t total_size() const noexcept;
 
+    /**
+     * @brief returns the end of the range done from the start of the data
+     */
+    uint64_t contiguous() const noexcept;
+
+    /**
+     * @brief check if all of the data is done
+     */
+    bool complete() const noexcept { return done_ == size_; }
+
+    /**
+     * @brief check if a range is done, O(log n)
+     * @param[in] pos - the position
+     * @param[in] size - the length
+     */
+    bool contains(uint64_t pos, uint64_t size) const noexcept;
+
+    /**
+     * @brief find the first range not done at or after a position, O(log n)
+     * @param[in] pos - the position to search from
+     * @return the missing range, none if everything from pos is done
+     */
+    std::optional<byte_range_t> next_missing(uint64_t pos = 0) const noexcept;
+
+    /**
+     * @brief get all ranges not done
+     */
+    std::vector<byte_range_t> missing() const;
+
+    /**
+     * @brief get all ranges done, in order
+     */
+    std::vector<byte_range_t> ranges() const;
+
 private:
     uint64_t size_;
-    uint64_t pos_;
-    /* TODO: Implement out of order handling */
-    //std::array<int64_t, 7> progress_arr_;
+    uint64_t done_ = 0;
+    /* Start to end of each range done, ranges never overlap or touch */
+    std::map<uint64_t, uint64_t> ranges_{};
 };
 
 };
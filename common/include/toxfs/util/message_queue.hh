@@ -19,10 +19,13 @@
 
 #pragma once
 
+#include "toxfs/util/wakeup.hh"
+
 #include <queue>
 #include <mutex>
 #include <condition_variable>
 #include <optional>
+#include <vector>
 
 namespace toxfs
 {
@@ -98,6 +101,16 @@ class message_queue
 public:
     message_queue() = default;
 
+    /**
+     * @brief also notify a wakeup on every push, for a consumer that sleeps
+     *        on more than this queue. Must be set before anything is pushed.
+     * @param[in] wakeup - the wakeup, null for none
+     */
+    void set_wakeup(wakeup_t *wakeup) noexcept
+    {
+        wakeup_ = wakeup;
+    }
+
     /**
      * @brief check if empty, this is NOT thread safe as the queue
      *        could change after return
@@ -120,6 +133,7 @@ public:
         queue_.push(std::forward<T>(m));
         lock.unlock();
         cond_push_.notify_one();
+        notify_wakeup_();
     }
 
     /**
@@ -139,6 +153,7 @@ public:
         queue_.push(std::forward<T>(m));
         lock.unlock();
         cond_push_.notify_one();
+        notify_wakeup_();
         return true;
     }
 
@@ -159,9 +174,35 @@ public:
         queue_.push(std::forward<T>(m));
         lock.unlock();
         cond_push_.notify_one();
+        notify_wakeup_();
         return true;
     }
 
+    /**
+     * @brief push a run of items with one lock and one notify, waits while full
+     * @param[in] first - the first item, the items are moved from
+     * @param[in] last - the end of the items
+     */
+    template <class It>
+    void push_bulk(It first, It last)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (; first != last; ++first)
+        {
+            if (queue_.size() >= MaxSize)
+            {
+                // Full, wake the consumers so they make room
+                cond_push_.notify_all();
+                notify_wakeup_();
+                cond_pop_.wait(lock, [this]() { return queue_.size() < MaxSize; });
+            }
+            queue_.push(std::move(*first));
+        }
+        lock.unlock();
+        cond_push_.notify_all();
+        notify_wakeup_();
+    }
+
     /**
      * @brief get a new threadsafe off the queue
      * @return threadsafe
@@ -238,6 +279,65 @@ public:
         return ret;
     }
 
+    /**
+     * @brief move every item off the queue with one lock
+     * @param[out] out - the items are appended to it
+     * @return the number of items
+     */
+    size_t pop_all(std::vector<T>& out)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t const n = queue_.size();
+        for (; !queue_.empty(); queue_.pop())
+            out.push_back(std::move(queue_.front()));
+        lock.unlock();
+        if (n > 0)
+            cond_pop_.notify_all();
+        return n;
+    }
+
+    /**
+     * @brief move up to max items off the queue with one lock, without waiting
+     * @param[out] out - the items are appended to it
+     * @param[in] max - the most items to take
+     * @return the number of items
+     */
+    size_t try_pop_up_to(std::vector<T>& out, size_t max)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t n = 0;
+        for (; n < max && !queue_.empty(); n++, queue_.pop())
+            out.push_back(std::move(queue_.front()));
+        lock.unlock();
+        if (n > 0)
+            cond_pop_.notify_all();
+        return n;
+    }
+
+    /**
+     * @brief wait for items until a certain time, then move up to max of them
+     *        off the queue with one lock
+     * @param[out] out - the items are appended to it
+     * @param[in] max - the most items to take
+     * @param[in] timeout - the timeout time
+     * @return the number of items, 0 if timed out
+     */
+    template <class Clock, class Duration>
+    size_t pop_up_to(std::vector<T>& out, size_t max, std::chrono::time_point<Clock, Duration> const& timeout)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (max == 0 || !cond_push_.wait_until(lock, timeout, [this]() { return !queue_.empty(); }))
+        {
+            return 0;
+        }
+        size_t n = 0;
+        for (; n < max && !queue_.empty(); n++, queue_.pop())
+            out.push_back(std::move(queue_.front()));
+        lock.unlock();
+        cond_pop_.notify_all();
+        return n;
+    }
+
     // If ever needed these can be implemented, but I doubt it will...
     message_queue(message_queue const&) = delete;
     message_queue(message_queue &&) = delete;
@@ -246,10 +346,17 @@ public:
     message_queue& operator=(message_queue &&) = delete;
 
 private:
+    void notify_wakeup_() noexcept
+    {
+        if (wakeup_)
+            wakeup_->notify();
+    }
+
     mutable std::mutex mutex_{};
     mutable std::condition_variable cond_push_{};
     mutable std::condition_variable cond_pop_{};
     std::queue<T> queue_{};
+    wakeup_t *wakeup_ = nullptr;
 };
 
 } // namespace toxfs
@@ -0,0 +1,521 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "toxfs/util/wakeup.hh"
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace toxfs
+{
+
+namespace detail
+{
+
+/* Checks of a condition before a waiting thread goes to sleep */
+constexpr unsigned k_park_spin_count = 128;
+
+/**
+ * @brief the checks to do before sleeping, none on a single core where
+ *        spinning only keeps the thread being waited for from running
+ */
+inline unsigned park_spin_count() noexcept
+{
+    static unsigned const count = std::thread::hardware_concurrency() > 1 ? k_park_spin_count : 0;
+    return count;
+}
+
+inline void cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/**
+ * Lets threads sleep until a condition holds, without a lock on the fast
+ * path. Waiters spin for a bit, then register themselves and sleep on a
+ * condition variable (a futex on Linux). Notifying only takes the lock
+ * when someone has registered.
+ */
+class parking_lot_t
+{
+public:
+    /**
+     * @brief wait until pred returns true, pred may do the operation it checks for
+     * @param[in] pred - the condition
+     * @param[in] deadline - when to give up
+     * @return true if pred returned true, false if timed out
+     */
+    template<class Pred, class Clock, class Duration>
+    bool wait_until(Pred&& pred, std::chrono::time_point<Clock, Duration> const& deadline)
+    {
+        for (unsigned i = 0, spins = park_spin_count(); i < spins; i++)
+        {
+            if (pred())
+                return true;
+            cpu_relax();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool const ok = cond_.wait_until(lock, deadline, pred);
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+        return ok;
+    }
+
+    /**
+     * @brief wait until pred returns true, pred may do the operation it checks for
+     * @param[in] pred - the condition
+     */
+    template<class Pred>
+    void wait(Pred&& pred)
+    {
+        for (unsigned i = 0, spins = park_spin_count(); i < spins; i++)
+        {
+            if (pred())
+                return;
+            cpu_relax();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cond_.wait(lock, pred);
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief wake the waiters after the condition may have changed
+     */
+    void notify() noexcept
+    {
+        // Pairs with the fence of the waiters, either they see the change or we see them
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_relaxed) == 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        cond_.notify_all();
+    }
+
+private:
+    std::atomic<unsigned> waiters_{0};
+    std::mutex mutex_{};
+    std::condition_variable cond_{};
+};
+
+/* Keeps the indices of producers and consumers on separate cache lines */
+constexpr size_t k_cache_line_size = 64;
+
+} // namespace detail
+
+/**
+ * A bounded lock-free queue with one consumer, as a drop-in replacement of
+ * message_queue where the lock is the bottleneck.
+ *
+ * Items live in a ring of cells, each with a sequence number that says
+ * whether it is free or full for the current lap (D. Vyukov's bounded
+ * queue). Producers claim a cell by moving the head, so with several
+ * producers that is a CAS, and publish it by bumping the sequence. Blocked
+ * threads spin briefly before they sleep.
+ *
+ * Debug builds assert that only one thread pops, and for a single producer
+ * queue only one thread pushes.
+ *
+ * @tparam T - the item type
+ * @tparam Size - the capacity, a power of 2
+ * @tparam MultiProducer - false if only one thread ever pushes
+ */
+template<class T, std::size_t Size, bool MultiProducer>
+class ring_queue
+{
+    static_assert(Size >= 2 && (Size & (Size - 1)) == 0, "ring_queue size must be a power of 2");
+
+public:
+    ring_queue() noexcept
+    {
+        for (size_t i = 0; i < Size; i++)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ~ring_queue() noexcept
+    {
+        while (try_pop_()) {}
+    }
+
+    /**
+     * @brief also notify a wakeup on every push, for a consumer that sleeps
+     *        on more than this queue. Must be set before anything is pushed.
+     * @param[in] wakeup - the wakeup, null for none
+     */
+    void set_wakeup(wakeup_t *wakeup) noexcept
+    {
+        wakeup_ = wakeup;
+    }
+
+    /**
+     * @brief check if empty, this is NOT thread safe as the queue
+     *        could change after return
+     * @return true if the queue is empty
+     */
+    bool empty() const noexcept
+    {
+        auto const pos = tail_.load(std::memory_order_relaxed);
+        return cells_[pos & k_mask].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    /**
+     * @brief push an item onto the queue, waits while it is full
+     * @param[in] m - item
+     */
+    void push(T&& m)
+    {
+        check_producer_();
+        if (!try_push_(m))
+            not_full_.wait([&]() { return try_push_(m); });
+        notify_consumer_();
+    }
+
+    /**
+     * @brief push an item onto the queue
+     * @param[in] m - item
+     * @param[in] timeout - the timeout duration
+     * @return true if pushed, false if the queue stayed full
+     */
+    template <class Rep, class Period>
+    bool push_timeout(T&& m, std::chrono::duration<Rep, Period> const& timeout)
+    {
+        return push_until_time(std::move(m), std::chrono::steady_clock::now() + timeout);
+    }
+
+    /**
+     * @brief push an item onto the queue
+     * @param[in] m - item
+     * @param[in] timeout - the timeout time
+     * @return true if pushed, false if the queue stayed full
+     */
+    template <class Clock, class Duration>
+    bool push_until_time(T&& m, std::chrono::time_point<Clock, Duration> const& timeout)
+    {
+        check_producer_();
+        if (!try_push_(m) && !not_full_.wait_until([&]() { return try_push_(m); }, timeout))
+            return false;
+        notify_consumer_();
+        return true;
+    }
+
+    /**
+     * @brief push a run of items with one notify, waits while full
+     * @param[in] first - the first item, the items are moved from
+     * @param[in] last - the end of the items
+     */
+    template <class It>
+    void push_bulk(It first, It last)
+    {
+        check_producer_();
+        for (; first != last; ++first)
+        {
+            if (!try_push_(*first))
+            {
+                // Full, wake the consumer so it makes room
+                notify_consumer_();
+                not_full_.wait([&]() { return try_push_(*first); });
+            }
+        }
+        notify_consumer_();
+    }
+
+    /**
+     * @brief get an item off the queue, waits while it is empty
+     * @return the item
+     */
+    T pop()
+    {
+        check_consumer_();
+        std::optional<T> ret = try_pop_();
+        if (!ret)
+            not_empty_.wait([&]() { return (ret = try_pop_()).has_value(); });
+        not_full_.notify();
+        return std::move(*ret);
+    }
+
+    /**
+     * @brief try to get an item off the queue
+     * @return T if succeeded, none if queue is empty
+     */
+    std::optional<T> try_pop()
+    {
+        check_consumer_();
+        std::optional<T> ret = try_pop_();
+        if (ret)
+            not_full_.notify();
+        return ret;
+    }
+
+    /**
+     * @brief get an item off the queue with timeout
+     * @param[in] timeout - the timeout duration
+     * @return T if succeeded, none if timed out
+     */
+    template <class Rep, class Period>
+    std::optional<T> pop_timeout(std::chrono::duration<Rep, Period> const& timeout)
+    {
+        return pop_until_time(std::chrono::steady_clock::now() + timeout);
+    }
+
+    /**
+     * @brief get an item off the queue until a certain time
+     * @param[in] timeout - the timeout time
+     * @return T if succeeded, none if timed out
+     */
+    template <class Clock, class Duration>
+    std::optional<T> pop_until_time(std::chrono::time_point<Clock, Duration> const& timeout)
+    {
+        check_consumer_();
+        std::optional<T> ret = try_pop_();
+        if (!ret && !not_empty_.wait_until([&]() { return (ret = try_pop_()).has_value(); }, timeout))
+            return std::nullopt;
+        not_full_.notify();
+        return ret;
+    }
+
+    /**
+     * @brief move every item off the queue
+     * @param[out] out - the items are appended to it
+     * @return the number of items
+     */
+    size_t pop_all(std::vector<T>& out)
+    {
+        check_consumer_();
+        size_t n = 0;
+        for (auto item = try_pop_(); item; item = try_pop_(), n++)
+            out.push_back(std::move(*item));
+        if (n > 0)
+            not_full_.notify();
+        return n;
+    }
+
+    /**
+     * @brief move up to max items off the queue without waiting
+     * @param[out] out - the items are appended to it
+     * @param[in] max - the most items to take
+     * @return the number of items
+     */
+    size_t try_pop_up_to(std::vector<T>& out, size_t max)
+    {
+        check_consumer_();
+        size_t n = 0;
+        for (; n < max; n++)
+        {
+            auto item = try_pop_();
+            if (!item)
+                break;
+            out.push_back(std::move(*item));
+        }
+        if (n > 0)
+            not_full_.notify();
+        return n;
+    }
+
+    /**
+     * @brief wait for items until a certain time, then move up to max of them
+     *        off the queue with one notify
+     * @param[out] out - the items are appended to it
+     * @param[in] max - the most items to take
+     * @param[in] timeout - the timeout time
+     * @return the number of items, 0 if timed out
+     */
+    template <class Clock, class Duration>
+    size_t pop_up_to(std::vector<T>& out, size_t max, std::chrono::time_point<Clock, Duration> const& timeout)
+    {
+        check_consumer_();
+        if (max == 0)
+            return 0;
+
+        std::optional<T> item = try_pop_();
+        if (!item && !not_empty_.wait_until([&]() { return (item = try_pop_()).has_value(); }, timeout))
+            return 0;
+
+        size_t n = 0;
+        for (; item; n++)
+        {
+            out.push_back(std::move(*item));
+            item.reset();
+            if (n + 1 < max)
+                item = try_pop_();
+        }
+        not_full_.notify();
+        return n;
+    }
+
+    ring_queue(ring_queue const&) = delete;
+    ring_queue(ring_queue &&) = delete;
+
+    ring_queue& operator=(ring_queue const&) = delete;
+    ring_queue& operator=(ring_queue &&) = delete;
+
+private:
+    static constexpr size_t k_mask = Size - 1;
+
+    struct cell_t
+    {
+        /* pos when free for the push at pos, pos + 1 when full for the pop at pos */
+        std::atomic<size_t> sequence;
+        std::aligned_storage_t<sizeof(T), alignof(T)> storage;
+
+        T* item() noexcept { return std::launder(reinterpret_cast<T*>(&storage)); }
+    };
+
+    /**
+     * @brief assert the calling thread is the consumer, the first one to pop
+     */
+    void check_consumer_() noexcept
+    {
+#ifdef TOXFS_DEBUG
+        check_owner_(consumer_);
+#endif
+    }
+
+    /**
+     * @brief assert the calling thread is the only producer, the first one to
+     *        push, if there must only be one
+     */
+    void check_producer_() noexcept
+    {
+#ifdef TOXFS_DEBUG
+        if constexpr (!MultiProducer)
+            check_owner_(producer_);
+#endif
+    }
+
+#ifdef TOXFS_DEBUG
+    static void check_owner_(std::atomic<std::thread::id>& owner) noexcept
+    {
+        auto const self = std::this_thread::get_id();
+        std::thread::id expected{};
+        if (!owner.compare_exchange_strong(expected, self, std::memory_order_relaxed))
+            assert(expected == self && "ring_queue used by a second thread on a single thread side");
+    }
+#endif
+
+    void notify_consumer_() noexcept
+    {
+        not_empty_.notify();
+        if (wakeup_)
+            wakeup_->notify();
+    }
+
+    /**
+     * @brief push without waiting, m is only moved from on success
+     */
+    bool try_push_(T& m)
+    {
+        auto pos = head_.load(std::memory_order_relaxed);
+        cell_t* cell;
+        while (true)
+        {
+            cell = &cells_[pos & k_mask];
+            auto const seq = cell->sequence.load(std::memory_order_acquire);
+            auto const diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if (diff < 0)
+                return false;
+
+            if (diff > 0)
+            {
+                // Another producer took the cell
+                pos = head_.load(std::memory_order_relaxed);
+            }
+            else if constexpr (MultiProducer)
+            {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else
+            {
+                head_.store(pos + 1, std::memory_order_relaxed);
+                break;
+            }
+        }
+
+        new (&cell->storage) T(std::move(m));
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief pop without waiting, only ever called by the consumer
+     */
+    std::optional<T> try_pop_()
+    {
+        auto const pos = tail_.load(std::memory_order_relaxed);
+        auto& cell = cells_[pos & k_mask];
+        if (cell.sequence.load(std::memory_order_acquire) != pos + 1)
+            return std::nullopt;
+
+        std::optional<T> ret{std::move(*cell.item())};
+        cell.item()->~T();
+        tail_.store(pos + 1, std::memory_order_relaxed);
+        cell.sequence.store(pos + Size, std::memory_order_release);
+        return ret;
+    }
+
+    alignas(detail::k_cache_line_size) std::atomic<size_t> head_{0};
+    alignas(detail::k_cache_line_size) std::atomic<size_t> tail_{0};
+    alignas(detail::k_cache_line_size) std::array<cell_t, Size> cells_;
+    detail::parking_lot_t not_empty_{};
+    detail::parking_lot_t not_full_{};
+    wakeup_t *wakeup_ = nullptr;
+#ifdef TOXFS_DEBUG
+    std::atomic<std::thread::id> consumer_{};
+    std::atomic<std::thread::id> producer_{};
+#endif
+};
+
+/**
+ * A ring_queue for any number of producers and one consumer
+ */
+template<class T, std::size_t Size>
+using mpsc_ring_queue = ring_queue<T, Size, true>;
+
+/**
+ * A ring_queue for one producer and one consumer
+ */
+template<class T, std::size_t Size>
+using spsc_ring_queue = ring_queue<T, Size, false>;
+
+} // namespace toxfs
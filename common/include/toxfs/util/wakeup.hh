@@ -0,0 +1,115 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <utility>
+
+namespace toxfs
+{
+
+/**
+ * Puts one thread to sleep until another thread has work for it or a
+ * deadline passes, on an eventfd watched by epoll.
+ *
+ * A thread that takes work from several places (queues, mailboxes) checks
+ * them all in the ready predicate and sleeps on one wakeup_t, everything
+ * that hands it work calls notify. notify only makes a syscall while the
+ * thread is actually asleep.
+ */
+class wakeup_t
+{
+public:
+    /**
+     * @brief ctor
+     * @throws if the eventfd or epoll instance cannot be created
+     */
+    wakeup_t();
+
+    ~wakeup_t() noexcept;
+
+    wakeup_t(wakeup_t const&) = delete;
+    wakeup_t& operator=(wakeup_t const&) = delete;
+
+    /**
+     * @brief wake the thread after handing it work, any thread may call this
+     */
+    void notify() noexcept
+    {
+        // Pairs with the fence in wait_until, either the waiter sees the work or this sees the waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed))
+            signal_();
+    }
+
+    /**
+     * @brief sleep until ready returns true or the deadline passes, only
+     *        ever called by the one thread that owns the wakeup
+     * @param[in] deadline - when to wake up anyway, time_point::max() for never
+     * @param[in] ready - checks for work, may return true spuriously
+     */
+    template<class Clock, class Duration, class Pred>
+    void wait_until(std::chrono::time_point<Clock, Duration> const& deadline, Pred&& ready)
+    {
+        sleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!ready())
+            wait_(timeout_ms_(deadline));
+        sleeping_.store(false, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief sleep until ready returns true
+     */
+    template<class Pred>
+    void wait(Pred&& ready)
+    {
+        wait_until(std::chrono::steady_clock::time_point::max(), std::forward<Pred>(ready));
+    }
+
+private:
+    template<class Clock, class Duration>
+    static int timeout_ms_(std::chrono::time_point<Clock, Duration> const& deadline) noexcept
+    {
+        if (deadline == std::chrono::time_point<Clock, Duration>::max())
+            return -1;
+
+        auto const now = Clock::now();
+        if (deadline <= now)
+            return 0;
+
+        // Rounded up, so the thread never wakes just before the deadline and spins
+        auto const ms = std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count();
+        return ms > INT_MAX ? INT_MAX : static_cast<int>(ms);
+    }
+
+    void signal_() noexcept;
+
+    void wait_(int timeout_ms) noexcept;
+
+    int event_fd_ = -1;
+    int epoll_fd_ = -1;
+    std::atomic<bool> sleeping_{false};
+};
+
+} // namespace toxfs
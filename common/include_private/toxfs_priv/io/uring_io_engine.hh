@@ -0,0 +1,109 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "toxfs/io/io_engine.hh"
+
+#include <liburing.h>
+
+#include <mutex>
+#include <thread>
+
+namespace toxfs::io
+{
+
+/**
+ * An io_engine_t backed by io_uring.
+ *
+ * Submissions are queued in the submission ring and only handed to the
+ * kernel when the ring fills up or on flush(), so a burst of requests
+ * costs one syscall. Completions are reaped by a dedicated thread which
+ * runs the callbacks.
+ */
+class uring_io_engine_t : public io_engine_t
+{
+public:
+    /**
+     * @brief ctor
+     * @param[in] queue_depth - the size of the submission ring
+     * @throws if the ring could not be created
+     */
+    explicit uring_io_engine_t(unsigned queue_depth);
+
+    ~uring_io_engine_t() noexcept override;
+
+    uring_io_engine_t(uring_io_engine_t const&) = delete;
+    uring_io_engine_t& operator=(uring_io_engine_t const&) = delete;
+
+    /* io_engine_t */
+
+    void submit_read(std::shared_ptr<file_t const> file, uint64_t pos,
+            buffer_t buffer, io_callback_t callback) override;
+
+    void submit_write(std::shared_ptr<file_t const> file, uint64_t pos,
+            buffer_t buffer, io_callback_t callback) override;
+
+    void submit_writev(std::shared_ptr<file_t const> file, uint64_t pos,
+            buffer_chain_t data, io_callback_t callback) override;
+
+    void flush() override;
+
+    io_engine_type_t type() const noexcept override { return io_engine_type_t::uring; }
+
+    /* END io_engine_t */
+
+private:
+    enum class op_t
+    {
+        read,
+        write,
+        writev
+    };
+
+    struct request_t
+    {
+        op_t op;
+        std::shared_ptr<file_t const> file;
+        uint64_t position;
+        buffer_t buffer;
+        io_callback_t callback;
+        /* Bytes already transferred by earlier partial completions */
+        size_t done = 0;
+        /* Only for writev, iov[iov_first:] is what is left to write */
+        buffer_chain_t chain{};
+        std::vector<iovec> iov{};
+        size_t iov_first = 0;
+        size_t total = 0;
+    };
+
+    /**
+     * @brief put a request in the submission ring, mutex_ must be held
+     */
+    void queue_locked_(request_t *req);
+
+    void completion_thread_run_() noexcept;
+
+    io_uring ring_;
+    std::mutex mutex_;
+    unsigned unsubmitted_ = 0;
+    std::thread completion_thread_;
+};
+
+} // namespace toxfs::io
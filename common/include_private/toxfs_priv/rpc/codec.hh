@@ -0,0 +1,101 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "toxfs/tox/tox_types.hh"
+
+#include <gsl/span>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace toxfs::rpc::codec
+{
+
+/* Id byte of RPC packets, in the range toxcore leaves to applications */
+constexpr std::byte k_packet_id{180};
+
+/* Set in the op byte of responses */
+constexpr uint8_t k_response_flag = 0x80;
+
+/* Room left for the header of a response: id, op, request id and status */
+constexpr size_t k_max_header_size = 16;
+
+/* Most payload that fits in a packet after the header */
+constexpr size_t k_max_payload_size = tox::k_max_lossless_packet_size - k_max_header_size;
+
+/**
+ * Appends values to a packet. Integers are LEB128 varints, strings are
+ * prefixed by their length.
+ */
+class writer_t
+{
+public:
+    void u8(uint8_t value);
+
+    void varint(uint64_t value);
+
+    void string(std::string_view value);
+
+    void bytes(gsl::span<std::byte const> value);
+
+    size_t size() const noexcept { return data_.size(); }
+
+    std::vector<std::byte> take() noexcept { return std::move(data_); }
+
+private:
+    std::vector<std::byte> data_;
+};
+
+/**
+ * Reads values written by writer_t, throws if the packet is too short
+ */
+class reader_t
+{
+public:
+    explicit reader_t(gsl::span<std::byte const> data) noexcept
+        : data_(data)
+    {}
+
+    uint8_t u8();
+
+    uint64_t varint();
+
+    std::string string();
+
+    /**
+     * @brief take everything not read yet
+     */
+    gsl::span<std::byte const> rest() noexcept;
+
+    bool empty() const noexcept { return pos_ == data_.size(); }
+
+private:
+    void need_(size_t bytes) const;
+
+    gsl::span<std::byte const> data_;
+    size_t pos_ = 0;
+};
+
+} // namespace toxfs::rpc::codec
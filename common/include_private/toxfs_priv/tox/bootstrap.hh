@@ -0,0 +1,67 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "toxfs/tox/tox.hh"
+
+#include <gsl/span>
+
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+
+namespace toxfs::tox
+{
+
+/**
+ * @brief resolve the hosts of bootstrap nodes, all of them at once
+ * @param[in] nodes - the nodes
+ * @return the nodes with numeric hosts, nodes that do not resolve are left out
+ */
+std::vector<bootstrap_node_t> resolve_bootstrap_nodes(std::vector<bootstrap_node_t> const& nodes);
+
+/**
+ * @brief get the DHT nodes toxcore has heard from out of its savedata
+ * @param[in] savedata - the savedata of tox_get_savedata
+ * @return the UDP nodes, empty if the savedata has none or cannot be parsed
+ */
+std::vector<bootstrap_node_t> savedata_dht_nodes(gsl::span<std::byte const> savedata) noexcept;
+
+/**
+ * @brief get the path of the node cache kept next to a save file
+ */
+std::filesystem::path node_cache_path(std::filesystem::path const& save_file);
+
+/**
+ * @brief read the nodes cached by an earlier run
+ * @return the nodes, empty if there is no cache or it cannot be read
+ */
+std::vector<bootstrap_node_t> load_node_cache(std::filesystem::path const& path) noexcept;
+
+/**
+ * @brief replace the node cache
+ * @param[in] path - the cache path
+ * @param[in] nodes - the nodes, with numeric hosts so no lookups are needed next time
+ * @throws if the cache could not be written
+ */
+void store_node_cache(std::filesystem::path const& path, std::vector<bootstrap_node_t> const& nodes);
+
+} // namespace toxfs::tox
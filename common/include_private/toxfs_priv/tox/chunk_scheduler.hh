@@ -0,0 +1,127 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "toxfs/tox/file_types.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace toxfs::tox
+{
+
+/**
+ * Decides which file gets to release its next chunk request, with deficit
+ * round robin first across friends and then across the files of a friend.
+ *
+ * Every round a friend earns quantum * weight bytes of credit and spends it
+ * on its files, which each earn quantum * weight bytes of their own when
+ * their turn starts. A file that cannot release (nothing requested or its
+ * window is full) gives up its turn and its credit, so idle files do not
+ * bank credit for later.
+ */
+class chunk_scheduler_t
+{
+public:
+    /**
+     * @brief try to release the next chunk request of a file
+     * @return the cost of the request in bytes, none if nothing was released
+     */
+    using release_fn_t = std::function<std::optional<size_t>(unique_file_id_t)>;
+
+    /**
+     * @brief ctor
+     * @param[in] quantum - the credit per round for a weight of 1, in bytes
+     */
+    explicit chunk_scheduler_t(size_t quantum) noexcept;
+
+    /**
+     * @brief start scheduling a file, does nothing if it is already known
+     */
+    void add(unique_file_id_t id);
+
+    /**
+     * @brief stop scheduling a file
+     */
+    void remove(unique_file_id_t id);
+
+    /**
+     * @brief set the weight of a friend, kept even while it sends nothing
+     */
+    void set_weight(friend_id_t id, unsigned weight);
+
+    /**
+     * @brief set the weight of a file, kept until the file is removed
+     */
+    void set_weight(unique_file_id_t id, unsigned weight);
+
+    /**
+     * @brief release chunk requests in fair order
+     * @param[in] budget - the most requests to release
+     * @param[in] release - releases a request of a file
+     * @return the number of requests released
+     */
+    unsigned schedule(unsigned budget, release_fn_t const& release);
+
+    /**
+     * @brief get the weights and bytes released of every friend and file
+     */
+    std::vector<friend_share_t> shares() const;
+
+private:
+    struct file_state_t
+    {
+        unsigned weight = 1;
+        int64_t deficit = 0;
+        bool in_turn = false;
+        uint64_t bytes = 0;
+    };
+
+    struct friend_state_t
+    {
+        int64_t deficit = 0;
+        uint64_t bytes = 0;
+        std::vector<unique_file_id_t> files{};
+        size_t next = 0;
+    };
+
+    /**
+     * @brief let a friend spend its credit for one round
+     * @return the number of requests released
+     */
+    unsigned serve_friend_(friend_state_t& fr, unsigned budget, release_fn_t const& release);
+
+    unsigned friend_weight_(friend_id_t id) const noexcept;
+
+    int64_t quantum_;
+    /* Ordered so the round robin is stable */
+    std::map<uint32_t, friend_state_t> friends_{};
+    std::unordered_map<unique_file_id_t, file_state_t> files_{};
+    std::unordered_map<uint32_t, unsigned> friend_weights_{};
+    /* The friend the next round starts with */
+    uint32_t next_friend_ = 0;
+};
+
+} // namespace toxfs::tox
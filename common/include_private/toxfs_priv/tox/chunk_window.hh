@@ -0,0 +1,87 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "toxfs/tox/file_types.hh"
+
+#include <chrono>
+
+namespace toxfs::tox
+{
+
+/**
+ * Decides how many blocks of one file may be read ahead of toxcore, from
+ * the moment a block is released for reading until toxcore has taken all
+ * of it. The round trip is the disk read plus the wait for the network, so
+ * it rises once the network is the bottleneck.
+ *
+ * Delay based AIMD in the style of LEDBAT: the window doubles every round
+ * trip until the first sign of congestion, then grows while the round trip
+ * stays near the lowest one seen and shrinks as queueing delay rises above
+ * the target. A full toxcore send queue halves the window, at most once per
+ * round trip.
+ */
+class chunk_window_t
+{
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    /**
+     * @brief ctor
+     * @param[in] min_window - the smallest the window can get
+     * @param[in] max_window - the largest the window can get
+     */
+    chunk_window_t(unsigned min_window, unsigned max_window) noexcept;
+
+    /**
+     * @brief get the number of blocks that may be in flight
+     */
+    unsigned window() const noexcept;
+
+    /**
+     * @brief record a block that toxcore has taken all of
+     * @param[in] rtt - the time since the block was released
+     */
+    void on_sent(clock_t::duration rtt) noexcept;
+
+    /**
+     * @brief record a chunk that toxcore refused because its send queue was full
+     */
+    void on_sendq() noexcept;
+
+    /**
+     * @brief get the state for inspection
+     */
+    chunk_window_state_t state() const noexcept;
+
+private:
+    double min_window_;
+    double max_window_;
+    double window_;
+    double ssthresh_;
+    /* Smoothed and lowest round trip, zero until the first sample */
+    clock_t::duration srtt_{};
+    clock_t::duration min_rtt_{};
+    clock_t::time_point min_rtt_time_{};
+    clock_t::time_point last_decrease_{};
+    uint64_t sendq_events_ = 0;
+};
+
+} // namespace toxfs::tox
@@ -0,0 +1,55 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "toxfs/tox/tox_types.hh"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace toxfs::tox
+{
+
+/*
+ * A daemon can run several Tox instances. The friend ids handed out carry
+ * the index of the instance that serves the friend in their top bits, above
+ * the friend number toxcore uses.
+ */
+constexpr unsigned k_instance_shift = 24;
+constexpr size_t k_max_instances = size_t{1} << (32u - k_instance_shift);
+constexpr uint32_t k_friend_number_mask = (uint32_t{1} << k_instance_shift) - 1;
+
+constexpr friend_id_t make_friend_id(size_t instance, uint32_t friend_number) noexcept
+{
+    return friend_id_t{static_cast<uint32_t>(instance << k_instance_shift) | (friend_number & k_friend_number_mask)};
+}
+
+constexpr size_t instance_of(friend_id_t id) noexcept
+{
+    return id.id >> k_instance_shift;
+}
+
+constexpr uint32_t friend_number_of(friend_id_t id) noexcept
+{
+    return id.id & k_friend_number_mask;
+}
+
+} // namespace toxfs::tox
@@ -0,0 +1,84 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "toxfs/tox/file_types.hh"
+
+#include <chrono>
+#include <cstddef>
+
+namespace toxfs::tox
+{
+
+/**
+ * Limits a flow of bytes to a rate, allowing bursts up to a size.
+ *
+ * Tokens are only checked for being positive before data goes out and the
+ * full size is taken after, so a bucket can go into debt by one chunk. That
+ * keeps chunks larger than the burst from stalling forever, and the debt is
+ * paid back before anything else goes.
+ */
+class token_bucket_t
+{
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    /**
+     * @brief ctor
+     * @param[in] limit - the limit, a rate of 0 never limits
+     */
+    explicit token_bucket_t(rate_limit_t limit = {}) noexcept;
+
+    /**
+     * @brief change the limit, tokens already earned are kept up to the new burst
+     */
+    void set_limit(rate_limit_t limit) noexcept;
+
+    rate_limit_t limit() const noexcept { return limit_; }
+
+    /**
+     * @brief check if data may go now
+     */
+    bool ready(clock_t::time_point now) noexcept;
+
+    /**
+     * @brief take tokens for data that went
+     */
+    void consume(size_t bytes) noexcept;
+
+private:
+    void refill_(clock_t::time_point now) noexcept;
+
+    rate_limit_t limit_;
+    double burst_;
+    double tokens_;
+    clock_t::time_point last_refill_{clock_t::now()};
+};
+
+/**
+ * @brief get an even part of a limit for one of n instances. The parts are
+ *        static, an idle instance does not give its part to busy ones
+ * @param[in] limit - the limit of all instances together
+ * @param[in] n - the number of instances
+ * @return the part, never rounded down to 0 which would mean no limit
+ */
+rate_limit_t split_rate_limit(rate_limit_t limit, unsigned n) noexcept;
+
+} // namespace toxfs::tox
@@ -20,24 +20,41 @@
 #pragma once
 
 #include "toxfs/tox/tox_if.hh"
-#include "toxfs/util/message_queue.hh"
+#include "toxfs/util/ring_queue.hh"
+#include "toxfs/util/wakeup.hh"
 
 #include "toxfs_priv/tox/tox_if_msg.hh"
 
+#include <atomic>
+#include <memory>
 #include <thread>
+#include <vector>
 
 namespace toxfs::tox
 {
 
 constexpr size_t k_queue_max_size = 512;
 
-using send_queue_t = message_queue<send_msg_t, k_queue_max_size>;
-using recv_queue_t = message_queue<recv_msg_t, k_queue_max_size>;
+/* Most messages a consumer takes off a queue at once */
+constexpr size_t k_queue_batch_size = 64;
 
+/* Any thread may send through tox_if and every instance receives, each queue has one consumer */
+using send_queue_t = mpsc_ring_queue<send_msg_t, k_queue_max_size>;
+using recv_queue_t = mpsc_ring_queue<recv_msg_t, k_queue_max_size>;
+
+/**
+ * The tox_if of all Tox instances of a daemon. Each instance has its own
+ * send queue, messages go to the instance of the friend they are for. All
+ * instances share the receive queue.
+ */
 class tox_if_impl : public tox_if
 {
 public:
-    tox_if_impl();
+    /**
+     * @brief ctor
+     * @param[in] instances - the number of Tox instances
+     */
+    explicit tox_if_impl(size_t instances = 1);
 
     ~tox_if_impl() noexcept;
 
@@ -57,15 +74,39 @@ public:
 
     void unregister_file_callback_if(file_callback_if& file_if) override;
 
+    void register_packet_callback_if(packet_callback_if& packet_if) override;
+
+    void unregister_packet_callback_if(packet_callback_if& packet_if) override;
+
+    void send_lossless_packet(friend_id_t id, std::vector<std::byte> packet) override;
+
     std::future<unique_file_id_t> send_file(friend_id_t fr_id, file_info_t file) override;
 
+    void send_file(friend_id_t fr_id, file_info_t file, file_send_callback_t callback) override;
+
     void send_file_control(unique_file_id_t id, file_control_t control) override;
 
+    void send_file_seek(unique_file_id_t id, uint64_t position) override;
+
+    std::future<std::optional<chunk_window_state_t>> get_chunk_window(unique_file_id_t id) override;
+
+    void set_friend_weight(friend_id_t id, unsigned weight) override;
+
+    void set_file_weight(unique_file_id_t id, unsigned weight) override;
+
+    std::future<std::vector<friend_share_t>> get_shares() override;
+
+    void set_rate_limit(transfer_direction_t direction, rate_limit_t limit) override;
+
+    void set_friend_rate_limit(friend_id_t id, transfer_direction_t direction, rate_limit_t limit) override;
+
+    void set_file_rate_limit(unique_file_id_t id, rate_limit_t limit) override;
+
     void send_file_chunk(unique_file_id_t id, file_chunk_t chunk) override;
 
     /* END tox_if */
 
-    send_queue_t& get_send_queue() noexcept { return send_queue_; }
+    send_queue_t& get_send_queue(size_t instance) noexcept { return *send_queues_[instance]; }
 
     recv_queue_t& get_recv_queue() noexcept { return recv_queue_; }
 
@@ -79,16 +120,29 @@ private:
     void recv_msg_(recv_msg_file_chunk_request_t&& msg);
     void recv_msg_(recv_msg_file_chunk_t&& msg);
     void recv_msg_(recv_msg_file_error_t&& msg);
+    void recv_msg_(recv_msg_file_send_done_t&& msg);
+    void recv_msg_(recv_msg_lossless_packet_t&& msg);
+    void recv_msg_(recv_msg_lossless_packet_error_t&& msg);
 
     void msg_thread_run_() noexcept;
 
+    /**
+     * @brief get the send queue of the instance that serves a friend
+     * @throws if the friend id is of no instance
+     */
+    send_queue_t& queue_for_(friend_id_t id);
+
+    std::vector<std::unique_ptr<send_queue_t>> send_queues_;
     std::thread msg_thread_;
-    send_queue_t send_queue_;
+    /* The message thread sleeps on this until a message arrives or it is stopped */
+    wakeup_t wakeup_;
+    std::atomic<bool> stop_{false};
     recv_queue_t recv_queue_;
     friend_callback_if *friend_callback_if_ = nullptr;
     file_callback_if *file_callback_if_ptr_ = nullptr;
+    packet_callback_if *packet_callback_if_ptr_ = nullptr;
 
-    message_queue<friend_message_t, 64> fr_messages_queue_;
+    spsc_ring_queue<friend_message_t, 64> fr_messages_queue_;
 };
 
 } // namespace toxfs::tox
@@ -22,10 +22,13 @@
 #include "toxfs/tox/tox_types.hh"
 #include "toxfs/tox/file_types.hh"
 #include "toxfs/tox/tox_error.hh"
+#include "toxfs/tox/tox_if.hh"
 
 #include <variant>
 #include <future>
 #include <cstdint>
+#include <optional>
+#include <vector>
 
 namespace toxfs::tox
 {
@@ -33,6 +36,8 @@ namespace toxfs::tox
     {
         tox::public_key_t key;
         std::string message;
+        /* The instance the request was sent to, which accepts it */
+        size_t instance;
     };
 
     struct recv_msg_fr_message_t
@@ -83,6 +88,25 @@ namespace toxfs::tox
         tox_error error;
     };
 
+    struct recv_msg_file_send_done_t
+    {
+        file_send_callback_t callback;
+        std::future<unique_file_id_t> result;
+    };
+
+    struct recv_msg_lossless_packet_t
+    {
+        friend_id_t id;
+        std::vector<std::byte> packet;
+    };
+
+    struct recv_msg_lossless_packet_error_t
+    {
+        friend_id_t id;
+        std::vector<std::byte> packet;
+        tox_error error;
+    };
+
     using recv_msg_t = std::variant<
         recv_msg_fr_request_t,
         recv_msg_fr_message_t,
@@ -92,7 +116,10 @@ namespace toxfs::tox
         recv_msg_file_control_t,
         recv_msg_file_chunk_request_t,
         recv_msg_file_chunk_t,
-        recv_msg_file_error_t
+        recv_msg_file_error_t,
+        recv_msg_file_send_done_t,
+        recv_msg_lossless_packet_t,
+        recv_msg_lossless_packet_error_t
     >;
 
     struct send_msg_get_conn_status_t
@@ -118,6 +145,8 @@ namespace toxfs::tox
         friend_id_t id;
         file_info_t info;
         std::promise<unique_file_id_t> promise;
+        /* If set the result is handed to this instead of a future */
+        file_send_callback_t callback;
     };
 
     struct send_msg_file_control_t
@@ -126,12 +155,66 @@ namespace toxfs::tox
         file_control_t control;
     };
 
+    struct send_msg_file_seek_t
+    {
+        unique_file_id_t id;
+        uint64_t position;
+    };
+
+    struct send_msg_get_chunk_window_t
+    {
+        unique_file_id_t id;
+        std::promise<std::optional<chunk_window_state_t>> promise;
+    };
+
+    struct send_msg_set_friend_weight_t
+    {
+        friend_id_t id;
+        unsigned weight;
+    };
+
+    struct send_msg_set_file_weight_t
+    {
+        unique_file_id_t id;
+        unsigned weight;
+    };
+
+    struct send_msg_get_shares_t
+    {
+        std::promise<std::vector<friend_share_t>> promise;
+    };
+
+    struct send_msg_set_rate_limit_t
+    {
+        transfer_direction_t direction;
+        rate_limit_t limit;
+    };
+
+    struct send_msg_set_friend_rate_limit_t
+    {
+        friend_id_t id;
+        transfer_direction_t direction;
+        rate_limit_t limit;
+    };
+
+    struct send_msg_set_file_rate_limit_t
+    {
+        unique_file_id_t id;
+        rate_limit_t limit;
+    };
+
     struct send_msg_file_chunk_t
     {
         unique_file_id_t id;
         file_chunk_t chunk;
     };
 
+    struct send_msg_lossless_packet_t
+    {
+        friend_id_t id;
+        std::vector<std::byte> packet;
+    };
+
     struct send_msg_savedata_t
     {
     };
@@ -142,7 +225,16 @@ namespace toxfs::tox
         send_msg_fr_message_t,
         send_msg_file_send_t,
         send_msg_file_control_t,
+        send_msg_file_seek_t,
+        send_msg_get_chunk_window_t,
+        send_msg_set_friend_weight_t,
+        send_msg_set_file_weight_t,
+        send_msg_get_shares_t,
+        send_msg_set_rate_limit_t,
+        send_msg_set_friend_rate_limit_t,
+        send_msg_set_file_rate_limit_t,
         send_msg_file_chunk_t,
+        send_msg_lossless_packet_t,
         send_msg_savedata_t
     >;
 } // namespace toxfs::tox
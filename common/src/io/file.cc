@@ -0,0 +1,258 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "toxfs/io/file.hh"
+#include "toxfs/exception.hh"
+
+#include <fmt/core.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace toxfs::io
+{
+
+namespace
+{
+
+int mode_to_flags(open_mode_t mode) noexcept
+{
+    switch (mode)
+    {
+        case open_mode_t::read: return O_RDONLY;
+        case open_mode_t::write: return O_WRONLY | O_CREAT;
+        case open_mode_t::truncate: return O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    return O_RDONLY;
+}
+
+/**
+ * Drop the first n bytes (and any empty buffers) from a list of iovecs
+ */
+void advance_iov(std::vector<iovec>& iov, size_t& first, size_t n) noexcept
+{
+    while (first < iov.size() && (n > 0 || iov[first].iov_len == 0))
+    {
+        if (n >= iov[first].iov_len)
+        {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        else
+        {
+            iov[first].iov_base = static_cast<std::byte*>(iov[first].iov_base) + n;
+            iov[first].iov_len -= n;
+            n = 0;
+        }
+    }
+}
+
+int iov_count(std::vector<iovec> const& iov, size_t first) noexcept
+{
+    return static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+}
+
+} // namespace
+
+file_t::file_t(std::filesystem::path const& path, open_mode_t mode)
+    : fd_(::open(path.c_str(), mode_to_flags(mode) | O_CLOEXEC, 0644))
+    , path_(path)
+{
+    if (fd_ < 0)
+    {
+        throw TOXFS_EXCEPTION(runtime_error,
+                fmt::format("Cannot open {}: {}", path.native(), std::strerror(errno)));
+    }
+}
+
+file_t::~file_t() noexcept
+{
+    close();
+}
+
+file_t::file_t(file_t&& other) noexcept
+    : fd_(std::exchange(other.fd_, -1))
+    , path_(std::move(other.path_))
+{}
+
+file_t& file_t::operator=(file_t&& other) noexcept
+{
+    if (this != &other)
+    {
+        close();
+        fd_ = std::exchange(other.fd_, -1);
+        path_ = std::move(other.path_);
+    }
+    return *this;
+}
+
+uint64_t file_t::size() const
+{
+    struct stat st;
+    if (::fstat(fd_, &st) != 0)
+    {
+        throw TOXFS_EXCEPTION(runtime_error,
+                fmt::format("Cannot stat {}: {}", path_.native(), std::strerror(errno)));
+    }
+    return static_cast<uint64_t>(st.st_size);
+}
+
+size_t file_t::read_at(uint64_t pos, gsl::span<std::byte> data) const
+{
+    size_t done = 0;
+    while (done < data.size())
+    {
+        auto ret = ::pread(fd_, data.data() + done, data.size() - done, static_cast<off_t>(pos + done));
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            throw TOXFS_EXCEPTION(runtime_error,
+                    fmt::format("Error reading {} at {} size {}: {}",
+                        path_.native(), pos, data.size(), std::strerror(errno)));
+        }
+        if (ret == 0)
+            break;
+
+        done += static_cast<size_t>(ret);
+    }
+    return done;
+}
+
+void file_t::write_at(uint64_t pos, gsl::span<std::byte const> data) const
+{
+    size_t done = 0;
+    while (done < data.size())
+    {
+        auto ret = ::pwrite(fd_, data.data() + done, data.size() - done, static_cast<off_t>(pos + done));
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            throw TOXFS_EXCEPTION(runtime_error,
+                    fmt::format("Error writing {} at {} size {}: {}",
+                        path_.native(), pos, data.size(), std::strerror(errno)));
+        }
+        done += static_cast<size_t>(ret);
+    }
+}
+
+size_t file_t::readv_at(uint64_t pos, gsl::span<iovec const> iov) const
+{
+    std::vector<iovec> remaining(iov.begin(), iov.end());
+    size_t first = 0;
+    size_t done = 0;
+    while (first < remaining.size())
+    {
+        auto ret = ::preadv(fd_, &remaining[first], iov_count(remaining, first), static_cast<off_t>(pos + done));
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            throw TOXFS_EXCEPTION(runtime_error,
+                    fmt::format("Error reading {} at {}: {}", path_.native(), pos + done, std::strerror(errno)));
+        }
+        if (ret == 0)
+            break;
+
+        done += static_cast<size_t>(ret);
+        advance_iov(remaining, first, static_cast<size_t>(ret));
+    }
+    return done;
+}
+
+void file_t::writev_at(uint64_t pos, gsl::span<iovec const> iov) const
+{
+    std::vector<iovec> remaining(iov.begin(), iov.end());
+    size_t first = 0;
+    size_t done = 0;
+    while (first < remaining.size())
+    {
+        auto ret = ::pwritev(fd_, &remaining[first], iov_count(remaining, first), static_cast<off_t>(pos + done));
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            throw TOXFS_EXCEPTION(runtime_error,
+                    fmt::format("Error writing {} at {}: {}", path_.native(), pos + done, std::strerror(errno)));
+        }
+        done += static_cast<size_t>(ret);
+        advance_iov(remaining, first, static_cast<size_t>(ret));
+    }
+}
+
+void file_t::sync_data() const
+{
+    if (::fdatasync(fd_) != 0)
+    {
+        throw TOXFS_EXCEPTION(runtime_error,
+                fmt::format("Cannot sync {}: {}", path_.native(), std::strerror(errno)));
+    }
+}
+
+void file_t::allocate(uint64_t size) const
+{
+    // Nothing to reserve, or the size is unknown (toxcore sends UINT64_MAX) or too large to reserve
+    if (size == 0 || size > static_cast<uint64_t>(std::numeric_limits<off_t>::max()))
+        return;
+
+    int err = 0;
+    if (::fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) != 0)
+    {
+        err = errno;
+        // Not every filesystem can reserve space, posix_fallocate falls back to writing it
+        if (err == EOPNOTSUPP || err == ENOSYS)
+            err = ::posix_fallocate(fd_, 0, static_cast<off_t>(size));
+    }
+
+    if (err != 0)
+    {
+        throw TOXFS_EXCEPTION(runtime_error,
+                fmt::format("Cannot allocate {} bytes for {}: {}", size, path_.native(), std::strerror(err)));
+    }
+}
+
+void file_t::advise_sequential() const noexcept
+{
+    ::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+void file_t::close() noexcept
+{
+    if (fd_ >= 0)
+    {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+} // namespace toxfs::io
@@ -0,0 +1,126 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "toxfs/io/io_engine.hh"
+#include "toxfs/exception.hh"
+#include "toxfs/logging.hh"
+
+#ifdef TOXFS_HAVE_IO_URING
+#include "toxfs_priv/io/uring_io_engine.hh"
+#endif
+
+#include <cerrno>
+
+namespace toxfs::io
+{
+
+namespace
+{
+
+/**
+ * Runs each request with a blocking pread/pwrite on the calling thread
+ */
+class sync_io_engine_t : public io_engine_t
+{
+public:
+    void submit_read(std::shared_ptr<file_t const> file, uint64_t pos,
+            buffer_t buffer, io_callback_t callback) override
+    {
+        int error = 0;
+        try
+        {
+            buffer.set_size(file->read_at(pos, gsl::span<std::byte>{buffer.data(), buffer.capacity()}));
+        }
+        catch (toxfs::exception const& e)
+        {
+            TOXFS_LOG_ERROR("sync read failed: {}", e.what());
+            error = EIO;
+        }
+        callback(io_completion_t{std::move(buffer), pos, error});
+    }
+
+    void submit_write(std::shared_ptr<file_t const> file, uint64_t pos,
+            buffer_t buffer, io_callback_t callback) override
+    {
+        int error = 0;
+        try
+        {
+            file->write_at(pos, gsl::span<std::byte const>{buffer.data(), buffer.size()});
+        }
+        catch (toxfs::exception const& e)
+        {
+            TOXFS_LOG_ERROR("sync write failed: {}", e.what());
+            error = EIO;
+        }
+        callback(io_completion_t{std::move(buffer), pos, error});
+    }
+
+    void submit_writev(std::shared_ptr<file_t const> file, uint64_t pos,
+            buffer_chain_t data, io_callback_t callback) override
+    {
+        auto const iov = data.iovecs();
+        int error = 0;
+        try
+        {
+            file->writev_at(pos, iov);
+        }
+        catch (toxfs::exception const& e)
+        {
+            TOXFS_LOG_ERROR("sync write failed: {}", e.what());
+            error = EIO;
+        }
+        callback(io_completion_t{buffer_t{0}, pos, error});
+    }
+
+    void flush() override
+    {}
+
+    io_engine_type_t type() const noexcept override
+    {
+        return io_engine_type_t::sync;
+    }
+};
+
+} // namespace
+
+std::unique_ptr<io_engine_t> make_io_engine(io_engine_type_t type, unsigned queue_depth)
+{
+    if (type == io_engine_type_t::uring)
+    {
+#ifdef TOXFS_HAVE_IO_URING
+        try
+        {
+            auto engine = std::make_unique<uring_io_engine_t>(queue_depth);
+            TOXFS_LOG_INFO("Using io_uring I/O engine with queue depth {}", queue_depth);
+            return engine;
+        }
+        catch (toxfs::exception const& e)
+        {
+            TOXFS_LOG_WARNING("io_uring unavailable, falling back to sync I/O: {}", e.what());
+        }
+#else
+        (void)queue_depth;
+        TOXFS_LOG_WARNING("Built without io_uring support, falling back to sync I/O");
+#endif
+    }
+
+    return std::make_unique<sync_io_engine_t>();
+}
+
+} // namespace toxfs::io
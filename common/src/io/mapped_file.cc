@@ -0,0 +1,197 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "toxfs/io/mapped_file.hh"
+#include "toxfs/logging.hh"
+
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+
+namespace toxfs::io
+{
+
+namespace
+{
+
+/**
+ * A live mapping as seen by the SIGBUS handler, only uses lock free atomics
+ * so it is safe to read from inside the handler.
+ */
+struct mapping_slot_t
+{
+    std::atomic<uintptr_t> begin{0};
+    std::atomic<uintptr_t> end{0};
+    std::atomic<bool> truncated{false};
+};
+
+constexpr size_t k_max_mappings = 256;
+
+std::array<mapping_slot_t, k_max_mappings> g_slots;
+struct sigaction g_prev_sigbus_action;
+std::once_flag g_install_once;
+
+/* Set while this thread is in guarded_copy, the handler jumps back to it */
+thread_local sigjmp_buf *t_fault_jmp = nullptr;
+
+void sigbus_handler(int sig, siginfo_t *info, void *ctx) noexcept
+{
+    auto addr = reinterpret_cast<uintptr_t>(info->si_addr);
+    for (auto& slot : g_slots)
+    {
+        if (addr >= slot.begin.load() && addr < slot.end.load())
+        {
+            // Past the end of a truncated file, fail the copy that touched it
+            slot.truncated.store(true);
+            if (t_fault_jmp)
+                siglongjmp(*t_fault_jmp, 1);
+            break;
+        }
+    }
+
+    // Not ours (or not read through guarded_copy), hand it to whoever was there before
+    if (g_prev_sigbus_action.sa_flags & SA_SIGINFO)
+    {
+        g_prev_sigbus_action.sa_sigaction(sig, info, ctx);
+    }
+    else if (g_prev_sigbus_action.sa_handler != SIG_DFL && g_prev_sigbus_action.sa_handler != SIG_IGN)
+    {
+        g_prev_sigbus_action.sa_handler(sig);
+    }
+    else
+    {
+        // Returning re-runs the faulting access which now kills the process as usual
+        ::signal(SIGBUS, SIG_DFL);
+    }
+}
+
+bool install_sigbus_handler() noexcept
+{
+    static bool installed = false;
+    std::call_once(g_install_once, []()
+    {
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_sigaction = sigbus_handler;
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        installed = ::sigaction(SIGBUS, &action, &g_prev_sigbus_action) == 0;
+        if (!installed)
+            TOXFS_LOG_ERROR("Failed to install SIGBUS handler: {}", std::strerror(errno));
+    });
+    return installed;
+}
+
+} // namespace
+
+/*static*/ std::shared_ptr<mapped_file_t> mapped_file_t::map(file_t const& file) noexcept
+{
+    if (!install_sigbus_handler())
+        return nullptr;
+
+    uint64_t size = 0;
+    try
+    {
+        size = file.size();
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_WARNING("Not mapping {}: {}", file.path().native(), e.what());
+        return nullptr;
+    }
+
+    if (size == 0)
+        return nullptr;
+
+    void *base = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, file.fd(), 0);
+    if (base == MAP_FAILED)
+    {
+        TOXFS_LOG_DEBUG("Cannot map {}: {}", file.path().native(), std::strerror(errno));
+        return nullptr;
+    }
+    ::madvise(base, size, MADV_SEQUENTIAL);
+
+    for (size_t i = 0; i < g_slots.size(); ++i)
+    {
+        uintptr_t expected = 0;
+        auto begin = reinterpret_cast<uintptr_t>(base);
+        if (g_slots[i].begin.compare_exchange_strong(expected, begin))
+        {
+            g_slots[i].truncated.store(false);
+            g_slots[i].end.store(begin + size);
+            return std::make_shared<mapped_file_t>(private_tag_t{}, static_cast<std::byte*>(base), size, i);
+        }
+    }
+
+    TOXFS_LOG_DEBUG("Cannot map {}: too many mappings", file.path().native());
+    ::munmap(base, size);
+    return nullptr;
+}
+
+mapped_file_t::mapped_file_t(private_tag_t, std::byte *base, uint64_t size, size_t slot) noexcept
+    : base_(base)
+    , size_(size)
+    , slot_(slot)
+{}
+
+mapped_file_t::~mapped_file_t() noexcept
+{
+    g_slots[slot_].end.store(0);
+    g_slots[slot_].begin.store(0);
+    ::munmap(base_, size_);
+}
+
+bool mapped_file_t::truncated() const noexcept
+{
+    return g_slots[slot_].truncated.load();
+}
+
+std::optional<buffer_t> mapped_file_t::view(uint64_t pos, size_t size)
+{
+    if (truncated() || pos > size_ || size > size_ - pos)
+        return std::nullopt;
+
+    return buffer_t{shared_from_this(), base_ + pos, size, true};
+}
+
+/*static*/ bool mapped_file_t::guarded_copy(std::byte *dst, std::byte const *src, size_t size) noexcept
+{
+    sigjmp_buf env;
+    // The handler runs with SIGBUS unblocked (SA_NODEFER), so there is no mask to restore
+    if (sigsetjmp(env, 0) != 0)
+    {
+        t_fault_jmp = nullptr;
+        return false;
+    }
+
+    t_fault_jmp = &env;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    std::memcpy(dst, src, size);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    t_fault_jmp = nullptr;
+    return true;
+}
+
+} // namespace toxfs::io
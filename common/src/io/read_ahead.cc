@@ -0,0 +1,228 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "toxfs/io/read_ahead.hh"
+#include "toxfs/logging.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
+namespace toxfs::io
+{
+
+namespace
+{
+
+/* Number of back to back sequential reads before reading ahead */
+constexpr unsigned k_sequential_threshold = 2;
+
+/* Weight of a new sample in the moving averages */
+constexpr double k_ewma_weight = 0.125;
+
+double ewma(double avg, double sample) noexcept
+{
+    return avg == 0.0 ? sample : avg + k_ewma_weight * (sample - avg);
+}
+
+} // namespace
+
+read_ahead_t::read_ahead_t(std::shared_ptr<file_t const> file, uint64_t file_size, io_engine_t& engine,
+        post_fn_t post, read_ahead_config_t const& config)
+    : file_(std::move(file))
+    , file_size_(file_size)
+    , engine_(engine)
+    , post_(std::move(post))
+    , config_(config)
+    , window_(config.min_blocks)
+{}
+
+void read_ahead_t::read(uint64_t pos, size_t size, read_callback_t callback)
+{
+    if (pos == next_pos_)
+    {
+        sequential_++;
+    }
+    else
+    {
+        TOXFS_LOG_DEBUG("read ahead of {} reset, jumped from {} to {}", file_->path().native(), next_pos_, pos);
+        sequential_ = 0;
+        generation_++;
+        blocks_.clear();
+        window_ = config_.min_blocks;
+    }
+    next_pos_ = pos + size;
+
+    pending_.push_back(pending_t{pos, size, std::move(callback)});
+
+    if (sequential_ >= k_sequential_threshold)
+        schedule_();
+
+    serve_pending_();
+}
+
+void read_ahead_t::schedule_()
+{
+    if (file_size_ == 0)
+        return;
+
+    auto const block_size = config_.block_size;
+    auto const first = next_pos_ / block_size;
+    auto const last = std::min(first + window_, (file_size_ - 1) / block_size + 1);
+
+    for (auto index = first; index < last; ++index)
+    {
+        if (blocks_.count(index))
+            continue;
+
+        auto start = index * block_size;
+        auto len = static_cast<size_t>(std::min<uint64_t>(block_size, file_size_ - start));
+
+        blocks_[index].submitted = clock_t::now();
+        engine_.submit_read(file_, start, buffer_t{len},
+            [weak = weak_from_this(), post = post_, generation = generation_, index](io_completion_t&& c)
+        {
+            post([weak, generation, index, c = std::move(c)]() mutable
+            {
+                if (auto self = weak.lock())
+                    self->on_block_read_(generation, index, std::move(c));
+            });
+        });
+    }
+}
+
+void read_ahead_t::on_block_read_(uint64_t generation, uint64_t index, io_completion_t&& c)
+{
+    if (generation != generation_)
+        return;
+
+    auto it = blocks_.find(index);
+    if (it == blocks_.end())
+        return;
+
+    block_t& block = it->second;
+    auto expected = std::min<uint64_t>(config_.block_size, file_size_ - index * config_.block_size);
+    if (c.error != 0 || c.buffer.size() != expected)
+    {
+        TOXFS_LOG_ERROR("Read ahead of {} at {} failed: got {} of {} ({})", file_->path().native(),
+            c.position, c.buffer.size(), expected, std::strerror(c.error));
+        block.failed = true;
+    }
+    else
+    {
+        block.data = std::move(c.buffer);
+        block.ready = true;
+
+        std::chrono::duration<double> latency = clock_t::now() - block.submitted;
+        read_latency_ = ewma(read_latency_, latency.count());
+        update_window_();
+    }
+
+    serve_pending_();
+}
+
+void read_ahead_t::serve_pending_()
+{
+    auto const block_size = config_.block_size;
+
+    while (!pending_.empty())
+    {
+        auto& p = pending_.front();
+        auto const first = p.position / block_size;
+        auto const last = (p.position + std::max<size_t>(p.size, 1u) - 1) / block_size;
+
+        bool missing = false;
+        bool failed = false;
+        bool waiting = false;
+        for (auto index = first; index <= last; ++index)
+        {
+            auto it = blocks_.find(index);
+            if (it == blocks_.end())
+                missing = true;
+            else if (it->second.failed)
+                failed = true;
+            else if (!it->second.ready)
+                waiting = true;
+        }
+
+        if (missing || failed || p.position + p.size > file_size_)
+        {
+            // Not covered by read ahead, read it directly and answer on the owner thread
+            engine_.submit_read(file_, p.position, buffer_t{p.size},
+                [post = post_, callback = std::move(p.callback)](io_completion_t&& c) mutable
+            {
+                post([callback = std::move(callback), c = std::move(c)]() mutable
+                {
+                    callback(read_result_t{buffer_chain_t{std::move(c.buffer)}, c.position, c.error});
+                });
+            });
+        }
+        else if (waiting)
+        {
+            break;
+        }
+        else
+        {
+            // Views of the blocks, chained if it straddles several
+            buffer_chain_t data;
+            size_t done = 0;
+            for (auto index = first; index <= last; ++index)
+            {
+                auto const& block = blocks_[index];
+                auto offset = static_cast<size_t>(p.position + done - index * block_size);
+                auto len = std::min(p.size - done, block.data.size() - offset);
+                data.append(block.data.slice(offset, len));
+                done += len;
+            }
+            p.callback(read_result_t{std::move(data), p.position, 0});
+        }
+
+        pending_.pop_front();
+    }
+
+    drop_consumed_();
+}
+
+void read_ahead_t::drop_consumed_()
+{
+    auto const keep_from = (pending_.empty() ? next_pos_ : pending_.front().position) / config_.block_size;
+
+    while (!blocks_.empty() && blocks_.begin()->first < keep_from)
+    {
+        if (blocks_.begin()->second.ready)
+        {
+            auto now = clock_t::now();
+            std::chrono::duration<double> elapsed = now - last_consumed_;
+            last_consumed_ = now;
+            if (elapsed.count() > 0.0)
+                consume_rate_ = ewma(consume_rate_, static_cast<double>(config_.block_size) / elapsed.count());
+        }
+        blocks_.erase(blocks_.begin());
+    }
+}
+
+void read_ahead_t::update_window_()
+{
+    // Keep twice the data consumed during one block read in flight
+    auto needed = std::ceil(2.0 * consume_rate_ * read_latency_ / static_cast<double>(config_.block_size));
+    window_ = std::clamp(static_cast<size_t>(needed) + 1, config_.min_blocks, config_.max_blocks);
+}
+
+} // namespace toxfs::io
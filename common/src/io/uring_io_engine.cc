@@ -0,0 +1,232 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "toxfs_priv/io/uring_io_engine.hh"
+#include "toxfs/exception.hh"
+#include "toxfs/logging.hh"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+namespace toxfs::io
+{
+
+namespace
+{
+
+/**
+ * Drop the first n bytes from the iovecs starting at first
+ */
+void advance_iov(std::vector<iovec>& iov, size_t& first, size_t n) noexcept
+{
+    while (first < iov.size() && n >= iov[first].iov_len)
+    {
+        n -= iov[first].iov_len;
+        first++;
+    }
+    if (first < iov.size() && n > 0)
+    {
+        iov[first].iov_base = static_cast<std::byte*>(iov[first].iov_base) + n;
+        iov[first].iov_len -= n;
+    }
+}
+
+} // namespace
+
+uring_io_engine_t::uring_io_engine_t(unsigned queue_depth)
+{
+    int ret = io_uring_queue_init(queue_depth, &ring_, 0);
+    if (ret < 0)
+    {
+        throw TOXFS_EXCEPTION(runtime_error,
+                fmt::format("io_uring_queue_init failed: {}", std::strerror(-ret)));
+    }
+
+    completion_thread_ = std::thread([this]() { completion_thread_run_(); });
+}
+
+uring_io_engine_t::~uring_io_engine_t() noexcept
+{
+    {
+        // Drain everything in flight, then wake the completion thread with a null request
+        std::lock_guard<std::mutex> lock(mutex_);
+        io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+        while (!sqe)
+        {
+            io_uring_submit(&ring_);
+            sqe = io_uring_get_sqe(&ring_);
+        }
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, nullptr);
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_DRAIN);
+        io_uring_submit(&ring_);
+    }
+
+    completion_thread_.join();
+    io_uring_queue_exit(&ring_);
+}
+
+void uring_io_engine_t::submit_read(std::shared_ptr<file_t const> file, uint64_t pos,
+        buffer_t buffer, io_callback_t callback)
+{
+    auto *req = new request_t{op_t::read, std::move(file), pos, std::move(buffer), std::move(callback)};
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_locked_(req);
+}
+
+void uring_io_engine_t::submit_write(std::shared_ptr<file_t const> file, uint64_t pos,
+        buffer_t buffer, io_callback_t callback)
+{
+    auto *req = new request_t{op_t::write, std::move(file), pos, std::move(buffer), std::move(callback)};
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_locked_(req);
+}
+
+void uring_io_engine_t::submit_writev(std::shared_ptr<file_t const> file, uint64_t pos,
+        buffer_chain_t data, io_callback_t callback)
+{
+    auto *req = new request_t{op_t::writev, std::move(file), pos, buffer_t{0}, std::move(callback)};
+    req->iov = data.iovecs();
+    req->total = data.size();
+    req->chain = std::move(data);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_locked_(req);
+}
+
+void uring_io_engine_t::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (unsubmitted_ > 0)
+    {
+        io_uring_submit(&ring_);
+        unsubmitted_ = 0;
+    }
+}
+
+void uring_io_engine_t::queue_locked_(request_t *req)
+{
+    io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+    while (!sqe)
+    {
+        // Ring is full, hand the batch to the kernel to make room
+        io_uring_submit(&ring_);
+        unsubmitted_ = 0;
+        sqe = io_uring_get_sqe(&ring_);
+        if (!sqe)
+            std::this_thread::yield();
+    }
+
+    auto offset = req->position + req->done;
+    if (req->op == op_t::read)
+    {
+        io_uring_prep_read(sqe, req->file->fd(), req->buffer.data() + req->done,
+                static_cast<unsigned>(req->buffer.capacity() - req->done), offset);
+    }
+    else if (req->op == op_t::write)
+    {
+        io_uring_prep_write(sqe, req->file->fd(), req->buffer.data() + req->done,
+                static_cast<unsigned>(req->buffer.size() - req->done), offset);
+    }
+    else
+    {
+        // Chains can be longer than a writev allows, the rest goes as a partial write
+        io_uring_prep_writev(sqe, req->file->fd(), req->iov.data() + req->iov_first,
+                static_cast<unsigned>(std::min<size_t>(req->iov.size() - req->iov_first, IOV_MAX)), offset);
+    }
+    io_uring_sqe_set_data(sqe, req);
+    unsubmitted_++;
+}
+
+void uring_io_engine_t::completion_thread_run_() noexcept
+{
+    while (true)
+    {
+        io_uring_cqe *cqe = nullptr;
+        int ret = io_uring_wait_cqe(&ring_, &cqe);
+        if (ret < 0)
+        {
+            if (ret != -EINTR)
+                TOXFS_LOG_ERROR("io_uring_wait_cqe failed: {}", std::strerror(-ret));
+            continue;
+        }
+
+        auto *req = static_cast<request_t*>(io_uring_cqe_get_data(cqe));
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring_, cqe);
+
+        if (!req)
+            break;
+
+        std::unique_ptr<request_t> owned{req};
+        int error = 0;
+        if (res == -EINTR || res == -EAGAIN)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_locked_(owned.release());
+            io_uring_submit(&ring_);
+            unsubmitted_ = 0;
+            continue;
+        }
+        else if (res < 0)
+        {
+            error = -res;
+        }
+        else
+        {
+            req->done += static_cast<size_t>(res);
+            if (req->op == op_t::writev)
+                advance_iov(req->iov, req->iov_first, static_cast<size_t>(res));
+
+            // Partial transfer, queue up the remainder (a read of 0 is EOF)
+            auto total = req->op == op_t::read ? req->buffer.capacity()
+                : req->op == op_t::write ? req->buffer.size() : req->total;
+            if (req->done < total && res > 0)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                queue_locked_(owned.release());
+                io_uring_submit(&ring_);
+                unsubmitted_ = 0;
+                continue;
+            }
+
+            if (req->op == op_t::read)
+                req->buffer.set_size(req->done);
+            else if (req->done < total)
+                error = EIO;
+        }
+
+        try
+        {
+            req->callback(io_completion_t{std::move(req->buffer), req->position, error});
+        }
+        catch (std::exception const& e)
+        {
+            TOXFS_LOG_ERROR("Exception in I/O completion callback: {}", e.what());
+        }
+    }
+}
+
+} // namespace toxfs::io
@@ -0,0 +1,215 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "toxfs/io/write_behind.hh"
+#include "toxfs/exception.hh"
+#include "toxfs/logging.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace toxfs::io
+{
+
+namespace
+{
+
+/* Past this many extents of buffered data, runs are written even if unaligned */
+constexpr size_t k_max_buffered_extents = 4;
+
+} // namespace
+
+write_behind_t::write_behind_t(std::shared_ptr<file_t const> file, io_engine_t& engine,
+        post_fn_t post, written_fn_t on_written, error_fn_t on_failed, write_behind_config_t const& config)
+    : file_(std::move(file))
+    , engine_(engine)
+    , post_(std::move(post))
+    , written_fn_(std::move(on_written))
+    , failed_fn_(std::move(on_failed))
+    , config_(config)
+{}
+
+void write_behind_t::write(uint64_t pos, buffer_chain_t data)
+{
+    if (data.size() == 0)
+        return;
+
+    if (chunks_.empty())
+        oldest_ = clock_t::now();
+
+    auto [it, ok] = chunks_.try_emplace(pos, data);
+    if (!ok)
+    {
+        // Same chunk again, keep the newest copy
+        buffered_ -= it->second.size();
+        it->second = std::move(data);
+    }
+    buffered_ += it->second.size();
+
+    if (buffered_ >= k_max_buffered_extents * config_.extent_size)
+        flush_(true);
+    else if (buffered_ >= config_.extent_size)
+        flush_(false);
+}
+
+void write_behind_t::poll()
+{
+    if (!chunks_.empty() && clock_t::now() - oldest_ >= config_.max_delay)
+        flush_(true);
+}
+
+void write_behind_t::finish(error_fn_t on_done)
+{
+    finishing_ = true;
+    done_fn_ = std::move(on_done);
+    flush_(true);
+
+    if (in_flight_ == 0)
+        done_();
+}
+
+void write_behind_t::flush_(bool all)
+{
+    auto it = chunks_.begin();
+    while (it != chunks_.end())
+    {
+        // Find the contiguous run starting at it
+        auto const start = it->first;
+        auto run_end = start;
+        auto last = it;
+        while (last != chunks_.end() && last->first == run_end)
+        {
+            run_end += last->second.size();
+            ++last;
+        }
+
+        auto const write_end = all ? run_end : run_end - run_end % config_.extent_size;
+        if (write_end <= start)
+        {
+            it = last;
+            continue;
+        }
+
+        buffer_chain_t run;
+        auto pos = start;
+        while (it != last && pos < write_end)
+        {
+            auto& chunk = it->second;
+            auto len = chunk.size();
+            if (pos + len > write_end)
+            {
+                // Straddles the extent boundary, keep the tail for later
+                auto head = static_cast<size_t>(write_end - pos);
+                chunks_.emplace_hint(last, write_end, chunk.slice(head, len - head));
+                run.append(chunk.slice(0, head));
+                len = head;
+            }
+            else
+            {
+                run.append(std::move(chunk));
+            }
+
+            pos += len;
+            it = chunks_.erase(it);
+        }
+
+        submit_(start, std::move(run));
+
+        buffered_ -= static_cast<size_t>(pos - start);
+        it = last;
+    }
+
+    if (chunks_.empty())
+        oldest_ = clock_t::now();
+}
+
+void write_behind_t::submit_(uint64_t pos, buffer_chain_t data)
+{
+    in_flight_++;
+    uint64_t const size = data.size();
+    engine_.submit_writev(file_, pos, std::move(data),
+        [self = shared_from_this(), pos, size](io_completion_t&& c)
+    {
+        auto post = self->post_;
+        post([self, pos, size, error = c.error]() { self->on_written_(pos, size, error); });
+    });
+}
+
+void write_behind_t::on_written_(uint64_t pos, uint64_t size, int error)
+{
+    in_flight_--;
+
+    if (error != 0)
+    {
+        TOXFS_LOG_ERROR("Error writing {} at {} size {}: {}",
+            file_->path().native(), pos, size, std::strerror(error));
+        if (error_ == 0)
+        {
+            error_ = error;
+            failed_fn_(error);
+        }
+    }
+    else
+    {
+        written_fn_(pos, size);
+    }
+
+    if (finishing_)
+    {
+        if (in_flight_ == 0)
+            done_();
+    }
+    else if (config_.durability == durability_t::periodic &&
+            clock_t::now() - last_sync_ >= config_.sync_interval)
+    {
+        sync_();
+    }
+}
+
+void write_behind_t::sync_()
+{
+    last_sync_ = clock_t::now();
+    if (config_.durability == durability_t::none)
+        return;
+
+    try
+    {
+        file_->sync_data();
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_ERROR("{}", e.what());
+        if (error_ == 0)
+            error_ = EIO;
+    }
+}
+
+void write_behind_t::done_()
+{
+    // Nothing to sync after a failed write, the file is given up on
+    if (error_ == 0)
+        sync_();
+
+    if (auto done = std::exchange(done_fn_, nullptr))
+        done(error_);
+}
+
+} // namespace toxfs::io
@@ -0,0 +1,98 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "toxfs_priv/rpc/codec.hh"
+#include "toxfs/exception.hh"
+
+#include <fmt/core.h>
+
+namespace toxfs::rpc::codec
+{
+
+void writer_t::u8(uint8_t value)
+{
+    data_.push_back(std::byte{value});
+}
+
+void writer_t::varint(uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        data_.push_back(std::byte{static_cast<uint8_t>(value | 0x80)});
+        value >>= 7;
+    }
+    data_.push_back(std::byte{static_cast<uint8_t>(value)});
+}
+
+void writer_t::string(std::string_view value)
+{
+    varint(value.size());
+    auto const bytes = reinterpret_cast<std::byte const*>(value.data());
+    data_.insert(data_.end(), bytes, bytes + value.size());
+}
+
+void writer_t::bytes(gsl::span<std::byte const> value)
+{
+    data_.insert(data_.end(), value.begin(), value.end());
+}
+
+uint8_t reader_t::u8()
+{
+    need_(1);
+    return std::to_integer<uint8_t>(data_[pos_++]);
+}
+
+uint64_t reader_t::varint()
+{
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        auto const byte = u8();
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+
+    throw TOXFS_EXCEPTION(runtime_error, "RPC varint too long");
+}
+
+std::string reader_t::string()
+{
+    auto const size = varint();
+    need_(size);
+    std::string value{reinterpret_cast<char const*>(data_.data() + pos_), size};
+    pos_ += size;
+    return value;
+}
+
+gsl::span<std::byte const> reader_t::rest() noexcept
+{
+    auto rest = data_.subspan(pos_);
+    pos_ = data_.size();
+    return rest;
+}
+
+void reader_t::need_(size_t bytes) const
+{
+    if (data_.size() - pos_ < bytes)
+        throw TOXFS_EXCEPTION(runtime_error, fmt::format("RPC packet truncated at byte {}", pos_));
+}
+
+} // namespace toxfs::rpc::codec
@@ -0,0 +1,820 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "toxfs/rpc/rpc.hh"
+#include "toxfs/logging.hh"
+
+#include "toxfs_priv/rpc/codec.hh"
+
+#include <fmt/core.h>
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+namespace toxfs::rpc
+{
+
+namespace
+{
+
+/* How often the server thread looks for requests that have timed out */
+constexpr std::chrono::seconds k_expire_interval{1};
+
+/* Most data one read request asks for, so its answer fits in a packet */
+constexpr size_t k_max_read_size = codec::k_max_payload_size;
+
+/* Most answers waiting for the server thread, more are dropped and the client times out */
+constexpr size_t k_max_queued_answers = 256;
+
+/* How long to wait before sending an answer again that failed to send */
+constexpr std::chrono::milliseconds k_answer_retry_delay{100};
+
+std::vector<std::byte> encode_answer(uint8_t op, uint64_t request_id, int status, gsl::span<std::byte const> payload)
+{
+    codec::writer_t answer;
+    answer.u8(std::to_integer<uint8_t>(codec::k_packet_id));
+    answer.u8(static_cast<uint8_t>(op | codec::k_response_flag));
+    answer.varint(request_id);
+    answer.varint(static_cast<uint64_t>(status));
+    if (status == 0)
+        answer.bytes(payload);
+    return answer.take();
+}
+
+/* Key of an answer, unique while its request is in flight */
+uint64_t answer_key(tox::friend_id_t fr_id, uint64_t request_id) noexcept
+{
+    return (static_cast<uint64_t>(fr_id.id) << 32) | (request_id & 0xffffffff);
+}
+
+file_type_t file_type_of(mode_t mode) noexcept
+{
+    if (S_ISREG(mode))
+        return file_type_t::regular;
+    if (S_ISDIR(mode))
+        return file_type_t::directory;
+    if (S_ISLNK(mode))
+        return file_type_t::symlink;
+    return file_type_t::other;
+}
+
+file_type_t file_type_of(std::filesystem::file_type type) noexcept
+{
+    switch (type)
+    {
+    case std::filesystem::file_type::regular:
+        return file_type_t::regular;
+    case std::filesystem::file_type::directory:
+        return file_type_t::directory;
+    case std::filesystem::file_type::symlink:
+        return file_type_t::symlink;
+    default:
+        return file_type_t::other;
+    }
+}
+
+file_type_t decode_file_type(uint8_t value) noexcept
+{
+    if (value > static_cast<uint8_t>(file_type_t::other))
+        return file_type_t::other;
+    return static_cast<file_type_t>(value);
+}
+
+/**
+ * @brief make the completion of a request that decodes the answer into a promise
+ */
+template<class T, class Decode>
+auto make_complete(std::shared_ptr<std::promise<T>> promise, Decode decode)
+{
+    return [promise = std::move(promise), decode = std::move(decode)](
+            std::exception_ptr error, gsl::span<std::byte const> payload)
+    {
+        if (error)
+        {
+            promise->set_exception(error);
+            return;
+        }
+
+        try
+        {
+            codec::reader_t reader{payload};
+            if constexpr (std::is_void_v<T>)
+            {
+                decode(reader);
+                promise->set_value();
+            }
+            else
+            {
+                promise->set_value(decode(reader));
+            }
+        }
+        catch (...)
+        {
+            promise->set_exception(std::current_exception());
+        }
+    };
+}
+
+} // namespace
+
+rpc_t::rpc_t(std::shared_ptr<tox::tox_if> tox_if, rpc_config_t config)
+    : tox_if_(std::move(tox_if))
+    , config_(std::move(config))
+{
+    config_.root_dir = std::filesystem::canonical(config_.root_dir);
+    server_thread_ = std::thread([this]() { server_run_(); });
+    tox_if_->register_packet_callback_if(*this);
+}
+
+rpc_t::~rpc_t() noexcept
+{
+    tox_if_->unregister_packet_callback_if(*this);
+    server_queue_.push([this]() { stop_ = true; });
+    server_thread_.join();
+
+    std::unordered_map<uint32_t, pending_t> pending;
+    {
+        std::lock_guard lock{mutex_};
+        pending.swap(pending_);
+        friends_.clear();
+    }
+
+    for (auto& [request_id, req] : pending)
+    {
+        req.complete(std::make_exception_ptr(
+                TOXFS_EXCEPTION(rpc::rpc_error, fmt::format("RPC request {} cancelled", request_id), ECANCELED)), {});
+    }
+}
+
+std::future<file_stat_t> rpc_t::stat(tox::friend_id_t fr_id, std::string path)
+{
+    auto promise = std::make_shared<std::promise<file_stat_t>>();
+    auto future = promise->get_future();
+
+    codec::writer_t args;
+    args.string(path);
+    call_(fr_id, op_t::stat, args.take(), make_complete(std::move(promise), [](codec::reader_t& reader)
+    {
+        file_stat_t st{};
+        st.type = decode_file_type(reader.u8());
+        st.size = reader.varint();
+        st.mtime = static_cast<int64_t>(reader.varint());
+        st.mode = static_cast<uint32_t>(reader.varint());
+        return st;
+    }));
+
+    return future;
+}
+
+std::future<dir_page_t> rpc_t::readdir(tox::friend_id_t fr_id, std::string path, uint64_t offset)
+{
+    auto promise = std::make_shared<std::promise<dir_page_t>>();
+    auto future = promise->get_future();
+
+    codec::writer_t args;
+    args.string(path);
+    args.varint(offset);
+    call_(fr_id, op_t::readdir, args.take(), make_complete(std::move(promise), [](codec::reader_t& reader)
+    {
+        dir_page_t page;
+        auto const count = reader.varint();
+        for (uint64_t i = 0; i < count; i++)
+        {
+            auto name = reader.string();
+            page.entries.push_back(dir_entry_t{std::move(name), decode_file_type(reader.u8())});
+        }
+
+        if (reader.u8())
+            page.next = reader.varint();
+        return page;
+    }));
+
+    return future;
+}
+
+std::future<file_handle_t> rpc_t::open(tox::friend_id_t fr_id, std::string path)
+{
+    auto promise = std::make_shared<std::promise<file_handle_t>>();
+    auto future = promise->get_future();
+
+    codec::writer_t args;
+    args.string(path);
+    call_(fr_id, op_t::open, args.take(), make_complete(std::move(promise), [](codec::reader_t& reader)
+    {
+        return file_handle_t{reader.varint()};
+    }));
+
+    return future;
+}
+
+std::future<buffer_chain_t> rpc_t::read(tox::friend_id_t fr_id, file_handle_t handle, uint64_t position, size_t size)
+{
+    // Every part is its own request, they are all in flight at once and joined at the end
+    std::vector<std::pair<std::future<buffer_t>, size_t>> parts;
+    for (size_t done = 0; done < size; done += k_max_read_size)
+    {
+        auto const part_size = std::min(k_max_read_size, size - done);
+        auto promise = std::make_shared<std::promise<buffer_t>>();
+        parts.emplace_back(promise->get_future(), part_size);
+
+        codec::writer_t args;
+        args.varint(handle.id);
+        args.varint(position + done);
+        args.varint(part_size);
+        call_(fr_id, op_t::read, args.take(), make_complete(std::move(promise), [](codec::reader_t& reader)
+        {
+            auto const data = reader.rest();
+            buffer_t buf{data.size()};
+            std::copy(data.begin(), data.end(), buf.data());
+            buf.set_size(data.size());
+            return buf;
+        }));
+    }
+
+    return std::async(std::launch::deferred, [parts = std::move(parts)]() mutable
+    {
+        buffer_chain_t data;
+        for (auto& [future, part_size] : parts)
+        {
+            auto part = future.get();
+            auto const part_len = std::min(part.size(), part_size);
+            data.append(part.slice(0, part_len));
+
+            // A short part is the end of the file, there is nothing after it
+            if (part_len < part_size)
+                break;
+        }
+
+        return data;
+    });
+}
+
+std::future<void> rpc_t::close(tox::friend_id_t fr_id, file_handle_t handle)
+{
+    auto promise = std::make_shared<std::promise<void>>();
+    auto future = promise->get_future();
+
+    codec::writer_t args;
+    args.varint(handle.id);
+    call_(fr_id, op_t::close, args.take(), make_complete(std::move(promise), [](codec::reader_t&) {}));
+
+    return future;
+}
+
+void rpc_t::on_tox_lossless_packet(tox::friend_id_t id, std::vector<std::byte> packet) noexcept
+{
+    // Other lossless packets are not for us
+    if (packet.size() < 2 || packet.front() != codec::k_packet_id)
+        return;
+
+    if (!(std::to_integer<uint8_t>(packet[1]) & codec::k_response_flag))
+    {
+        uint8_t op = 0;
+        uint64_t request_id = 0;
+        try
+        {
+            codec::reader_t reader{gsl::span<std::byte const>{packet.data(), packet.size()}.subspan(1)};
+            op = reader.u8();
+            request_id = reader.varint();
+        }
+        catch (std::exception const& e)
+        {
+            TOXFS_LOG_WARNING("Malformed RPC request from friend {}: {}", id.id, e.what());
+            return;
+        }
+
+        // Never wait for the server here, this thread dispatches every tox message
+        std::function<void()> serve{[this, id, packet = std::move(packet)]() { serve_(id, packet); }};
+        if (!server_queue_.push_timeout(std::move(serve), std::chrono::seconds{0}))
+        {
+            TOXFS_LOG_DEBUG("RPC server busy, refusing request {} from friend {}", request_id, id.id);
+            try
+            {
+                queue_answer_(answer_t{id, encode_answer(op, request_id, EBUSY, {}), std::chrono::steady_clock::now()});
+            }
+            catch (std::exception const& e)
+            {
+                TOXFS_LOG_ERROR("Failed to refuse RPC request {} from friend {}: {}", request_id, id.id, e.what());
+            }
+        }
+        return;
+    }
+
+    try
+    {
+        codec::reader_t reader{gsl::span<std::byte const>{packet.data(), packet.size()}.subspan(2)};
+        auto const request_id = static_cast<uint32_t>(reader.varint());
+        auto const status = static_cast<int>(reader.varint());
+
+        std::exception_ptr error;
+        if (status != 0)
+        {
+            error = std::make_exception_ptr(TOXFS_EXCEPTION(rpc::rpc_error,
+                    fmt::format("RPC request {} failed: {}", request_id, std::strerror(status)), status));
+        }
+
+        finish_(id, request_id, error, reader.rest());
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_WARNING("Malformed RPC answer from friend {}: {}", id.id, e.what());
+    }
+}
+
+void rpc_t::on_tox_lossless_packet_error(tox::friend_id_t id, std::vector<std::byte> packet, tox::tox_error err) noexcept
+{
+    if (packet.size() < 2 || packet.front() != codec::k_packet_id)
+        return;
+
+    if (std::to_integer<uint8_t>(packet[1]) & codec::k_response_flag)
+    {
+        TOXFS_LOG_DEBUG("Failed to send RPC answer to friend {}: {}", id.id, err.what());
+        retry_answer_(id, std::move(packet));
+        return;
+    }
+
+    try
+    {
+        codec::reader_t reader{gsl::span<std::byte const>{packet.data(), packet.size()}.subspan(2)};
+        auto const request_id = static_cast<uint32_t>(reader.varint());
+        finish_(id, request_id, std::make_exception_ptr(err), {});
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_ERROR("Failed to send malformed RPC request to friend {}: {}", id.id, e.what());
+    }
+}
+
+void rpc_t::call_(tox::friend_id_t fr_id, op_t op, std::vector<std::byte> args, complete_t complete)
+{
+    auto const request_id = next_request_id_++;
+
+    codec::writer_t writer;
+    writer.u8(std::to_integer<uint8_t>(codec::k_packet_id));
+    writer.u8(static_cast<uint8_t>(op));
+    writer.varint(request_id);
+    writer.bytes(args);
+
+    if (writer.size() > tox::k_max_lossless_packet_size)
+    {
+        complete(std::make_exception_ptr(TOXFS_EXCEPTION(rpc::rpc_error,
+                fmt::format("RPC request of {} bytes does not fit in a packet", writer.size()), EMSGSIZE)), {});
+        return;
+    }
+
+    auto packet = writer.take();
+    {
+        std::lock_guard lock{mutex_};
+        auto& req = pending_.emplace(request_id,
+                pending_t{fr_id, std::chrono::steady_clock::now() + config_.request_timeout, std::move(complete)}).first->second;
+
+        auto& fr = friends_[fr_id.id];
+        if (fr.in_flight >= config_.max_in_flight)
+        {
+            fr.backlog.emplace_back(request_id, std::move(packet));
+            return;
+        }
+
+        fr.in_flight++;
+        req.sent = true;
+    }
+
+    send_(fr_id, request_id, std::move(packet));
+}
+
+void rpc_t::send_(tox::friend_id_t fr_id, uint32_t request_id, std::vector<std::byte> packet) noexcept
+{
+    try
+    {
+        tox_if_->send_lossless_packet(fr_id, std::move(packet));
+    }
+    catch (std::exception const&)
+    {
+        finish_(fr_id, request_id, std::current_exception(), {});
+    }
+}
+
+void rpc_t::finish_(tox::friend_id_t fr_id, uint32_t request_id, std::exception_ptr error,
+        gsl::span<std::byte const> payload) noexcept
+{
+    complete_t complete;
+    std::optional<std::pair<uint32_t, std::vector<std::byte>>> next;
+    {
+        std::lock_guard lock{mutex_};
+        auto it = pending_.find(request_id);
+        // Answered twice, or answered after it timed out
+        if (it == pending_.end())
+            return;
+
+        // Request ids are guessable, only the friend asked may answer
+        if (!(it->second.fr_id == fr_id))
+        {
+            TOXFS_LOG_WARNING("Ignoring RPC answer {} from friend {}, it was sent to friend {}",
+                request_id, fr_id.id, it->second.fr_id.id);
+            return;
+        }
+
+        complete = std::move(it->second.complete);
+        bool const sent = it->second.sent;
+        pending_.erase(it);
+
+        auto& fr = friends_[fr_id.id];
+        if (sent)
+            fr.in_flight--;
+
+        // Requests that timed out while queued are skipped
+        while (!fr.backlog.empty() && fr.in_flight < config_.max_in_flight)
+        {
+            auto queued = std::move(fr.backlog.front());
+            fr.backlog.pop_front();
+
+            auto queued_it = pending_.find(queued.first);
+            if (queued_it != pending_.end())
+            {
+                queued_it->second.sent = true;
+                fr.in_flight++;
+                next = std::move(queued);
+                break;
+            }
+        }
+
+        if (fr.in_flight == 0 && fr.backlog.empty())
+            friends_.erase(fr_id.id);
+    }
+
+    complete(error, payload);
+
+    if (next)
+        send_(fr_id, next->first, std::move(next->second));
+}
+
+void rpc_t::expire_() noexcept
+{
+    std::vector<std::pair<tox::friend_id_t, uint32_t>> expired;
+    {
+        std::lock_guard lock{mutex_};
+        auto const now = std::chrono::steady_clock::now();
+        for (auto const& [request_id, req] : pending_)
+        {
+            if (req.deadline <= now)
+                expired.emplace_back(req.fr_id, request_id);
+        }
+    }
+
+    for (auto const& [fr_id, request_id] : expired)
+    {
+        finish_(fr_id, request_id, std::make_exception_ptr(
+                TOXFS_EXCEPTION(rpc::rpc_error, fmt::format("RPC request {} timed out", request_id), ETIMEDOUT)), {});
+    }
+}
+
+void rpc_t::server_run_() noexcept
+{
+    auto next_expire = std::chrono::steady_clock::now() + k_expire_interval;
+    while (!stop_)
+    {
+        auto const next_answer = send_answers_();
+        auto func = server_queue_.pop_until_time(std::min(next_expire, next_answer));
+        if (func)
+            (*func)();
+
+        auto const now = std::chrono::steady_clock::now();
+        if (now >= next_expire)
+        {
+            expire_();
+            next_expire = now + k_expire_interval;
+        }
+    }
+}
+
+void rpc_t::serve_(tox::friend_id_t fr_id, std::vector<std::byte> const& packet) noexcept
+{
+    codec::reader_t args{gsl::span<std::byte const>{packet.data(), packet.size()}.subspan(1)};
+    uint8_t op = 0;
+    uint64_t request_id = 0;
+    try
+    {
+        op = args.u8();
+        request_id = args.varint();
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_WARNING("Malformed RPC request from friend {}: {}", fr_id.id, e.what());
+        return;
+    }
+
+    codec::writer_t result;
+    int status = 0;
+    try
+    {
+        switch (static_cast<op_t>(op))
+        {
+        case op_t::stat:
+            serve_stat_(fr_id, args, result);
+            break;
+        case op_t::readdir:
+            serve_readdir_(fr_id, args, result);
+            break;
+        case op_t::open:
+            serve_open_(fr_id, args, result);
+            break;
+        case op_t::read:
+            serve_read_(fr_id, args, result);
+            break;
+        case op_t::close:
+            serve_close_(fr_id, args, result);
+            break;
+        default:
+            status = ENOSYS;
+            break;
+        }
+    }
+    catch (rpc_error const& e)
+    {
+        TOXFS_LOG_DEBUG("RPC request {} from friend {} failed: {}", request_id, fr_id.id, e.what());
+        status = e.error_code();
+    }
+    catch (std::filesystem::filesystem_error const& e)
+    {
+        TOXFS_LOG_DEBUG("RPC request {} from friend {} failed: {}", request_id, fr_id.id, e.what());
+        status = e.code().value();
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_WARNING("RPC request {} from friend {} failed: {}", request_id, fr_id.id, e.what());
+        status = EIO;
+    }
+
+    std::vector<std::byte> answer;
+    try
+    {
+        auto const payload = result.take();
+        answer = encode_answer(op, request_id, status, payload);
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_ERROR("Failed to encode answer to RPC request {} from friend {}: {}", request_id, fr_id.id, e.what());
+        return;
+    }
+
+    try
+    {
+        tox_if_->send_lossless_packet(fr_id, answer);
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_DEBUG("Failed to answer RPC request {} from friend {}: {}", request_id, fr_id.id, e.what());
+        retry_answer_(fr_id, std::move(answer));
+    }
+}
+
+void rpc_t::queue_answer_(answer_t answer) noexcept
+{
+    {
+        std::lock_guard lock{answers_mutex_};
+        if (answers_.size() >= k_max_queued_answers)
+        {
+            TOXFS_LOG_WARNING("Too many RPC answers queued, dropping one to friend {}", answer.fr_id.id);
+            return;
+        }
+        answers_.push_back(std::move(answer));
+    }
+
+    // Wake the server thread if it is idle, if its queue is full it is not
+    server_queue_.push_timeout(std::function<void()>{[]() {}}, std::chrono::seconds{0});
+}
+
+void rpc_t::retry_answer_(tox::friend_id_t fr_id, std::vector<std::byte> packet) noexcept
+{
+    uint64_t request_id = 0;
+    try
+    {
+        codec::reader_t reader{gsl::span<std::byte const>{packet.data(), packet.size()}.subspan(2)};
+        request_id = reader.varint();
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_ERROR("Failed to send malformed RPC answer to friend {}: {}", fr_id.id, e.what());
+        return;
+    }
+
+    auto const now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard lock{answers_mutex_};
+        auto const [it, inserted] = answer_deadlines_.try_emplace(answer_key(fr_id, request_id), now + config_.request_timeout);
+        if (!inserted && it->second <= now)
+        {
+            TOXFS_LOG_WARNING("Giving up on answering RPC request {} from friend {}", request_id, fr_id.id);
+            answer_deadlines_.erase(it);
+            return;
+        }
+    }
+
+    queue_answer_(answer_t{fr_id, std::move(packet), now + k_answer_retry_delay});
+}
+
+std::chrono::steady_clock::time_point rpc_t::send_answers_() noexcept
+{
+    auto const now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+
+    std::deque<answer_t> due;
+    {
+        std::lock_guard lock{answers_mutex_};
+        for (auto it = answers_.begin(); it != answers_.end();)
+        {
+            if (it->due <= now)
+            {
+                due.push_back(std::move(*it));
+                it = answers_.erase(it);
+            }
+            else
+            {
+                next = std::min(next, it->due);
+                ++it;
+            }
+        }
+
+        // Forget retried answers long after the client gave up on them, a retry
+        // still queued has found its deadline passed by then
+        for (auto it = answer_deadlines_.begin(); it != answer_deadlines_.end();)
+        {
+            if (it->second + config_.request_timeout <= now)
+                it = answer_deadlines_.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    for (auto& answer : due)
+    {
+        try
+        {
+            tox_if_->send_lossless_packet(answer.fr_id, answer.packet);
+        }
+        catch (std::exception const& e)
+        {
+            TOXFS_LOG_DEBUG("Failed to send RPC answer to friend {}: {}", answer.fr_id.id, e.what());
+            retry_answer_(answer.fr_id, std::move(answer.packet));
+        }
+    }
+
+    return next;
+}
+
+void rpc_t::serve_stat_(tox::friend_id_t /*fr_id*/, codec::reader_t& args, codec::writer_t& result)
+{
+    auto const path = resolve_path_(args.string());
+
+    struct ::stat st{};
+    if (::stat(path.c_str(), &st) != 0)
+    {
+        int const err = errno;
+        throw TOXFS_EXCEPTION(rpc::rpc_error, fmt::format("Cannot stat {}: {}", path.native(), std::strerror(err)), err);
+    }
+
+    auto const mtime = int64_t{st.st_mtim.tv_sec} * 1000000000 + st.st_mtim.tv_nsec;
+    result.u8(static_cast<uint8_t>(file_type_of(st.st_mode)));
+    result.varint(static_cast<uint64_t>(st.st_size));
+    result.varint(static_cast<uint64_t>(mtime));
+    result.varint(st.st_mode & 07777u);
+}
+
+void rpc_t::serve_readdir_(tox::friend_id_t fr_id, codec::reader_t& args, codec::writer_t& result)
+{
+    auto const path = resolve_path_(args.string());
+    auto const offset = args.varint();
+
+    // The directory is listed once for the first page and later pages are
+    // cut from that, so entries neither repeat nor go missing between pages
+    auto& listing = dir_listings_[fr_id.id];
+    if (offset == 0 || listing.path != path)
+    {
+        std::vector<dir_entry_t> entries;
+        for (auto const& entry : std::filesystem::directory_iterator{path})
+            entries.push_back(dir_entry_t{entry.path().filename().string(), file_type_of(entry.symlink_status().type())});
+
+        std::sort(entries.begin(), entries.end(),
+                [](dir_entry_t const& a, dir_entry_t const& b) { return a.name < b.name; });
+        listing = dir_listing_t{path, std::move(entries)};
+    }
+
+    // Room for the entry count, the end marker and the next offset
+    constexpr size_t k_page_overhead = 16;
+    // Room for the length of a name and the type
+    constexpr size_t k_entry_overhead = 4;
+
+    codec::writer_t page;
+    uint64_t count = 0;
+    auto i = std::min<uint64_t>(offset, listing.entries.size());
+    for (; i < listing.entries.size(); i++)
+    {
+        auto const& entry = listing.entries[i];
+        if (page.size() + entry.name.size() + k_entry_overhead + k_page_overhead > codec::k_max_payload_size)
+            break;
+
+        page.string(entry.name);
+        page.u8(static_cast<uint8_t>(entry.type));
+        count++;
+    }
+
+    if (count == 0 && i < listing.entries.size())
+    {
+        throw TOXFS_EXCEPTION(rpc::rpc_error,
+                fmt::format("Directory entry {} does not fit in a packet", listing.entries[i].name), ENAMETOOLONG);
+    }
+
+    result.varint(count);
+    auto const entries = page.take();
+    result.bytes(entries);
+
+    if (i < listing.entries.size())
+    {
+        result.u8(1);
+        result.varint(i);
+    }
+    else
+    {
+        result.u8(0);
+        dir_listings_.erase(fr_id.id);
+    }
+}
+
+void rpc_t::serve_open_(tox::friend_id_t fr_id, codec::reader_t& args, codec::writer_t& result)
+{
+    auto const path = resolve_path_(args.string());
+
+    auto& files = open_files_[fr_id.id];
+    if (files.size() >= config_.max_open_files)
+        throw TOXFS_EXCEPTION(rpc::rpc_error, fmt::format("Friend {} has too many open files", fr_id.id), EMFILE);
+
+    if (std::filesystem::is_directory(path))
+        throw TOXFS_EXCEPTION(rpc::rpc_error, fmt::format("Cannot open {}: is a directory", path.native()), EISDIR);
+
+    auto const handle = next_handle_++;
+    files.emplace(handle, io::file_t{path, io::open_mode_t::read});
+    result.varint(handle);
+}
+
+void rpc_t::serve_read_(tox::friend_id_t fr_id, codec::reader_t& args, codec::writer_t& result)
+{
+    auto const handle = args.varint();
+    auto const position = args.varint();
+    auto const size = static_cast<size_t>(std::min<uint64_t>(args.varint(), k_max_read_size));
+
+    auto files_it = open_files_.find(fr_id.id);
+    if (files_it == open_files_.end() || files_it->second.count(handle) == 0)
+        throw TOXFS_EXCEPTION(rpc::rpc_error, fmt::format("Friend {} has no open file {}", fr_id.id, handle), EBADF);
+
+    std::vector<std::byte> data(size);
+    auto const n = files_it->second.at(handle).read_at(position, gsl::span<std::byte>{data.data(), data.size()});
+    result.bytes(gsl::span<std::byte const>{data.data(), n});
+}
+
+void rpc_t::serve_close_(tox::friend_id_t fr_id, codec::reader_t& args, codec::writer_t& /*result*/)
+{
+    auto const handle = args.varint();
+
+    auto files_it = open_files_.find(fr_id.id);
+    if (files_it == open_files_.end() || files_it->second.erase(handle) == 0)
+        throw TOXFS_EXCEPTION(rpc::rpc_error, fmt::format("Friend {} has no open file {}", fr_id.id, handle), EBADF);
+
+    if (files_it->second.empty())
+        open_files_.erase(files_it);
+}
+
+std::filesystem::path rpc_t::resolve_path_(std::string const& path) const
+{
+    // Paths are relative to the root dir, a leading slash means the same
+    auto const full = std::filesystem::canonical(config_.root_dir / std::filesystem::path{path}.relative_path());
+
+    auto const rel_path = full.lexically_relative(config_.root_dir);
+    if (rel_path.empty() || *rel_path.begin() == "..")
+        throw TOXFS_EXCEPTION(rpc::rpc_error, fmt::format("{} is not in the root dir", path), EACCES);
+
+    return full;
+}
+
+} // namespace toxfs::rpc
@@ -0,0 +1,251 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "toxfs_priv/tox/bootstrap.hh"
+#include "toxfs/exception.hh"
+#include "toxfs/logging.hh"
+
+#include <fmt/core.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include <fstream>
+#include <future>
+#include <optional>
+#include <sstream>
+#include <string>
+
+namespace toxfs::tox
+{
+
+namespace
+{
+
+/* Most nodes kept in the cache */
+constexpr size_t k_max_cached_nodes = 32;
+
+/* The savedata layout of toxcore, see its state.c and DHT.c */
+constexpr uint32_t k_state_cookie_global = 0x15ed1b1f;
+constexpr uint16_t k_state_cookie_type = 0x01ce;
+constexpr uint16_t k_state_type_dht = 2;
+constexpr uint32_t k_dht_state_cookie_global = 0x0159000d;
+constexpr uint16_t k_dht_state_cookie_type = 0x11ce;
+constexpr uint16_t k_dht_state_type_nodes = 4;
+
+/* Address families of packed nodes, the TCP ones are skipped */
+constexpr uint8_t k_packed_inet = 2;
+constexpr uint8_t k_packed_inet6 = 10;
+constexpr uint8_t k_packed_tcp_inet = 130;
+constexpr uint8_t k_packed_tcp_inet6 = 138;
+
+uint32_t load_le32(std::byte const *p) noexcept
+{
+    return std::to_integer<uint32_t>(p[0]) | std::to_integer<uint32_t>(p[1]) << 8 |
+        std::to_integer<uint32_t>(p[2]) << 16 | std::to_integer<uint32_t>(p[3]) << 24;
+}
+
+/**
+ * @brief find the first section of a type in toxcore state data
+ * @return the data of the section, empty if there is none
+ */
+gsl::span<std::byte const> find_section(gsl::span<std::byte const> data, uint16_t cookie, uint16_t type) noexcept
+{
+    constexpr size_t k_header_size = 8;
+    while (data.size() >= k_header_size)
+    {
+        auto const length = load_le32(data.data());
+        auto const cookie_type = load_le32(data.data() + 4);
+        data = data.subspan(k_header_size);
+        if (length > data.size() || (cookie_type >> 16) != cookie)
+            break;
+
+        if ((cookie_type & 0xffff) == type)
+            return data.first(length);
+        data = data.subspan(length);
+    }
+
+    return {};
+}
+
+std::optional<std::string> resolve_host(std::string const& host)
+{
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    addrinfo *result = nullptr;
+    int ret = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+    if (ret != 0)
+    {
+        TOXFS_LOG_WARNING("Cannot resolve bootstrap node {}: {}", host, gai_strerror(ret));
+        return std::nullopt;
+    }
+
+    std::optional<std::string> address;
+    char buf[INET6_ADDRSTRLEN];
+    for (auto *ai = result; ai && !address; ai = ai->ai_next)
+    {
+        void const *src = nullptr;
+        if (ai->ai_family == AF_INET)
+            src = &reinterpret_cast<sockaddr_in const*>(ai->ai_addr)->sin_addr;
+        else if (ai->ai_family == AF_INET6)
+            src = &reinterpret_cast<sockaddr_in6 const*>(ai->ai_addr)->sin6_addr;
+
+        if (src && inet_ntop(ai->ai_family, src, buf, sizeof(buf)))
+            address = std::string{buf};
+    }
+
+    freeaddrinfo(result);
+    return address;
+}
+
+} // namespace
+
+std::vector<bootstrap_node_t> resolve_bootstrap_nodes(std::vector<bootstrap_node_t> const& nodes)
+{
+    // Lookups are slow and block, do them all at once
+    std::vector<std::future<std::optional<std::string>>> lookups;
+    lookups.reserve(nodes.size());
+    for (auto const& node : nodes)
+        lookups.push_back(std::async(std::launch::async, resolve_host, node.host));
+
+    std::vector<bootstrap_node_t> resolved;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        if (auto address = lookups[i].get())
+            resolved.push_back(bootstrap_node_t{std::move(*address), nodes[i].port, nodes[i].key});
+    }
+
+    return resolved;
+}
+
+std::vector<bootstrap_node_t> savedata_dht_nodes(gsl::span<std::byte const> savedata) noexcept
+{
+    std::vector<bootstrap_node_t> nodes;
+    try
+    {
+        // Savedata starts with 4 zero bytes and the global cookie, the DHT section with its own cookie
+        if (savedata.size() < 8 || load_le32(savedata.data()) != 0 || load_le32(savedata.data() + 4) != k_state_cookie_global)
+            return nodes;
+
+        auto const dht = find_section(savedata.subspan(8), k_state_cookie_type, k_state_type_dht);
+        if (dht.size() < 4 || load_le32(dht.data()) != k_dht_state_cookie_global)
+            return nodes;
+
+        // Packed nodes: family, address, port in network order and the DHT key
+        auto packed = find_section(dht.subspan(4), k_dht_state_cookie_type, k_dht_state_type_nodes);
+        while (!packed.empty())
+        {
+            auto const family = std::to_integer<uint8_t>(packed[0]);
+            size_t address_size = 0;
+            if (family == k_packed_inet || family == k_packed_tcp_inet)
+                address_size = 4;
+            else if (family == k_packed_inet6 || family == k_packed_tcp_inet6)
+                address_size = 16;
+            else
+                break;
+
+            auto const node_size = 1 + address_size + 2 + k_public_key_size;
+            if (packed.size() < node_size)
+                break;
+
+            if (family == k_packed_inet || family == k_packed_inet6)
+            {
+                char host[INET6_ADDRSTRLEN];
+                if (inet_ntop(family == k_packed_inet ? AF_INET : AF_INET6, packed.data() + 1, host, sizeof(host)))
+                {
+                    auto const *port = packed.data() + 1 + address_size;
+                    bootstrap_node_t node{host, static_cast<uint16_t>(std::to_integer<uint16_t>(port[0]) << 8 |
+                        std::to_integer<uint16_t>(port[1])), {}};
+
+                    constexpr char k_hex[] = "0123456789ABCDEF";
+                    for (auto b : packed.subspan(1 + address_size + 2, k_public_key_size))
+                    {
+                        node.key += k_hex[std::to_integer<uint8_t>(b) >> 4];
+                        node.key += k_hex[std::to_integer<uint8_t>(b) & 0xf];
+                    }
+
+                    nodes.push_back(std::move(node));
+                }
+            }
+
+            packed = packed.subspan(node_size);
+        }
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_WARNING("Cannot read the DHT nodes of the savedata: {}", e.what());
+        nodes.clear();
+    }
+
+    return nodes;
+}
+
+std::filesystem::path node_cache_path(std::filesystem::path const& save_file)
+{
+    auto path = save_file;
+    path += ".nodes";
+    return path;
+}
+
+std::vector<bootstrap_node_t> load_node_cache(std::filesystem::path const& path) noexcept
+{
+    std::vector<bootstrap_node_t> nodes;
+    try
+    {
+        std::ifstream s{path};
+        std::string line;
+        while (std::getline(s, line) && nodes.size() < k_max_cached_nodes)
+        {
+            std::istringstream ls{line};
+            bootstrap_node_t node;
+            if (ls >> node.host >> node.port >> node.key)
+                nodes.push_back(std::move(node));
+        }
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_WARNING("Cannot read node cache {}: {}", path.native(), e.what());
+        nodes.clear();
+    }
+
+    return nodes;
+}
+
+void store_node_cache(std::filesystem::path const& path, std::vector<bootstrap_node_t> const& nodes)
+{
+    auto tmp = path;
+    tmp += ".tmp";
+
+    {
+        std::ofstream s{tmp, std::ios_base::out | std::ios_base::trunc};
+        for (size_t i = 0; i < nodes.size() && i < k_max_cached_nodes; i++)
+            s << nodes[i].host << ' ' << nodes[i].port << ' ' << nodes[i].key << '\n';
+
+        if (!s.flush())
+            throw TOXFS_EXCEPTION(runtime_error, fmt::format("Cannot write node cache {}", tmp.native()));
+    }
+
+    std::filesystem::rename(tmp, path);
+}
+
+} // namespace toxfs::tox
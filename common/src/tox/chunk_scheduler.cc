@@ -0,0 +1,180 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "toxfs_priv/tox/chunk_scheduler.hh"
+
+#include <algorithm>
+
+namespace toxfs::tox
+{
+
+chunk_scheduler_t::chunk_scheduler_t(size_t quantum) noexcept
+    : quantum_(static_cast<int64_t>(std::max<size_t>(1, quantum)))
+{
+}
+
+void chunk_scheduler_t::add(unique_file_id_t id)
+{
+    if (!files_.emplace(id, file_state_t{}).second)
+        return;
+
+    friends_[id.friend_id.id].files.push_back(id);
+}
+
+void chunk_scheduler_t::remove(unique_file_id_t id)
+{
+    if (files_.erase(id) == 0)
+        return;
+
+    auto it = friends_.find(id.friend_id.id);
+    if (it == friends_.end())
+        return;
+
+    // The friend stays, with its byte count, even once it has no files
+    auto& files = it->second.files;
+    files.erase(std::remove(files.begin(), files.end(), id), files.end());
+}
+
+void chunk_scheduler_t::set_weight(friend_id_t id, unsigned weight)
+{
+    friend_weights_[id.id] = std::max(1u, weight);
+}
+
+void chunk_scheduler_t::set_weight(unique_file_id_t id, unsigned weight)
+{
+    auto it = files_.find(id);
+    if (it != files_.end())
+        it->second.weight = std::max(1u, weight);
+}
+
+unsigned chunk_scheduler_t::schedule(unsigned budget, release_fn_t const& release)
+{
+    unsigned released = 0;
+    bool progress = true;
+    while (progress && released < budget && !friends_.empty())
+    {
+        progress = false;
+
+        // One round, starting where the last one left off
+        auto start = friends_.lower_bound(next_friend_);
+        for (size_t n = 0; n < friends_.size() && released < budget; ++n)
+        {
+            if (start == friends_.end())
+                start = friends_.begin();
+
+            auto const count = serve_friend_(start->second, budget - released, release);
+            released += count;
+            progress = progress || count > 0;
+            ++start;
+        }
+
+        next_friend_ = start == friends_.end() ? 0 : start->first;
+    }
+
+    return released;
+}
+
+unsigned chunk_scheduler_t::serve_friend_(friend_state_t& fr, unsigned budget, release_fn_t const& release)
+{
+    if (fr.files.empty())
+        return 0;
+
+    fr.deficit += quantum_ * friend_weight_(fr.files.front().friend_id);
+
+    unsigned released = 0;
+    size_t idle = 0;
+    while (fr.deficit > 0 && idle < fr.files.size() && released < budget)
+    {
+        fr.next %= fr.files.size();
+        auto& file = files_[fr.files[fr.next]];
+        if (!file.in_turn)
+        {
+            file.deficit += quantum_ * file.weight;
+            file.in_turn = true;
+        }
+
+        bool any = false;
+        while (file.deficit > 0 && fr.deficit > 0 && released < budget)
+        {
+            auto cost = release(fr.files[fr.next]);
+            if (!cost)
+                break;
+
+            auto const bytes = static_cast<int64_t>(std::max<size_t>(1, *cost));
+            file.deficit -= bytes;
+            fr.deficit -= bytes;
+            file.bytes += static_cast<uint64_t>(bytes);
+            fr.bytes += static_cast<uint64_t>(bytes);
+            released++;
+            any = true;
+        }
+
+        if (!any)
+        {
+            // Nothing to send, an idle file does not keep its credit
+            file.deficit = 0;
+            file.in_turn = false;
+            idle++;
+            fr.next++;
+        }
+        else if (file.deficit <= 0)
+        {
+            // Turn used up, the next file goes next
+            file.in_turn = false;
+            idle = 0;
+            fr.next++;
+        }
+        else
+        {
+            // Out of friend credit or budget, the file carries on next round
+            idle = 0;
+        }
+    }
+
+    if (idle >= fr.files.size())
+        fr.deficit = 0;
+
+    return released;
+}
+
+std::vector<friend_share_t> chunk_scheduler_t::shares() const
+{
+    std::vector<friend_share_t> ret;
+    ret.reserve(friends_.size());
+    for (auto const& [id, fr] : friends_)
+    {
+        friend_share_t share{friend_id_t{id}, friend_weight_(friend_id_t{id}), fr.bytes, {}};
+        share.files.reserve(fr.files.size());
+        for (auto const& file_id : fr.files)
+        {
+            auto const& file = files_.at(file_id);
+            share.files.push_back(file_share_t{file_id, file.weight, file.bytes});
+        }
+        ret.push_back(std::move(share));
+    }
+    return ret;
+}
+
+unsigned chunk_scheduler_t::friend_weight_(friend_id_t id) const noexcept
+{
+    auto it = friend_weights_.find(id.id);
+    return it == friend_weights_.end() ? 1u : it->second;
+}
+
+} // namespace toxfs::tox
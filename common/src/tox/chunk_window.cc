@@ -0,0 +1,121 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "toxfs_priv/tox/chunk_window.hh"
+
+#include <algorithm>
+#include <limits>
+
+namespace toxfs::tox
+{
+
+namespace
+{
+
+/* Queueing delay the window aims for */
+constexpr std::chrono::milliseconds k_target_delay{25};
+
+/* The lowest round trip is forgotten after this long, so route changes are picked up */
+constexpr std::chrono::seconds k_min_rtt_lifetime{30};
+
+/* Weight of a new sample in the smoothed round trip */
+constexpr double k_srtt_gain = 1.0 / 8.0;
+
+/* Largest window change per round trip in congestion avoidance, in blocks */
+constexpr double k_gain = 1.0;
+
+} // namespace
+
+chunk_window_t::chunk_window_t(unsigned min_window, unsigned max_window) noexcept
+    : min_window_(std::max(1u, min_window))
+    , max_window_(std::max(min_window_, static_cast<double>(max_window)))
+    , window_(min_window_)
+    , ssthresh_(std::numeric_limits<double>::infinity())
+{
+}
+
+unsigned chunk_window_t::window() const noexcept
+{
+    return static_cast<unsigned>(window_);
+}
+
+void chunk_window_t::on_sent(clock_t::duration rtt) noexcept
+{
+    auto const now = clock_t::now();
+
+    if (srtt_ == clock_t::duration::zero())
+    {
+        srtt_ = rtt;
+    }
+    else
+    {
+        srtt_ += std::chrono::duration_cast<clock_t::duration>((rtt - srtt_) * k_srtt_gain);
+    }
+
+    if (min_rtt_ == clock_t::duration::zero() || rtt <= min_rtt_ || now - min_rtt_time_ > k_min_rtt_lifetime)
+    {
+        min_rtt_ = rtt;
+        min_rtt_time_ = now;
+    }
+
+    auto const queueing = srtt_ - min_rtt_;
+    if (window_ < ssthresh_)
+    {
+        // Slow start, one more per block doubles the window every round trip
+        if (queueing > k_target_delay)
+            ssthresh_ = window_;
+        else
+            window_ += 1.0;
+    }
+    else
+    {
+        auto off_target = 1.0 - std::chrono::duration<double>(queueing) / std::chrono::duration<double>(k_target_delay);
+        off_target = std::clamp(off_target, -1.0, 1.0);
+        window_ += k_gain * off_target / window_;
+    }
+
+    window_ = std::clamp(window_, min_window_, max_window_);
+}
+
+void chunk_window_t::on_sendq() noexcept
+{
+    sendq_events_++;
+
+    auto const now = clock_t::now();
+    if (now - last_decrease_ < srtt_)
+        return;
+
+    window_ = std::max(min_window_, window_ / 2.0);
+    ssthresh_ = window_;
+    last_decrease_ = now;
+}
+
+chunk_window_state_t chunk_window_t::state() const noexcept
+{
+    return chunk_window_state_t
+    {
+        window(),
+        window_ < ssthresh_,
+        std::chrono::duration_cast<std::chrono::microseconds>(srtt_),
+        std::chrono::duration_cast<std::chrono::microseconds>(min_rtt_),
+        sendq_events_
+    };
+}
+
+} // namespace toxfs::tox
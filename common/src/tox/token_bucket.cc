@@ -0,0 +1,96 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "toxfs_priv/tox/token_bucket.hh"
+
+#include <algorithm>
+
+namespace toxfs::tox
+{
+
+namespace
+{
+
+/* The default burst, as a fraction of a second at the rate */
+constexpr double k_default_burst_time = 0.25;
+
+double burst_of(rate_limit_t limit) noexcept
+{
+    if (limit.burst != 0)
+        return static_cast<double>(limit.burst);
+    return static_cast<double>(limit.rate) * k_default_burst_time;
+}
+
+} // namespace
+
+token_bucket_t::token_bucket_t(rate_limit_t limit) noexcept
+    : limit_(limit)
+    , burst_(burst_of(limit))
+    , tokens_(burst_)
+{
+}
+
+void token_bucket_t::set_limit(rate_limit_t limit) noexcept
+{
+    refill_(clock_t::now());
+
+    limit_ = limit;
+    burst_ = burst_of(limit);
+    tokens_ = std::min(tokens_, burst_);
+}
+
+bool token_bucket_t::ready(clock_t::time_point now) noexcept
+{
+    if (limit_.rate == 0)
+        return true;
+
+    refill_(now);
+    return tokens_ > 0;
+}
+
+void token_bucket_t::consume(size_t bytes) noexcept
+{
+    if (limit_.rate == 0)
+        return;
+
+    tokens_ -= static_cast<double>(bytes);
+}
+
+rate_limit_t split_rate_limit(rate_limit_t limit, unsigned n) noexcept
+{
+    n = std::max(1u, n);
+    rate_limit_t part{limit.rate / n, limit.burst / n};
+    if (limit.rate != 0)
+        part.rate = std::max<uint64_t>(part.rate, 1);
+    if (limit.burst != 0)
+        part.burst = std::max<uint64_t>(part.burst, 1);
+    return part;
+}
+
+void token_bucket_t::refill_(clock_t::time_point now) noexcept
+{
+    if (now <= last_refill_)
+        return;
+
+    std::chrono::duration<double> const elapsed = now - last_refill_;
+    last_refill_ = now;
+    tokens_ = std::min(burst_, tokens_ + elapsed.count() * static_cast<double>(limit_.rate));
+}
+
+} // namespace toxfs::tox
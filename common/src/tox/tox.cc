@@ -24,9 +24,15 @@
 #include "toxfs/util/message_queue.hh"
 #include "toxfs/util/compile_utils.hh"
 #include "toxfs/util/string_helpers.hh"
+#include "toxfs/io/mapped_file.hh"
 
 #include "toxfs_priv/tox/tox_if_impl.hh"
 #include "toxfs_priv/tox/tox_if_convert.hh"
+#include "toxfs_priv/tox/bootstrap.hh"
+#include "toxfs_priv/tox/chunk_scheduler.hh"
+#include "toxfs_priv/tox/chunk_window.hh"
+#include "toxfs_priv/tox/instance_id.hh"
+#include "toxfs_priv/tox/token_bucket.hh"
 
 #include <tox/tox.h>
 
@@ -34,6 +40,7 @@
 
 #include <gsl/gsl_util>
 
+#include <algorithm>
 #include <string_view>
 #include <stdexcept>
 #include <chrono>
@@ -45,7 +52,11 @@
 #include <cstring>
 #include <unordered_map>
 #include <queue>
+#include <deque>
+#include <map>
+#include <limits>
 #include <optional>
+#include <future>
 
 namespace toxfs::tox
 {
@@ -95,6 +106,19 @@ void set_promise_from_tox(std::promise<T>& promise_ref, T value, ErrEnum err, co
     }
 }
 
+/* Public nodes to join the network through, unless in LAN mode */
+static bootstrap_node_t const k_public_bootstrap_nodes[] =
+{
+    bootstrap_node_t {
+        "tox.abilinski.com", 33445,
+        "10C00EB250C3233E343E2AEBA07115A5C28920E9C8D29492F6D00B29049EDC7E"
+    },
+    bootstrap_node_t {
+        "tox.initramfs.io", 33445,
+        "3F0A45A268367C1BEA652F258C85F4A66DA76BCAA667A49E770BCC4917AB6A25"
+    },
+};
+
 }  // namespace detail
 
 struct tox_t::impl_t
@@ -103,22 +127,115 @@ struct tox_t::impl_t
     Tox *tox_ = nullptr;
 
     tox_config_t config_;
-    std::shared_ptr<tox_if_impl> if_impl_ptr_;
+    /* The index of this instance among the daemon's Tox instances */
+    size_t instance_;
     send_queue_t& send_queue_ref_;
     recv_queue_t& recv_queue_ref_;
 
+    /* Messages for the interface are collected over a step of the loop and handed over together */
+    std::vector<recv_msg_t> recv_batch_;
+
+    /*
+     * toxcore asks for file data in chunks of about 1.3KB. Rather than pass
+     * each of those up, contiguous requests are read as blocks of
+     * config_.chunk_block_size and the blocks are cut back into chunks here.
+     * The window of each file decides how many blocks are read ahead of
+     * toxcore, a block counts from being released for reading until toxcore
+     * has taken all of it.
+     */
+    static constexpr unsigned k_min_blocks_in_flight = 2;
+    static constexpr unsigned k_max_blocks_in_flight = 64;
+
+    struct released_block_t
+    {
+        uint64_t position;
+        size_t size;
+        std::chrono::steady_clock::time_point time;
+        /* Set once the data is in blocks */
+        bool read{false};
+    };
+
     struct chunk_requests_t
     {
-        long num_in_flight{0};
-        long max_in_flight{16};
+        /* Blocks released and not yet taken by toxcore */
+        unsigned num_in_flight{0};
+        chunk_window_t window{k_min_blocks_in_flight, k_max_blocks_in_flight};
         std::chrono::steady_clock::time_point last_update{std::chrono::steady_clock::now()};
+        /* Chunks toxcore asked for and has not been sent yet, in order */
         std::queue<file_chunk_request_t> requests;
+        /* Blocks released and not yet taken by toxcore, in order */
+        std::deque<released_block_t> released;
+        /* Blocks that have been read, by position */
+        std::map<uint64_t, buffer_chain_t> blocks;
+        /* End of the data handed out for reading */
+        uint64_t requested_end{0};
+        uint64_t filesize{std::numeric_limits<uint64_t>::max()};
+        token_bucket_t bucket{};
+        /*
+         * Set while toxcore's send queue is full. The chunk it refused stays
+         * at the front of requests, its data in blocks, and is offered again
+         * at retry_at, backing off while the queue stays full.
+         */
+        std::optional<std::chrono::steady_clock::time_point> retry_at{};
+        std::chrono::microseconds retry_backoff{0};
+        /* No blocks are handed out while either side has the file paused */
+        bool paused_by_us{false};
+        bool paused_by_friend{false};
     };
     std::unordered_map<unique_file_id_t, chunk_requests_t> chunk_requests_;
 
+    /* Bounds on the wait before offering a chunk toxcore refused again */
+    static constexpr std::chrono::microseconds k_min_retry_backoff{500};
+    static constexpr std::chrono::microseconds k_max_retry_backoff{100000};
+
+    /* Blocks released across all files, and the most allowed */
+    static constexpr unsigned k_max_total_blocks_in_flight = 512;
+    unsigned total_in_flight_{0};
+
+    /* Credit per scheduler round for a weight of 1 is one block */
+    chunk_scheduler_t scheduler_{config_.chunk_block_size};
+
+    /* Bandwidth shaping, file data has to pass the total, its friend's and its file's bucket */
+    struct friend_buckets_t
+    {
+        token_bucket_t upload;
+        token_bucket_t download;
+    };
+    token_bucket_t upload_bucket_{config_.upload_limits.total};
+    token_bucket_t download_bucket_{config_.download_limits.total};
+    std::unordered_map<uint32_t, friend_buckets_t> friend_buckets_;
+
+    struct receive_t
+    {
+        token_bucket_t bucket;
+        /* Paused by the shaping until the buckets fill up again */
+        bool throttled = false;
+    };
+    std::unordered_map<unique_file_id_t, receive_t> receives_;
+
+    /* While file data moved more recently than this the loop runs at the active interval */
+    static constexpr std::chrono::seconds k_file_activity_timeout{1};
+    static constexpr std::chrono::milliseconds k_active_iteration_interval{2};
+    std::chrono::steady_clock::time_point last_file_activity_{};
+
+    /* Startup, for bootstrapping and for reporting how long it takes to come online */
+    std::chrono::steady_clock::time_point start_time_{std::chrono::steady_clock::now()};
+    std::future<std::vector<bootstrap_node_t>> resolving_{};
+    /* The configured nodes once resolved, cached after the nodes that answered */
+    std::vector<bootstrap_node_t> configured_nodes_{};
+    bool self_online_ = false;
+    bool been_online_ = false;
+    bool friend_online_ = false;
+
     std::thread loop_thread_;
 
-    explicit impl_t(tox_config_t const& config);
+    /**
+     * @brief ctor
+     * @param[in] config - the config of this instance
+     * @param[in] instance - the index of this instance
+     * @param[in] if_impl - the interface shared by all instances
+     */
+    impl_t(tox_config_t const& config, size_t instance, tox_if_impl& if_impl);
     ~impl_t() noexcept;
 
     impl_t(impl_t const&) = delete;
@@ -130,6 +247,8 @@ struct tox_t::impl_t
 
     /* Tox Callbacks */
 
+    void on_self_conn_status(TOX_CONNECTION conn_status);
+
     /* Friend */
     void on_friend_request(const uint8_t *public_key, const uint8_t *msg, size_t msg_len);
 
@@ -163,22 +282,131 @@ struct tox_t::impl_t
 
     void on_file_chunk(uint32_t fr_num, uint32_t file_num, uint64_t position, const uint8_t *data, size_t data_len);
 
+    /* Custom Packets */
+
+    void on_lossless_packet(uint32_t fr_num, const uint8_t *data, size_t data_len);
+
     /* Send Handlers */
 
+    void dispatch_send_msg_(send_msg_t&& msg) noexcept;
+
     void send_msg_(send_msg_get_conn_status_t&& msg);
     void send_msg_(send_msg_accept_fr_req_t&& msg);
     void send_msg_(send_msg_fr_message_t&& msg);
     void send_msg_(send_msg_file_send_t&& msg);
     void send_msg_(send_msg_file_control_t&& msg);
+    void send_msg_(send_msg_file_seek_t&& msg);
+    void send_msg_(send_msg_get_chunk_window_t&& msg);
+    void send_msg_(send_msg_set_friend_weight_t&& msg);
+    void send_msg_(send_msg_set_file_weight_t&& msg);
+    void send_msg_(send_msg_get_shares_t&& msg);
+    void send_msg_(send_msg_set_rate_limit_t&& msg);
+    void send_msg_(send_msg_set_friend_rate_limit_t&& msg);
+    void send_msg_(send_msg_set_file_rate_limit_t&& msg);
     void send_msg_(send_msg_file_chunk_t&& msg);
+    void send_msg_(send_msg_lossless_packet_t&& msg);
     void send_msg_(send_msg_savedata_t&& msg);
 
     /* Misc */
 
     void report_file_err_(unique_file_id_t id, tox_error error);
 
+    /**
+     * @brief queue a message for the interface, it goes out with the next flush_recv_
+     */
+    void post_(recv_msg_t&& msg);
+
+    /**
+     * @brief hand the messages queued by post_ to the interface
+     */
+    void flush_recv_();
+
+    /**
+     * @brief write the savedata to the save file, and the node cache next to it
+     * @throws if the save file could not be written
+     */
+    void save_();
+
+    /**
+     * @brief replace the node cache with the DHT nodes of the savedata, then the
+     *        configured nodes. Kept as is if no node has answered.
+     * @param[in] savedata - the savedata
+     */
+    void store_nodes_(gsl::span<std::byte const> savedata) noexcept;
+
+    /**
+     * @brief bootstrap from nodes with numeric hosts, and use them as TCP relays if configured
+     * @return true if any node was usable
+     */
+    bool bootstrap_(std::vector<bootstrap_node_t> const& nodes);
+
+    /**
+     * @brief get the chunk requests of a file being sent, creating them if needed
+     */
+    chunk_requests_t& get_chunk_requests_(unique_file_id_t id);
+
+    /**
+     * @brief forget a file being sent, along with the chunks it has in flight
+     */
+    void erase_chunk_requests_(unique_file_id_t id);
+
     void check_chunk_requests_(std::optional<unique_file_id_t> id);
 
+    /**
+     * @brief hand the next block of a file to the interface for reading if its window allows
+     * @return the size of the block, none if nothing was released
+     */
+    std::optional<size_t> release_block_(unique_file_id_t id);
+
+    /**
+     * @brief take the blocks toxcore has moved past out of flight, feeding the window
+     * @param[in] position - where toxcore is asking for data now
+     */
+    void retire_blocks_(chunk_requests_t& req, uint64_t position, std::chrono::steady_clock::time_point now);
+
+    /**
+     * @brief send the chunks toxcore asked for that have been read
+     */
+    void send_chunks_(unique_file_id_t id, chunk_requests_t& req);
+
+    enum class chunk_sent_t
+    {
+        /* Sent, or failed with an error that has been reported */
+        sent,
+        /* The send queue was full, the chunk has to be sent again */
+        retry,
+        /* The data could not be read, the file has been cancelled */
+        dropped
+    };
+
+    /**
+     * @brief send a chunk to toxcore, errors other than a full send queue are reported
+     */
+    chunk_sent_t send_chunk_(unique_file_id_t id, chunk_requests_t& req, uint64_t position, buffer_chain_t const& data);
+
+    /* Chunks from mappings or several segments are copied here for toxcore, mappings guarded */
+    std::vector<std::byte> chunk_buf_;
+
+    /* Files cancelled while sending, their chunk requests are erased once nothing refers to them */
+    std::vector<unique_file_id_t> dropped_sends_;
+
+    /**
+     * @brief offer chunks that toxcore refused again once their backoff is over
+     */
+    void retry_chunks_();
+
+    friend_buckets_t& get_friend_buckets_(friend_id_t id);
+
+    /**
+     * @brief check if a file being received may take more data
+     */
+    bool download_ready_(unique_file_id_t id, receive_t& recv, std::chrono::steady_clock::time_point now);
+
+    /**
+     * @brief resume received files that were paused by shaping once their buckets allow it
+     */
+    void check_throttled_receives_();
+
     /**
      * Helper for binding a tox callback by passing this of impl_t as user_data
      * and then cast it back and call the corresponding member function after.
@@ -214,11 +442,11 @@ struct tox_t::impl_t
 
 using impl_t = tox_t::impl_t;
 
-impl_t::impl_t(tox_config_t const& config)
+impl_t::impl_t(tox_config_t const& config, size_t instance, tox_if_impl& if_impl)
     : config_(config)
-    , if_impl_ptr_(std::make_shared<tox_if_impl>())
-    , send_queue_ref_(if_impl_ptr_->get_send_queue())
-    , recv_queue_ref_(if_impl_ptr_->get_recv_queue())
+    , instance_(instance)
+    , send_queue_ref_(if_impl.get_send_queue(instance))
+    , recv_queue_ref_(if_impl.get_recv_queue())
 {
     TOX_ERR_OPTIONS_NEW options_err;
     Tox_Options *options = nullptr;
@@ -252,6 +480,19 @@ impl_t::impl_t(tox_config_t const& config)
 
     tox_options_set_log_callback(options, detail::log_callback);
 
+    if (config_.lan_mode)
+    {
+        tox_options_set_local_discovery_enabled(options, true);
+        if (config_.tcp_relays)
+            TOXFS_LOG_WARNING("TCP relays are not used in LAN mode, ignoring tcp_relays");
+    }
+
+    if (config_.udp_start_port != 0 || config_.udp_end_port != 0)
+    {
+        tox_options_set_start_port(options, config_.udp_start_port);
+        tox_options_set_end_port(options, config_.udp_end_port != 0 ? config_.udp_end_port : config_.udp_start_port);
+    }
+
     TOX_ERR_NEW new_err;
     tox_ = tox_new(options, &new_err);
     if (!tox_)
@@ -269,6 +510,9 @@ impl_t::~impl_t() noexcept
 
 void impl_t::setup_callbacks()
 {
+    tox_callback_self_connection_status(tox_,
+        callback_t<decltype(&impl_t::on_self_conn_status)>::callback<&impl_t::on_self_conn_status>);
+
     tox_callback_friend_request(tox_,
         callback_t<decltype(&impl_t::on_friend_request)>::callback<&impl_t::on_friend_request>);
 
@@ -309,59 +553,49 @@ void impl_t::setup_callbacks()
 
     tox_callback_file_recv_chunk(tox_,
         callback_t<decltype(&impl_t::on_file_chunk)>::callback<&impl_t::on_file_chunk>);
+
+    tox_callback_friend_lossless_packet(tox_,
+        callback_t<decltype(&impl_t::on_lossless_packet)>::callback<&impl_t::on_lossless_packet>);
 }
 
 void impl_t::loop()
 {
     setup_callbacks();
 
-    struct bootstrap_node
-    {
-        std::string url;
-        uint16_t port;
-        std::string key;
-    };
-
-    // TODO: put this elsewhere
-    auto nodes =
-    {
-        bootstrap_node {
-            "tox.abilinski.com", 33445,
-            "10C00EB250C3233E343E2AEBA07115A5C28920E9C8D29492F6D00B29049EDC7E"
-        },
-        bootstrap_node {
-            "tox.initramfs.io", 33445,
-            "3F0A45A268367C1BEA652F258C85F4A66DA76BCAA667A49E770BCC4917AB6A25"
-        },
-    };
+    start_time_ = std::chrono::steady_clock::now();
 
+    // Nodes from the last run need no lookups, start with them while the configured ones resolve
     bool ok = false;
-    for (auto const& [url, port, key] : nodes)
+    if (!config_.save_file.empty())
     {
-        TOXFS_LOG_INFO("Bootstrapping using: {}:{}", url, port);
-
-        auto key_bin = hex_string_to_binary(key);
-        TOX_ERR_BOOTSTRAP err;
-        if (tox_bootstrap(tox_, url.c_str(), port, reinterpret_cast<uint8_t*>(key_bin.data()), &err))
-        {
-            ok = true;
-        }
-        else
+        auto cached = load_node_cache(node_cache_path(config_.save_file));
+        if (!cached.empty())
         {
-            TOXFS_LOG_WARNING("Bootstrapping with {}:{} failed: {}", url, port, err);
+            TOXFS_LOG_INFO("Bootstrapping from {} cached nodes", cached.size());
+            ok = bootstrap_(cached);
         }
     }
 
-    if (!ok)
+    std::vector<bootstrap_node_t> nodes;
+    if (!config_.lan_mode)
+        nodes.assign(std::begin(detail::k_public_bootstrap_nodes), std::end(detail::k_public_bootstrap_nodes));
+    nodes.insert(nodes.end(), config_.bootstrap_nodes.begin(), config_.bootstrap_nodes.end());
+    resolving_ = std::async(std::launch::async, [nodes = std::move(nodes)]() { return resolve_bootstrap_nodes(nodes); });
+
+    if (config_.lan_mode)
     {
-        TOXFS_LOG_WARNING("Bootstrapping failed on all nodes! Only local will work.");
+        // What the other peers need to bootstrap from this one directly
+        public_key_t dht_id;
+        tox_self_get_dht_id(tox_, reinterpret_cast<uint8_t*>(dht_id.data()));
+        TOXFS_LOG_INFO("LAN mode, instance {} is on UDP port {} with DHT key {:02x}",
+            instance_, tox_self_get_udp_port(tox_, nullptr), fmt::join(dht_id, ""));
     }
 
 
     address_t addr;
     tox_self_get_address(tox_, reinterpret_cast<uint8_t*>(&addr));
 
-    TOXFS_LOG_INFO("My tox address is: {:02x}", fmt::join(addr.bytes, ""));
+    TOXFS_LOG_INFO("My tox address (instance {}) is: {:02x}", instance_, fmt::join(addr.bytes, ""));
 
     TOXFS_LOG_DEBUG("Tox address breakdown: public_key: {:02x} nospam: {:02x} checksum: {:02x}",
         fmt::join(addr.public_key(), ""),
@@ -371,30 +605,94 @@ void impl_t::loop()
     auto name = std::string_view{"toxfs daemon"};
     tox_self_set_name(tox_, reinterpret_cast<uint8_t const*>(name.data()), name.size(), nullptr);
 
-    std::chrono::steady_clock::time_point start_time;
+    std::vector<send_msg_t> send_batch;
+    send_batch.reserve(k_queue_batch_size);
+
     while (true)
     {
-        start_time = std::chrono::steady_clock::now();
+        auto const start_time = std::chrono::steady_clock::now();
         tox_iterate(tox_, this);
-        auto end_time = start_time + std::chrono::milliseconds{tox_iteration_interval(tox_)};
+
+        if (resolving_.valid() && resolving_.wait_for(std::chrono::seconds{0}) == std::future_status::ready)
+        {
+            configured_nodes_ = resolving_.get();
+            if (!bootstrap_(configured_nodes_) && !ok && !config_.lan_mode)
+                TOXFS_LOG_WARNING("Bootstrapping failed on all nodes! Only local will work.");
+        }
+
+        retry_chunks_();
+        for (auto const& id : dropped_sends_)
+            erase_chunk_requests_(id);
+        dropped_sends_.clear();
         check_chunk_requests_(std::nullopt);
-        auto opt_msg = send_queue_ref_.pop_until_time(end_time);
-        if (opt_msg)
+        check_throttled_receives_();
+
+        // Iterate quickly while files are moving so chunks are not held back by the loop
+        auto interval = std::chrono::milliseconds{tox_iteration_interval(tox_)};
+        if (start_time - last_file_activity_ < k_file_activity_timeout)
+            interval = std::min(interval, k_active_iteration_interval);
+        auto const end_time = start_time + interval;
+
+        flush_recv_();
+
+        // Serve everything queued until the next iteration is due, a batch at a time
+        while (send_queue_ref_.pop_up_to(send_batch, k_queue_batch_size, end_time) > 0)
         {
-            try
-            {
-                std::visit([this](auto&& msg) { send_msg_(std::move(msg)); }, *opt_msg);
-            }
-            catch (toxfs::exception const& e)
-            {
-                TOXFS_LOG_ERROR("Exception while sending message: {}", e.what());
-            }
-            catch (std::exception const& e)
-            {
-                TOXFS_LOG_ERROR("Exception while sending message: {}", e.what());
-            }
+            for (auto& msg : send_batch)
+                dispatch_send_msg_(std::move(msg));
+            send_batch.clear();
+            flush_recv_();
+
+            if (std::chrono::steady_clock::now() >= end_time)
+                break;
         }
-        std::this_thread::sleep_until(end_time);
+    }
+}
+
+void impl_t::dispatch_send_msg_(send_msg_t&& msg) noexcept
+{
+    try
+    {
+        std::visit([this](auto&& m) { send_msg_(std::move(m)); }, msg);
+    }
+    catch (toxfs::exception const& e)
+    {
+        TOXFS_LOG_ERROR("Exception while sending message: {}", e.what());
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_ERROR("Exception while sending message: {}", e.what());
+    }
+}
+
+void impl_t::on_self_conn_status(TOX_CONNECTION conn_status)
+{
+    TOXFS_LOG_DEBUG("on_self_conn_status of instance {}: {}", instance_, int(conn_status));
+
+    bool const was_online = self_online_;
+    self_online_ = conn_status != TOX_CONNECTION_NONE;
+    if (!self_online_ || was_online)
+        return;
+
+    if (!been_online_)
+    {
+        been_online_ = true;
+        auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start_time_);
+        TOXFS_LOG_INFO("Instance {} is online after {}ms", instance_, elapsed.count());
+    }
+
+    if (config_.save_file.empty())
+        return;
+
+    // toxcore keeps the DHT nodes and relays it knows in the savedata, so the next start can use them
+    try
+    {
+        save_();
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_WARNING("Cannot save the nodes for the next start: {}", e.what());
     }
 }
 
@@ -404,7 +702,7 @@ void impl_t::on_friend_request(const uint8_t *public_key, const uint8_t *msg, si
     std::string_view msg_str{reinterpret_cast<const char*>(msg), msg_len};
     TOXFS_LOG_DEBUG("on_friend_request from {:x}: {} (len = {})", fmt::join(public_key_arr, ""), msg_str, msg_len);
 
-    recv_queue_ref_.push(recv_msg_fr_request_t { public_key_arr, std::string{msg_str} });
+    post_(recv_msg_fr_request_t { public_key_arr, std::string{msg_str}, instance_ });
 }
 
 void impl_t::on_friend_msg(uint32_t fr_num, TOX_MESSAGE_TYPE type, const uint8_t *msg, size_t msg_len)
@@ -412,7 +710,7 @@ void impl_t::on_friend_msg(uint32_t fr_num, TOX_MESSAGE_TYPE type, const uint8_t
     std::string_view msg_str{reinterpret_cast<const char*>(msg), msg_len};
     TOXFS_LOG_DEBUG("on_friend_msg from #{}: (type {}) {} (len = {})", fr_num, int(type), msg_str, msg_len);
 
-    recv_queue_ref_.push(recv_msg_fr_message_t { friend_id_t{fr_num}, std::string{msg_str} });
+    post_(recv_msg_fr_message_t { make_friend_id(instance_, fr_num), std::string{msg_str} });
 }
 
 void impl_t::on_friend_name(uint32_t fr_num, const uint8_t *name, size_t name_len)
@@ -420,7 +718,7 @@ void impl_t::on_friend_name(uint32_t fr_num, const uint8_t *name, size_t name_le
     std::string_view name_str{reinterpret_cast<const char*>(name), name_len};
     TOXFS_LOG_DEBUG("on_friend_name from #{}: {} (len = {})", fr_num, name_str, name_len);
 
-    recv_queue_ref_.push(recv_msg_fr_name_t { friend_id_t{fr_num}, std::string{name_str} });
+    post_(recv_msg_fr_name_t { make_friend_id(instance_, fr_num), std::string{name_str} });
 }
 
 void impl_t::on_friend_status(uint32_t fr_num, const uint8_t *msg, size_t msg_len)
@@ -428,13 +726,21 @@ void impl_t::on_friend_status(uint32_t fr_num, const uint8_t *msg, size_t msg_le
     std::string_view msg_str{reinterpret_cast<const char*>(msg), msg_len};
     TOXFS_LOG_DEBUG("on_friend_status from #{}: {} (len = {})", fr_num, msg_str, msg_len);
 
-    recv_queue_ref_.push(recv_msg_fr_status_t { friend_id_t{fr_num}, std::string{msg_str} });
+    post_(recv_msg_fr_status_t { make_friend_id(instance_, fr_num), std::string{msg_str} });
 }
 
 void impl_t::on_friend_conn_status(uint32_t fr_num, TOX_CONNECTION conn_status)
 {
     TOXFS_LOG_DEBUG("on_friend_conn_status from #{}: {}", fr_num, int(conn_status));
 
+    if (conn_status != TOX_CONNECTION_NONE && !friend_online_)
+    {
+        friend_online_ = true;
+        auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start_time_);
+        TOXFS_LOG_INFO("First friend of instance {} online after {}ms", instance_, elapsed.count());
+    }
+
     // TODO
 }
 
@@ -471,7 +777,20 @@ void impl_t::on_file_control(uint32_t fr_num, uint32_t file_num, TOX_FILE_CONTRO
 {
     TOXFS_LOG_DEBUG("on_file_control from #{}: file #{} ctrl {}", fr_num, file_num, int(file_ctrl));
 
-    recv_queue_ref_.push(recv_msg_file_control_t { unique_file_id_t{fr_num, file_num}, from_tox::convert(file_ctrl) });
+    unique_file_id_t const file_id{make_friend_id(instance_, fr_num), file_id_t{file_num}};
+    if (file_ctrl == TOX_FILE_CONTROL_CANCEL)
+    {
+        receives_.erase(file_id);
+        erase_chunk_requests_(file_id);
+    }
+    else if (auto it = chunk_requests_.find(file_id); it != chunk_requests_.end())
+    {
+        it->second.paused_by_friend = file_ctrl == TOX_FILE_CONTROL_PAUSE;
+        if (file_ctrl == TOX_FILE_CONTROL_RESUME)
+            check_chunk_requests_(file_id);
+    }
+
+    post_(recv_msg_file_control_t { file_id, from_tox::convert(file_ctrl) });
 }
 
 void impl_t::on_file_recv(uint32_t fr_num, uint32_t file_num, uint32_t kind, uint64_t file_size,
@@ -487,20 +806,30 @@ void impl_t::on_file_recv(uint32_t fr_num, uint32_t file_num, uint32_t kind, uin
         return;
     }
 
-    recv_queue_ref_.push(recv_msg_file_receive_t { unique_file_id_t{fr_num, file_num}, {std::string{filename_str}, file_size} });
+    file_hash_t hash{};
+    if (!tox_file_get_file_id(tox_, fr_num, file_num, reinterpret_cast<uint8_t*>(hash.data()), nullptr))
+        TOXFS_LOG_WARNING("Cannot get the file id of file #{} from #{}", file_num, fr_num);
+
+    unique_file_id_t const file_id{make_friend_id(instance_, fr_num), file_id_t{file_num}};
+    receives_.insert_or_assign(file_id, receive_t{token_bucket_t{config_.download_limits.per_file}});
+
+    post_(recv_msg_file_receive_t { file_id,
+            {std::string{filename_str}, file_size, hash} });
 }
 
 void impl_t::on_file_chunk_request(uint32_t fr_num, uint32_t file_num, uint64_t position, size_t length)
 {
     // TOXFS_LOG_DEBUG("on_file_chunk_request from #{}: file #{} position {} len {}", fr_num, file_num, position, length);
 
-    unique_file_id_t file_id{fr_num, file_num};
+    unique_file_id_t file_id{make_friend_id(instance_, fr_num), file_id_t{file_num}};
 
-    auto& req = chunk_requests_[file_id];
+    auto& req = get_chunk_requests_(file_id);
 
     req.requests.push(file_chunk_request_t{position, length});
     req.last_update = std::chrono::steady_clock::now();
+    last_file_activity_ = req.last_update;
 
+    send_chunks_(file_id, req);
     check_chunk_requests_(file_id);
 }
 
@@ -508,10 +837,42 @@ void impl_t::on_file_chunk(uint32_t fr_num, uint32_t file_num, uint64_t position
 {
     // TOXFS_LOG_DEBUG("on_file_chunk from #{}: file #{} position {} len {}", fr_num, file_num, position, data_len);
 
+    auto const now = std::chrono::steady_clock::now();
+    last_file_activity_ = now;
+
+    unique_file_id_t const file_id{make_friend_id(instance_, fr_num), file_id_t{file_num}};
+    auto it = receives_.find(file_id);
+    if (data_len == 0)
+    {
+        // The whole file has arrived
+        if (it != receives_.end())
+            receives_.erase(it);
+    }
+    else if (it != receives_.end())
+    {
+        download_bucket_.consume(data_len);
+        get_friend_buckets_(file_id.friend_id).download.consume(data_len);
+        it->second.bucket.consume(data_len);
+
+        // Over the limit, hold the sender off until the buckets have filled up again
+        if (!it->second.throttled && !download_ready_(file_id, it->second, now))
+        {
+            if (tox_file_control(tox_, fr_num, file_num, TOX_FILE_CONTROL_PAUSE, nullptr))
+                it->second.throttled = true;
+        }
+    }
+
     buffer_t buf{data_len};
     std::memcpy(buf.data(), data, data_len);
     buf.set_size(data_len);
-    recv_queue_ref_.push(recv_msg_file_chunk_t { unique_file_id_t{fr_num, file_num}, {position, std::move(buf)} });
+    post_(recv_msg_file_chunk_t { file_id, {position, buffer_chain_t{std::move(buf)}} });
+}
+
+void impl_t::on_lossless_packet(uint32_t fr_num, const uint8_t *data, size_t data_len)
+{
+    auto const bytes = reinterpret_cast<std::byte const*>(data);
+    post_(recv_msg_lossless_packet_t {
+        make_friend_id(instance_, fr_num), std::vector<std::byte>(bytes, bytes + data_len) });
 }
 
 void impl_t::send_msg_(send_msg_get_conn_status_t&& /*msg*/)
@@ -524,13 +885,13 @@ void impl_t::send_msg_(send_msg_accept_fr_req_t&& msg)
     TOX_ERR_FRIEND_ADD err;
     uint32_t fr_id = tox_friend_add_norequest(tox_, reinterpret_cast<uint8_t const*>(msg.public_key.data()), &err);
 
-    detail::set_promise_from_tox(msg.promise, friend_id_t{fr_id}, err, "tox_friend_add_norequest failed");
+    detail::set_promise_from_tox(msg.promise, make_friend_id(instance_, fr_id), err, "tox_friend_add_norequest failed");
 }
 
 void impl_t::send_msg_(send_msg_fr_message_t&& msg)
 {
     TOX_ERR_FRIEND_SEND_MESSAGE err = TOX_ERR_FRIEND_SEND_MESSAGE_OK;
-    auto msg_id = tox_friend_send_message(tox_, msg.id.id, TOX_MESSAGE_TYPE_NORMAL,
+    auto msg_id = tox_friend_send_message(tox_, friend_number_of(msg.id), TOX_MESSAGE_TYPE_NORMAL,
             reinterpret_cast<uint8_t const*>(msg.message.data()), msg.message.size(), &err);
 
     detail::set_promise_from_tox(msg.promise, message_id_t{msg_id}, err, "tox_friend_send_message failed");
@@ -539,43 +900,180 @@ void impl_t::send_msg_(send_msg_fr_message_t&& msg)
 void impl_t::send_msg_(send_msg_file_send_t&& msg)
 {
     TOX_ERR_FILE_SEND err = TOX_ERR_FILE_SEND_OK;
-    auto file_id = tox_file_send(tox_, msg.id.id, TOX_FILE_KIND_DATA, msg.info.filesize, nullptr,
+    bool const has_hash = std::any_of(msg.info.hash.begin(), msg.info.hash.end(),
+            [](std::byte b) { return b != std::byte{0}; });
+    auto file_id = tox_file_send(tox_, friend_number_of(msg.id), TOX_FILE_KIND_DATA, msg.info.filesize,
+            has_hash ? reinterpret_cast<uint8_t const*>(msg.info.hash.data()) : nullptr,
             reinterpret_cast<uint8_t const*>(msg.info.filename.data()), msg.info.filename.size(), &err);
 
     auto uniq_id = unique_file_id_t{msg.id, file_id_t{file_id}};
+    if (!err)
+        get_chunk_requests_(uniq_id).filesize = msg.info.filesize;
     detail::set_promise_from_tox(msg.promise, uniq_id, err, "tox_file_send failed");
+
+    // Run the callback on the interface's thread, it must not block the tox loop
+    if (msg.callback)
+        post_(recv_msg_file_send_done_t{std::move(msg.callback), msg.promise.get_future()});
 }
 
 void impl_t::send_msg_(send_msg_file_control_t&& msg)
 {
+    if (auto it = receives_.find(msg.id); it != receives_.end())
+    {
+        auto& recv = it->second;
+        if (msg.control == file_control_t::resume)
+        {
+            // Leave the file paused, check_throttled_receives_ resumes it when the buckets allow
+            if (recv.throttled || !download_ready_(msg.id, recv, std::chrono::steady_clock::now()))
+            {
+                recv.throttled = true;
+                return;
+            }
+        }
+        else
+        {
+            recv.throttled = false;
+        }
+    }
+
+    if (msg.control == file_control_t::cancel)
+    {
+        receives_.erase(msg.id);
+        erase_chunk_requests_(msg.id);
+    }
+
     TOX_ERR_FILE_CONTROL err = TOX_ERR_FILE_CONTROL_OK;
-    bool ok = tox_file_control(tox_, msg.id.friend_id.id, msg.id.file_id.id, to_tox::convert(msg.control), &err);
+    bool ok = tox_file_control(tox_, friend_number_of(msg.id.friend_id), msg.id.file_id.id, to_tox::convert(msg.control), &err);
 
     if (!ok)
     {
         report_file_err_(msg.id, TOXFS_EXCEPTION(tox::tox_error, "tox_file_control failed", err));
     }
+    else if (auto it = chunk_requests_.find(msg.id); it != chunk_requests_.end())
+    {
+        it->second.paused_by_us = msg.control == file_control_t::pause;
+        if (msg.control == file_control_t::resume)
+            check_chunk_requests_(msg.id);
+    }
 }
 
-void impl_t::send_msg_(send_msg_file_chunk_t&& msg)
+void impl_t::send_msg_(send_msg_file_seek_t&& msg)
 {
-    TOX_ERR_FILE_SEND_CHUNK err = TOX_ERR_FILE_SEND_CHUNK_OK;
-    bool ok = tox_file_send_chunk(tox_, msg.id.friend_id.id, msg.id.file_id.id, msg.chunk.position,
-            reinterpret_cast<uint8_t const*>(msg.chunk.data.data()), msg.chunk.data.size(), &err);
+    TOX_ERR_FILE_SEEK err = TOX_ERR_FILE_SEEK_OK;
+    bool ok = tox_file_seek(tox_, friend_number_of(msg.id.friend_id), msg.id.file_id.id, msg.position, &err);
 
     if (!ok)
     {
-        report_file_err_(msg.id, TOXFS_EXCEPTION(tox::tox_error, "tox_file_send_chunk failed", err));
+        report_file_err_(msg.id, TOXFS_EXCEPTION(tox::tox_error, "tox_file_seek failed", err));
     }
+}
 
-    auto& req = chunk_requests_[msg.id];
-    req.last_update = std::chrono::steady_clock::now();
-    req.num_in_flight--;
+void impl_t::send_msg_(send_msg_get_chunk_window_t&& msg)
+{
+    auto it = chunk_requests_.find(msg.id);
+    if (it != chunk_requests_.end())
+        msg.promise.set_value(it->second.window.state());
+    else
+        msg.promise.set_value(std::nullopt);
+}
+
+void impl_t::send_msg_(send_msg_set_friend_weight_t&& msg)
+{
+    scheduler_.set_weight(msg.id, msg.weight);
+}
+
+void impl_t::send_msg_(send_msg_set_file_weight_t&& msg)
+{
+    scheduler_.set_weight(msg.id, msg.weight);
+}
+
+void impl_t::send_msg_(send_msg_get_shares_t&& msg)
+{
+    msg.promise.set_value(scheduler_.shares());
+}
+
+void impl_t::send_msg_(send_msg_set_rate_limit_t&& msg)
+{
+    if (msg.direction == transfer_direction_t::upload)
+        upload_bucket_.set_limit(msg.limit);
+    else
+        download_bucket_.set_limit(msg.limit);
+}
+
+void impl_t::send_msg_(send_msg_set_friend_rate_limit_t&& msg)
+{
+    auto& buckets = get_friend_buckets_(msg.id);
+    if (msg.direction == transfer_direction_t::upload)
+        buckets.upload.set_limit(msg.limit);
+    else
+        buckets.download.set_limit(msg.limit);
+}
+
+void impl_t::send_msg_(send_msg_set_file_rate_limit_t&& msg)
+{
+    if (auto it = receives_.find(msg.id); it != receives_.end())
+        it->second.bucket.set_limit(msg.limit);
+    else
+        get_chunk_requests_(msg.id).bucket.set_limit(msg.limit);
+}
+
+void impl_t::send_msg_(send_msg_file_chunk_t&& msg)
+{
+    auto req_it = chunk_requests_.find(msg.id);
+    if (req_it == chunk_requests_.end())
+    {
+        // Cancelled while the chunk was being read
+        return;
+    }
+    auto& req = req_it->second;
 
+    auto const now = std::chrono::steady_clock::now();
+    auto released_it = std::find_if(req.released.begin(), req.released.end(),
+        [&](released_block_t const& b) { return b.position == msg.chunk.position; });
+    if (released_it != req.released.end())
+    {
+        if (msg.chunk.data.empty())
+        {
+            // The block could not be read, it is handed out again when toxcore asks for it
+            req.requested_end = std::min(req.requested_end, msg.chunk.position);
+            req.released.erase(released_it);
+            req.num_in_flight--;
+            total_in_flight_--;
+        }
+        else
+        {
+            // Stays in flight until toxcore has taken it, see retire_blocks_
+            released_it->read = true;
+        }
+    }
+    req.last_update = now;
+
+    if (msg.chunk.data.size() > 0)
+        req.blocks.insert_or_assign(msg.chunk.position, std::move(msg.chunk.data));
+
+    send_chunks_(msg.id, req);
     check_chunk_requests_(msg.id);
 }
 
+void impl_t::send_msg_(send_msg_lossless_packet_t&& msg)
+{
+    TOX_ERR_FRIEND_CUSTOM_PACKET err = TOX_ERR_FRIEND_CUSTOM_PACKET_OK;
+    bool ok = tox_friend_send_lossless_packet(tox_, friend_number_of(msg.id),
+            reinterpret_cast<uint8_t const*>(msg.packet.data()), msg.packet.size(), &err);
+
+    if (!ok)
+    {
+        post_(recv_msg_lossless_packet_error_t {
+            msg.id, std::move(msg.packet), TOXFS_EXCEPTION(tox::tox_error, "tox_friend_send_lossless_packet failed", err) });
+    }
+}
+
 void impl_t::send_msg_(send_msg_savedata_t&&)
+{
+    save_();
+}
+
+void impl_t::save_()
 {
     std::vector<char> data;
     data.resize(tox_get_savedata_size(tox_));
@@ -586,86 +1084,439 @@ void impl_t::send_msg_(send_msg_savedata_t&&)
     s.write(data.data(), static_cast<std::streamoff>(data.size()));
 
     TOXFS_LOG_INFO("Successfully saved tox savedata to {}", config_.save_file.native());
+
+    store_nodes_(gsl::span<std::byte const>{reinterpret_cast<std::byte const*>(data.data()), data.size()});
+}
+
+void impl_t::store_nodes_(gsl::span<std::byte const> savedata) noexcept
+{
+    if (config_.save_file.empty())
+        return;
+
+    // The nodes toxcore has heard from go first, configured ones the cache limit drops
+    // are resolved again on every start anyway
+    auto nodes = savedata_dht_nodes(savedata);
+    if (nodes.empty())
+        return;
+
+    for (auto const& node : configured_nodes_)
+    {
+        bool const known = std::any_of(nodes.begin(), nodes.end(),
+            [&](bootstrap_node_t const& n) { return n.host == node.host && n.port == node.port; });
+        if (!known)
+            nodes.push_back(node);
+    }
+
+    try
+    {
+        store_node_cache(node_cache_path(config_.save_file), nodes);
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_WARNING("Cannot save the nodes for the next start: {}", e.what());
+    }
 }
 
 void impl_t::report_file_err_(unique_file_id_t id, tox_error error)
 {
-    recv_queue_ref_.push(recv_msg_file_error_t{id, std::move(error)});
+    post_(recv_msg_file_error_t{id, std::move(error)});
 }
 
-void impl_t::check_chunk_requests_(std::optional<unique_file_id_t> opt_id)
+void impl_t::post_(recv_msg_t&& msg)
 {
-    if (opt_id)
+    recv_batch_.push_back(std::move(msg));
+}
+
+void impl_t::flush_recv_()
+{
+    if (recv_batch_.empty())
+        return;
+
+    recv_queue_ref_.push_bulk(recv_batch_.begin(), recv_batch_.end());
+    recv_batch_.clear();
+}
+
+bool impl_t::bootstrap_(std::vector<bootstrap_node_t> const& nodes)
+{
+    bool ok = false;
+    for (auto const& node : nodes)
     {
-        auto& file_id = *opt_id;
-        auto& [num_in_flight, max_in_flight, last_update, requests] = chunk_requests_[file_id];
+        TOXFS_LOG_INFO("Bootstrapping using: {}:{}", node.host, node.port);
+
+        auto key_bin = hex_string_to_binary(node.key);
+        if (key_bin.size() != k_public_key_size)
+        {
+            TOXFS_LOG_WARNING("Bootstrap node {}:{} has a bad key", node.host, node.port);
+            continue;
+        }
 
-        while (num_in_flight < max_in_flight && !requests.empty())
+        TOX_ERR_BOOTSTRAP err;
+        if (!tox_bootstrap(tox_, node.host.c_str(), node.port, reinterpret_cast<uint8_t*>(key_bin.data()), &err))
+        {
+            TOXFS_LOG_WARNING("Bootstrapping with {}:{} failed: {}", node.host, node.port, err);
+            continue;
+        }
+
+        if (!config_.lan_mode && config_.tcp_relays &&
+            !tox_add_tcp_relay(tox_, node.host.c_str(), node.port, reinterpret_cast<uint8_t*>(key_bin.data()), &err))
         {
-            recv_queue_ref_.push(recv_msg_file_chunk_request_t{ file_id, requests.front() });
-            requests.pop();
-            num_in_flight++;
+            TOXFS_LOG_WARNING("Adding TCP relay {}:{} failed: {}", node.host, node.port, err);
         }
+
+        ok = true;
     }
-    else
+
+    return ok;
+}
+
+void impl_t::send_chunks_(unique_file_id_t id, chunk_requests_t& req)
+{
+    auto const now = std::chrono::steady_clock::now();
+    if (req.retry_at && now < *req.retry_at)
+        return;
+
+    while (!req.requests.empty())
     {
-        auto now = std::chrono::steady_clock::now();
-        std::vector<unique_file_id_t> to_erase;
-        for (auto& [file_id, req] : chunk_requests_)
+        auto const request = req.requests.front();
+        if (request.size == 0)
+        {
+            // End of file, let the interface know the file is done
+            post_(recv_msg_file_chunk_request_t{ id, request });
+            req.requests.pop();
+            continue;
+        }
+
+        // Blocks toxcore is done with
+        retire_blocks_(req, request.position, now);
+        while (!req.blocks.empty() &&
+            req.blocks.begin()->first + req.blocks.begin()->second.size() <= request.position)
         {
-            auto& [num_in_flight, max_in_flight, last_update, requests] = req;
+            req.blocks.erase(req.blocks.begin());
+        }
+
+        auto it = req.blocks.upper_bound(request.position);
+        if (it == req.blocks.begin())
+            break;
+        --it;
 
-            if (now - last_update > std::chrono::seconds{60})
+        auto const offset = static_cast<size_t>(request.position - it->first);
+        auto const& block = it->second;
+        auto sent = chunk_sent_t::sent;
+        if (offset + request.size <= block.size())
+        {
+            sent = send_chunk_(id, req, request.position, block.slice(offset, request.size));
+        }
+        else
+        {
+            // Straddles two blocks, chain the two parts once both are here
+            auto next = std::next(it);
+            if (next == req.blocks.end() || next->first != it->first + block.size() ||
+                offset + request.size > block.size() + next->second.size())
             {
-                to_erase.push_back(file_id);
-                continue;
+                break;
             }
 
-            if (num_in_flight == 0 && !requests.empty() && max_in_flight < 64)
+            auto const head = block.size() - offset;
+            auto data = block.slice(offset, head);
+            data.append(next->second.slice(0, request.size - head));
+            sent = send_chunk_(id, req, request.position, data);
+        }
+
+        if (sent == chunk_sent_t::dropped)
+            return;
+
+        if (sent == chunk_sent_t::retry)
+        {
+            // Keep the chunk and back off, toxcore wants it before anything after it
+            req.retry_backoff = std::clamp(req.retry_backoff * 2, k_min_retry_backoff, k_max_retry_backoff);
+            req.retry_at = now + req.retry_backoff;
+            return;
+        }
+
+        req.requests.pop();
+        req.retry_at.reset();
+        req.retry_backoff = std::chrono::microseconds{0};
+    }
+}
+
+void impl_t::retry_chunks_()
+{
+    auto const now = std::chrono::steady_clock::now();
+    for (auto& [file_id, req] : chunk_requests_)
+    {
+        if (req.retry_at && now >= *req.retry_at)
+        {
+            req.retry_at.reset();
+            req.last_update = now;
+            send_chunks_(file_id, req);
+        }
+    }
+}
+
+impl_t::chunk_sent_t impl_t::send_chunk_(unique_file_id_t id, chunk_requests_t& req, uint64_t position,
+        buffer_chain_t const& data)
+{
+    // toxcore wants the chunk in one piece. A single segment of plain memory is passed as is, the
+    // rest is copied, mappings guarded as the file may have shrunk since
+    auto const& segments = data.segments();
+    std::byte const *chunk = nullptr;
+    if (segments.size() == 1 && !segments.front().mapped())
+    {
+        chunk = segments.front().data();
+    }
+    else
+    {
+        chunk_buf_.resize(data.size());
+        size_t done = 0;
+        for (auto const& segment : segments)
+        {
+            if (!segment.mapped())
             {
-                max_in_flight *= 2;
+                std::memcpy(chunk_buf_.data() + done, segment.data(), segment.size());
             }
-
-            while (num_in_flight < max_in_flight && !requests.empty())
+            else if (!io::mapped_file_t::guarded_copy(chunk_buf_.data() + done, segment.data(), segment.size()))
             {
-                recv_queue_ref_.push(recv_msg_file_chunk_request_t{ file_id, requests.front() });
-                requests.pop();
-                num_in_flight++;
+                TOXFS_LOG_ERROR("File #{} to #{} was truncated while being sent, cancelling it",
+                    id.file_id.id, friend_number_of(id.friend_id));
+                tox_file_control(tox_, friend_number_of(id.friend_id), id.file_id.id, TOX_FILE_CONTROL_CANCEL, nullptr);
+                post_(recv_msg_file_control_t{ id, file_control_t::cancel });
+                req.paused_by_us = true;
+                req.requests = {};
+                req.blocks.clear();
+                dropped_sends_.push_back(id);
+                return chunk_sent_t::dropped;
             }
+            done += segment.size();
+        }
+        chunk = chunk_buf_.data();
+    }
+
+    TOX_ERR_FILE_SEND_CHUNK err = TOX_ERR_FILE_SEND_CHUNK_OK;
+    bool ok = tox_file_send_chunk(tox_, friend_number_of(id.friend_id), id.file_id.id, position,
+            reinterpret_cast<uint8_t const*>(chunk), data.size(), &err);
+
+    if (!ok)
+    {
+        if (err == TOX_ERR_FILE_SEND_CHUNK_SENDQ)
+        {
+            // Not an error, the network is behind, so read less ahead of it
+            req.window.on_sendq();
+            return chunk_sent_t::retry;
+        }
+
+        report_file_err_(id, TOXFS_EXCEPTION(tox::tox_error, "tox_file_send_chunk failed", err));
+    }
+
+    return chunk_sent_t::sent;
+}
+
+std::optional<size_t> impl_t::release_block_(unique_file_id_t id)
+{
+    auto it = chunk_requests_.find(id);
+    if (it == chunk_requests_.end())
+        return std::nullopt;
+
+    auto& req = it->second;
+    if (req.num_in_flight >= req.window.window() || req.requests.empty() ||
+        req.paused_by_us || req.paused_by_friend)
+    {
+        return std::nullopt;
+    }
+
+    // toxcore jumped somewhere that was not read ahead, after a seek, start over from there
+    auto const& front = req.requests.front();
+    auto const read_start = !req.blocks.empty() ? req.blocks.begin()->first
+        : !req.released.empty() ? req.released.front().position : req.requested_end;
+    if (front.position >= req.requested_end || front.position < read_start)
+    {
+        // Blocks read ahead of the old position are not taken, they say nothing about the network
+        total_in_flight_ -= static_cast<unsigned>(req.released.size());
+        req.num_in_flight = 0;
+        req.released.clear();
+        req.blocks.clear();
+        req.requested_end = front.position;
+    }
+
+    // How far ahead of toxcore to read is up to the window
+    auto const block_size = std::max<size_t>(config_.chunk_block_size, front.size);
+    if (req.requested_end >= req.filesize)
+        return std::nullopt;
+
+    // Held back by shaping, the window is left as it is so the file picks up where it was
+    auto const now = std::chrono::steady_clock::now();
+    auto& friend_bucket = get_friend_buckets_(id.friend_id).upload;
+    if (!upload_bucket_.ready(now) || !friend_bucket.ready(now) || !req.bucket.ready(now))
+    {
+        // Waiting on a limit is not a stalled transfer
+        req.last_update = now;
+        return std::nullopt;
+    }
+
+    // Whole chunks only, so chunks rarely straddle blocks
+    auto size = front.size > 0 ? block_size - block_size % front.size : block_size;
+    size = static_cast<size_t>(std::min<uint64_t>(size, req.filesize - req.requested_end));
+    file_chunk_request_t const block{req.requested_end, size};
+
+    upload_bucket_.consume(block.size);
+    friend_bucket.consume(block.size);
+    req.bucket.consume(block.size);
+
+    req.released.push_back(released_block_t{block.position, block.size, now});
+    req.requested_end += block.size;
+    req.num_in_flight++;
+    total_in_flight_++;
+
+    post_(recv_msg_file_chunk_request_t{ id, block });
+    return block.size;
+}
+
+void impl_t::retire_blocks_(chunk_requests_t& req, uint64_t position, std::chrono::steady_clock::time_point now)
+{
+    while (!req.released.empty())
+    {
+        auto const& block = req.released.front();
+        if (!block.read || block.position + block.size > position)
+            break;
+
+        // From release to toxcore taking the last of it, grows as the network falls behind
+        req.window.on_sent(now - block.time);
+        req.released.pop_front();
+        req.num_in_flight--;
+        total_in_flight_--;
+    }
+}
+
+void impl_t::check_chunk_requests_(std::optional<unique_file_id_t> opt_id)
+{
+    if (opt_id)
+    {
+        scheduler_.add(*opt_id);
+    }
+    else
+    {
+        auto now = std::chrono::steady_clock::now();
+        std::vector<unique_file_id_t> to_erase;
+        for (auto& [file_id, req] : chunk_requests_)
+        {
+            // A paused file is not stalled, it waits for a resume
+            if (!req.paused_by_us && !req.paused_by_friend && now - req.last_update > std::chrono::seconds{60})
+                to_erase.push_back(file_id);
         }
 
         for (auto const& file_id : to_erase)
         {
-            chunk_requests_.erase(file_id);
+            erase_chunk_requests_(file_id);
+        }
+    }
+
+    if (total_in_flight_ < k_max_total_blocks_in_flight &&
+        upload_bucket_.ready(std::chrono::steady_clock::now()))
+    {
+        scheduler_.schedule(k_max_total_blocks_in_flight - total_in_flight_,
+            [this](unique_file_id_t id) { return release_block_(id); });
+    }
+}
+
+impl_t::chunk_requests_t& impl_t::get_chunk_requests_(unique_file_id_t id)
+{
+    auto [it, inserted] = chunk_requests_.try_emplace(id);
+    if (inserted)
+        it->second.bucket.set_limit(config_.upload_limits.per_file);
+    return it->second;
+}
+
+void impl_t::erase_chunk_requests_(unique_file_id_t id)
+{
+    auto it = chunk_requests_.find(id);
+    if (it == chunk_requests_.end())
+        return;
+
+    total_in_flight_ -= it->second.num_in_flight;
+    chunk_requests_.erase(it);
+    scheduler_.remove(id);
+}
+
+impl_t::friend_buckets_t& impl_t::get_friend_buckets_(friend_id_t id)
+{
+    auto it = friend_buckets_.find(id.id);
+    if (it == friend_buckets_.end())
+    {
+        it = friend_buckets_.emplace(id.id, friend_buckets_t{
+            token_bucket_t{config_.upload_limits.per_friend},
+            token_bucket_t{config_.download_limits.per_friend}}).first;
+    }
+    return it->second;
+}
+
+bool impl_t::download_ready_(unique_file_id_t id, receive_t& recv, std::chrono::steady_clock::time_point now)
+{
+    return download_bucket_.ready(now) &&
+        get_friend_buckets_(id.friend_id).download.ready(now) &&
+        recv.bucket.ready(now);
+}
+
+void impl_t::check_throttled_receives_()
+{
+    auto const now = std::chrono::steady_clock::now();
+    for (auto& [file_id, recv] : receives_)
+    {
+        if (!recv.throttled || !download_ready_(file_id, recv, now))
+            continue;
+
+        TOX_ERR_FILE_CONTROL err = TOX_ERR_FILE_CONTROL_OK;
+        if (!tox_file_control(tox_, friend_number_of(file_id.friend_id), file_id.file_id.id, TOX_FILE_CONTROL_RESUME, &err))
+        {
+            report_file_err_(file_id, TOXFS_EXCEPTION(tox::tox_error, "tox_file_control failed", err));
         }
+        recv.throttled = false;
     }
 }
 
 tox_t::tox_t(tox_config_t const& config)
-    : impl_(std::make_unique<impl_t>(config))
-{}
+    : if_impl_(std::make_shared<tox_if_impl>(std::max(1u, config.instances)))
+{
+    auto const n = std::max(1u, config.instances);
+    for (unsigned i = 0; i < n; i++)
+    {
+        // Every instance is its own identity with its own save file, and takes an even part of the limits
+        tox_config_t instance_config = config;
+        if (i > 0 && !config.save_file.empty())
+            instance_config.save_file += fmt::format(".{}", i);
+
+        for (auto* limits : {&instance_config.upload_limits, &instance_config.download_limits})
+            limits->total = split_rate_limit(limits->total, n);
+
+        instances_.push_back(std::make_unique<impl_t>(instance_config, i, *if_impl_));
+    }
+}
 
 tox_t::~tox_t() noexcept
 {}
 
 std::shared_ptr<tox_if> tox_t::get_interface()
 {
-    return impl_->if_impl_ptr_;
+    return if_impl_;
 }
 
 void tox_t::start()
 {
-    impl_->loop_thread_ = std::thread([this]() { impl_->loop(); });
+    for (auto& instance : instances_)
+    {
+        auto* impl = instance.get();
+        impl->loop_thread_ = std::thread([impl]() { impl->loop(); });
+    }
 }
 
 void tox_t::stop()
 {
-    impl_->loop_thread_.join();
+    for (auto& instance : instances_)
+        instance->loop_thread_.join();
 }
 
 void tox_t::save()
 {
-    impl_->send_queue_ref_.push(send_msg_savedata_t{});
+    for (auto& instance : instances_)
+        instance->send_queue_ref_.push(send_msg_savedata_t{});
 }
 
 } // namespace toxfs
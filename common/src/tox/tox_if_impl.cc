@@ -21,19 +21,38 @@
 #include "toxfs/logging.hh"
 
 #include "toxfs_priv/tox/tox_if_impl.hh"
+#include "toxfs_priv/tox/instance_id.hh"
+#include "toxfs_priv/tox/token_bucket.hh"
+
+#include <fmt/core.h>
 
 #include <cassert>
+#include <future>
+#include <iterator>
 
 namespace toxfs::tox
 {
 
-tox_if_impl::tox_if_impl()
+tox_if_impl::tox_if_impl(size_t instances)
 {
+    if (instances == 0 || instances > k_max_instances)
+    {
+        throw TOXFS_EXCEPTION(runtime_error,
+                fmt::format("Unsupported number of tox instances: {}", instances));
+    }
+
+    send_queues_.reserve(instances);
+    for (size_t i = 0; i < instances; i++)
+        send_queues_.push_back(std::make_unique<send_queue_t>());
+
+    recv_queue_.set_wakeup(&wakeup_);
     msg_thread_ = std::thread([this]() { msg_thread_run_(); });
 }
 
 tox_if_impl::~tox_if_impl() noexcept
 {
+    stop_.store(true, std::memory_order_release);
+    wakeup_.notify();
     msg_thread_.join();
 }
 
@@ -45,7 +64,7 @@ std::future<connection_t> tox_if_impl::get_connection_status()
     };
 
     auto future = msg.promise.get_future();
-    send_queue_.push(std::move(msg));
+    send_queues_.front()->push(std::move(msg));
     return future;
 }
 
@@ -64,7 +83,7 @@ std::future<message_id_t> tox_if_impl::send_message(friend_id_t id, std::string
     };
 
     auto future = msg.promise.get_future();
-    send_queue_.push(std::move(msg));
+    queue_for_(id).push(std::move(msg));
     return future;
 }
 
@@ -106,20 +125,64 @@ void tox_if_impl::unregister_file_callback_if(file_callback_if& file_if)
     file_callback_if_ptr_ = nullptr;
 }
 
+void tox_if_impl::register_packet_callback_if(packet_callback_if& packet_if)
+{
+    if (packet_callback_if_ptr_)
+        throw TOXFS_EXCEPTION(runtime_error, "packet_callback_if already registered!");
+
+    packet_callback_if_ptr_ = &packet_if;
+}
+
+void tox_if_impl::unregister_packet_callback_if(packet_callback_if& packet_if)
+{
+    if (!packet_callback_if_ptr_)
+        throw TOXFS_EXCEPTION(runtime_error, "packet_callback_if not registered!");
+
+    if (packet_callback_if_ptr_ != &packet_if)
+        throw TOXFS_EXCEPTION(runtime_error, "trying to unregister unrelated packet_callback_if!");
+
+    packet_callback_if_ptr_ = nullptr;
+}
+
+void tox_if_impl::send_lossless_packet(friend_id_t id, std::vector<std::byte> packet)
+{
+    if (packet.empty() || packet.size() > k_max_lossless_packet_size
+        || packet.front() < k_lossless_packet_id_min || packet.front() > k_lossless_packet_id_max)
+    {
+        throw TOXFS_EXCEPTION(runtime_error, fmt::format("Invalid lossless packet of size {}", packet.size()));
+    }
+
+    queue_for_(id).push(send_msg_lossless_packet_t{id, std::move(packet)});
+}
+
 std::future<unique_file_id_t> tox_if_impl::send_file(friend_id_t fr_id, file_info_t file)
 {
     send_msg_file_send_t msg
     {
         fr_id,
         file,
-        std::promise<unique_file_id_t>{}
+        std::promise<unique_file_id_t>{},
+        file_send_callback_t{}
     };
 
     auto future = msg.promise.get_future();
-    send_queue_.push(std::move(msg));
+    queue_for_(fr_id).push(std::move(msg));
     return future;
 }
 
+void tox_if_impl::send_file(friend_id_t fr_id, file_info_t file, file_send_callback_t callback)
+{
+    send_msg_file_send_t msg
+    {
+        fr_id,
+        std::move(file),
+        std::promise<unique_file_id_t>{},
+        std::move(callback)
+    };
+
+    queue_for_(fr_id).push(std::move(msg));
+}
+
 void tox_if_impl::send_file_control(unique_file_id_t id, file_control_t control)
 {
     send_msg_file_control_t msg
@@ -128,7 +191,87 @@ void tox_if_impl::send_file_control(unique_file_id_t id, file_control_t control)
         control
     };
 
-    send_queue_.push(std::move(msg));
+    queue_for_(id.friend_id).push(std::move(msg));
+}
+
+void tox_if_impl::send_file_seek(unique_file_id_t id, uint64_t position)
+{
+    send_msg_file_seek_t msg
+    {
+        id,
+        position
+    };
+
+    queue_for_(id.friend_id).push(std::move(msg));
+}
+
+std::future<std::optional<chunk_window_state_t>> tox_if_impl::get_chunk_window(unique_file_id_t id)
+{
+    send_msg_get_chunk_window_t msg
+    {
+        id,
+        std::promise<std::optional<chunk_window_state_t>>{}
+    };
+
+    auto future = msg.promise.get_future();
+    queue_for_(id.friend_id).push(std::move(msg));
+    return future;
+}
+
+void tox_if_impl::set_friend_weight(friend_id_t id, unsigned weight)
+{
+    queue_for_(id).push(send_msg_set_friend_weight_t{id, weight});
+}
+
+void tox_if_impl::set_file_weight(unique_file_id_t id, unsigned weight)
+{
+    queue_for_(id.friend_id).push(send_msg_set_file_weight_t{id, weight});
+}
+
+std::future<std::vector<friend_share_t>> tox_if_impl::get_shares()
+{
+    std::vector<std::future<std::vector<friend_share_t>>> futures;
+    for (auto& queue : send_queues_)
+    {
+        send_msg_get_shares_t msg
+        {
+            std::promise<std::vector<friend_share_t>>{}
+        };
+
+        futures.push_back(msg.promise.get_future());
+        queue->push(std::move(msg));
+    }
+
+    // Friends are only ever on one instance, the shares can just be joined
+    return std::async(std::launch::deferred, [futures = std::move(futures)]() mutable
+    {
+        std::vector<friend_share_t> shares;
+        for (auto& future : futures)
+        {
+            auto instance_shares = future.get();
+            shares.insert(shares.end(), std::make_move_iterator(instance_shares.begin()),
+                std::make_move_iterator(instance_shares.end()));
+        }
+        return shares;
+    });
+}
+
+void tox_if_impl::set_rate_limit(transfer_direction_t direction, rate_limit_t limit)
+{
+    // Every instance has its own buckets, so each gets an even part of the limit
+    auto const part = split_rate_limit(limit, static_cast<unsigned>(send_queues_.size()));
+    for (auto& queue : send_queues_)
+        queue->push(send_msg_set_rate_limit_t{direction, part});
+}
+
+void tox_if_impl::set_friend_rate_limit(friend_id_t id, transfer_direction_t direction, rate_limit_t limit)
+{
+    queue_for_(id).push(send_msg_set_friend_rate_limit_t{id, direction, limit});
+}
+
+void tox_if_impl::set_file_rate_limit(unique_file_id_t id, rate_limit_t limit)
+{
+    queue_for_(id.friend_id).push(send_msg_set_file_rate_limit_t{id, limit});
 }
 
 void tox_if_impl::send_file_chunk(unique_file_id_t id, file_chunk_t chunk)
@@ -139,7 +282,7 @@ void tox_if_impl::send_file_chunk(unique_file_id_t id, file_chunk_t chunk)
         std::move(chunk)
     };
 
-    send_queue_.push(std::move(msg));
+    queue_for_(id.friend_id).push(std::move(msg));
 }
 
 void tox_if_impl::recv_msg_(recv_msg_fr_request_t&& msg)
@@ -154,7 +297,7 @@ void tox_if_impl::recv_msg_(recv_msg_fr_request_t&& msg)
                 std::promise<friend_id_t>{}
             };
 
-            send_queue_.push(std::move(accept_msg));
+            send_queues_.at(msg.instance)->push(std::move(accept_msg));
             return;
         }
     }
@@ -237,17 +380,63 @@ void tox_if_impl::recv_msg_(recv_msg_file_error_t&& msg)
     }
 }
 
+void tox_if_impl::recv_msg_(recv_msg_file_send_done_t&& msg)
+{
+    msg.callback(std::move(msg.result));
+}
+
+void tox_if_impl::recv_msg_(recv_msg_lossless_packet_t&& msg)
+{
+    if (packet_callback_if_ptr_)
+    {
+        packet_callback_if_ptr_->on_tox_lossless_packet(msg.id, std::move(msg.packet));
+    }
+    else
+    {
+        TOXFS_LOG_DEBUG("Dropping lossless packet from {}, no packet callback", msg.id.id);
+    }
+}
+
+void tox_if_impl::recv_msg_(recv_msg_lossless_packet_error_t&& msg)
+{
+    if (packet_callback_if_ptr_)
+    {
+        packet_callback_if_ptr_->on_tox_lossless_packet_error(msg.id, std::move(msg.packet), std::move(msg.error));
+    }
+    else
+    {
+        TOXFS_LOG_ERROR("Unhandled lossless packet error message");
+    }
+}
+
+send_queue_t& tox_if_impl::queue_for_(friend_id_t id)
+{
+    auto const instance = instance_of(id);
+    if (instance >= send_queues_.size())
+        throw TOXFS_EXCEPTION(runtime_error, fmt::format("Friend {} is of no tox instance", id.id));
+
+    return *send_queues_[instance];
+}
+
 void tox_if_impl::msg_thread_run_() noexcept
 {
-    // TODO: shutdown thread
-    while (true)
+    std::vector<recv_msg_t> batch;
+    batch.reserve(k_queue_batch_size);
+
+    while (!stop_.load(std::memory_order_acquire))
     {
-        auto opt_msg = recv_queue_.pop_timeout(std::chrono::milliseconds{100});
-        if (opt_msg)
+        batch.clear();
+        if (recv_queue_.try_pop_up_to(batch, k_queue_batch_size) == 0)
+        {
+            wakeup_.wait([this]() { return !recv_queue_.empty() || stop_.load(std::memory_order_acquire); });
+            continue;
+        }
+
+        for (auto& recv_msg : batch)
         {
             try
             {
-                std::visit([this](auto&& msg) { recv_msg_(std::move(msg)); }, *opt_msg);
+                std::visit([this](auto&& msg) { recv_msg_(std::move(msg)); }, recv_msg);
             }
             catch (toxfs::exception const& e)
             {
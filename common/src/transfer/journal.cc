@@ -0,0 +1,192 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "toxfs/transfer/journal.hh"
+#include "toxfs/logging.hh"
+
+#include <array>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace toxfs::transfer
+{
+
+namespace
+{
+
+constexpr std::array<char, 8> k_magic{'T', 'O', 'X', 'F', 'S', 'J', '0', '1'};
+constexpr size_t k_header_size = k_magic.size() + sizeof(uint64_t) + tox::k_file_hash_size;
+constexpr size_t k_record_size = 2 * sizeof(uint64_t);
+
+constexpr std::string_view k_journal_suffix{".toxfs-journal"};
+
+/* Rewrite the journal once it has this many more records than merged ranges */
+constexpr size_t k_compact_records = 4096;
+
+void put_u64(std::vector<std::byte>& out, uint64_t value)
+{
+    auto const *p = reinterpret_cast<std::byte const*>(&value);
+    out.insert(out.end(), p, p + sizeof(value));
+}
+
+uint64_t get_u64(std::byte const *p) noexcept
+{
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+void put_record(std::vector<std::byte>& out, byte_range_t const& range)
+{
+    put_u64(out, range.pos);
+    put_u64(out, range.size);
+}
+
+} // namespace
+
+std::filesystem::path transfer_journal_t::path_for(std::filesystem::path const& file)
+{
+    auto path = file;
+    path += std::string{k_journal_suffix};
+    return path;
+}
+
+bool transfer_journal_t::is_journal(std::filesystem::path const& path)
+{
+    auto name = path.filename().native();
+    constexpr std::string_view k_tmp_suffix{".tmp"};
+    if (name.size() > k_tmp_suffix.size() && name.compare(name.size() - k_tmp_suffix.size(), k_tmp_suffix.size(), k_tmp_suffix) == 0)
+        name.resize(name.size() - k_tmp_suffix.size());
+
+    return name.size() > k_journal_suffix.size() &&
+        name.compare(name.size() - k_journal_suffix.size(), k_journal_suffix.size(), k_journal_suffix) == 0;
+}
+
+std::optional<chunked_progress> transfer_journal_t::load(std::filesystem::path const& path,
+        tox::file_hash_t const& hash, uint64_t filesize) noexcept
+{
+    try
+    {
+        if (!std::filesystem::exists(path))
+            return std::nullopt;
+
+        io::file_t file{path, io::open_mode_t::read};
+        std::vector<std::byte> data(file.size());
+        data.resize(file.read_at(0, data));
+
+        if (data.size() < k_header_size
+                || std::memcmp(data.data(), k_magic.data(), k_magic.size()) != 0
+                || get_u64(data.data() + k_magic.size()) != filesize
+                || std::memcmp(data.data() + k_magic.size() + sizeof(uint64_t), hash.data(), hash.size()) != 0)
+        {
+            TOXFS_LOG_INFO("Journal {} is for a different file, ignoring it", path.native());
+            return std::nullopt;
+        }
+
+        // A record cut short by a crash is simply dropped
+        chunked_progress progress{filesize};
+        for (size_t off = k_header_size; off + k_record_size <= data.size(); off += k_record_size)
+            progress.update(get_u64(data.data() + off), get_u64(data.data() + off + sizeof(uint64_t)));
+
+        return progress;
+    }
+    catch (std::exception const& e)
+    {
+        TOXFS_LOG_WARNING("Cannot read journal {}: {}", path.native(), e.what());
+        return std::nullopt;
+    }
+}
+
+transfer_journal_t::transfer_journal_t(std::filesystem::path path, tox::file_hash_t const& hash, uint64_t filesize)
+    : path_(std::move(path))
+    , hash_(hash)
+    , filesize_(filesize)
+{}
+
+void transfer_journal_t::record(uint64_t pos, uint64_t size)
+{
+    pending_.push_back(byte_range_t{pos, size});
+}
+
+void transfer_journal_t::commit(io::file_t const& data, chunked_progress const& progress, bool sync_data)
+{
+    if (pending_.empty() && file_.is_open())
+        return;
+
+    if (sync_data)
+        data.sync_data();
+
+    if (!file_.is_open() || records_ + pending_.size() > progress.ranges().size() + k_compact_records)
+    {
+        rewrite_(progress);
+        return;
+    }
+
+    std::vector<std::byte> out;
+    out.reserve(pending_.size() * k_record_size);
+    for (auto const& range : pending_)
+        put_record(out, range);
+
+    file_.write_at(end_, out);
+    end_ += out.size();
+    records_ += pending_.size();
+    pending_.clear();
+}
+
+void transfer_journal_t::remove() noexcept
+{
+    file_.close();
+
+    std::error_code ec;
+    std::filesystem::remove(path_, ec);
+    if (ec)
+        TOXFS_LOG_WARNING("Cannot remove journal {}: {}", path_.native(), ec.message());
+}
+
+void transfer_journal_t::rewrite_(chunked_progress const& progress)
+{
+    auto const ranges = progress.ranges();
+
+    std::vector<std::byte> out;
+    out.reserve(k_header_size + ranges.size() * k_record_size);
+    auto const *magic = reinterpret_cast<std::byte const*>(k_magic.data());
+    out.insert(out.end(), magic, magic + k_magic.size());
+    put_u64(out, filesize_);
+    out.insert(out.end(), hash_.begin(), hash_.end());
+    for (auto const& range : ranges)
+        put_record(out, range);
+
+    // Write beside the journal and swap it in, so a crash leaves one or the other
+    auto tmp = path_;
+    tmp += ".tmp";
+    {
+        io::file_t file{tmp, io::open_mode_t::truncate};
+        file.write_at(0, out);
+        file.sync_data();
+    }
+    std::filesystem::rename(tmp, path_);
+
+    file_ = io::file_t{path_, io::open_mode_t::write};
+    end_ = out.size();
+    records_ = ranges.size();
+    pending_.clear();
+}
+
+} // namespace toxfs::transfer
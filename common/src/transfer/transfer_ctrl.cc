@@ -22,109 +22,526 @@
 #include "toxfs/logging.hh"
 #include "toxfs/exception.hh"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
 #include <vector>
 #include <utility>
 
 namespace toxfs::transfer
 {
 
-transfer_ctrl::transfer_t::transfer_t(transfer_type_t t, std::filesystem::path const& path, uint64_t filesize)
+namespace
+{
+
+constexpr std::chrono::milliseconds k_tick_interval{100};
+
+/* Most work functions a shard takes off its queue at once */
+constexpr size_t k_work_batch_size = 64;
+
+/* The shard whose thread this is, null on other threads */
+thread_local void const *t_current_shard = nullptr;
+
+/**
+ * Scramble the bits of a hash, std::hash of an integer is the integer itself
+ * and tox file numbers of received files only use the upper 16 bits
+ */
+constexpr uint64_t mix_hash(uint64_t h) noexcept
+{
+    h ^= h >> 33u;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33u;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33u;
+    return h;
+}
+
+/* Starts the file ids toxfs derives, toxcore's own ids are random */
+constexpr std::array<char, 8> k_file_hash_tag{'t', 'o', 'x', 'f', 's', 'i', 'd', '1'};
+
+/**
+ * Derive a stable toxcore file id from a file's path, size and modification
+ * time, so the receiver can recognise the file when it is offered again
+ */
+tox::file_hash_t make_file_hash(std::filesystem::path const& path, uint64_t filesize)
+{
+    std::error_code ec;
+    auto const mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+    auto const& name = path.native();
+
+    tox::file_hash_t hash;
+    std::memcpy(hash.data(), k_file_hash_tag.data(), k_file_hash_tag.size());
+    for (size_t lane = 1; lane < hash.size() / sizeof(uint64_t); ++lane)
+    {
+        // FNV-1a, seeded differently for each 8 bytes of the hash
+        uint64_t h = 0xcbf29ce484222325ull ^ mix_hash(lane + 1);
+        auto feed = [&h](void const *data, size_t size)
+        {
+            auto const *p = static_cast<unsigned char const*>(data);
+            for (size_t i = 0; i < size; ++i)
+            {
+                h ^= p[i];
+                h *= 0x100000001b3ull;
+            }
+        };
+        feed(name.data(), name.size());
+        feed(&filesize, sizeof(filesize));
+        feed(&mtime, sizeof(mtime));
+
+        h = mix_hash(h);
+        std::memcpy(hash.data() + lane * sizeof(h), &h, sizeof(h));
+    }
+    return hash;
+}
+
+/**
+ * @brief check if a file id was derived by make_file_hash, so it is the same
+ *        each time the file is offered
+ */
+bool is_derived_hash(tox::file_hash_t const& hash) noexcept
+{
+    return std::memcmp(hash.data(), k_file_hash_tag.data(), k_file_hash_tag.size()) == 0;
+}
+
+} // namespace
+
+transfer_ctrl::transfer_t::transfer_t(transfer_type_t t, std::filesystem::path const& path, uint64_t filesize,
+        io::open_mode_t mode)
     : transfer_type(t)
-    , stream(path, (t == transfer_type_t::send ? std::ios_base::in : (std::ios_base::out | std::ios_base::trunc))
-            | std::ios_base::binary)
+    , file(std::make_shared<io::file_t>(path, mode))
     , progress(filesize)
-{}
+{
+    if (t == transfer_type_t::send)
+        file->advise_sequential();
+}
 
 transfer_ctrl::transfer_ctrl(
     std::shared_ptr<tox::tox_if> tox_if,
-    std::filesystem::path root_dir)
+    transfer_config_t config)
     : tox_if_(std::move(tox_if))
-    , root_dir_(std::move(root_dir))
+    , config_(std::move(config))
+    , io_engine_(io::make_io_engine(config_.io_engine, config_.io_queue_depth))
 {
+    auto workers = config_.worker_threads;
+    if (workers == 0)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+
+    shards_.reserve(workers);
+    for (unsigned i = 0; i < workers; ++i)
+    {
+        shards_.push_back(std::make_unique<shard_t>());
+        shards_.back()->queue.set_wakeup(&shards_.back()->wakeup);
+    }
+
     tox_if_->register_file_callback_if(*this);
-    work_thread_ = std::thread([this]() { work_thread_run_(); });
+    journal_thread_ = std::thread([this]() { journal_run_(); });
+    for (auto& shard : shards_)
+        shard->thread = std::thread([this, &shard = *shard]() { shard_run_(shard); });
+
+    TOXFS_LOG_INFO("Transfers running on {} worker threads", workers);
 }
 
 transfer_ctrl::~transfer_ctrl() noexcept
 {
-    work_thread_.join();
+    for (auto& shard : shards_)
+        shard->thread.join();
+    journal_thread_.join();
     tox_if_->unregister_file_callback_if(*this);
 }
 
-void transfer_ctrl::send_path(tox::friend_id_t fr_id, std::string_view path_str)
+send_handle_t transfer_ctrl::send_path(tox::friend_id_t fr_id, std::string_view path_str)
 {
     std::filesystem::path path{path_str};
 
     if (path.is_relative())
-        path = root_dir_ / path;
+        path = config_.root_dir / path;
 
     if (!std::filesystem::exists(path))
         throw TOXFS_EXCEPTION(runtime_error, fmt::format("Cannot send {}: file does not exist", path.native()));
 
     path = std::filesystem::canonical(path);
     std::error_code ec;
-    auto rel_path = std::filesystem::relative(path, root_dir_, ec);
+    auto rel_path = std::filesystem::relative(path, config_.root_dir, ec);
     if (ec || *rel_path.begin() == "..")
         throw TOXFS_EXCEPTION(runtime_error,
-                fmt::format("Cannot send {}: file not in root dir ({})!", path.native(), root_dir_.native()));
+                fmt::format("Cannot send {}: file not in root dir ({})!", path.native(), config_.root_dir.native()));
 
-    std::vector<std::filesystem::path> send_files;
     if (std::filesystem::is_symlink(path))
-    {
         throw TOXFS_EXCEPTION(runtime_error, "TODO: Symlinks not supported");
+
+    if (transfer_journal_t::is_journal(path))
+        throw TOXFS_EXCEPTION(runtime_error, fmt::format("Cannot send {}: it is a transfer journal", path.native()));
+
+    auto state = std::make_shared<send_handle_t::state_t>();
+    auto job_id = next_send_job_++;
+
+    auto& shard = job_shard_(job_id);
+    run_on_shard_(shard, [this, &shard, fr_id, job_id, state, path = std::move(path)]()
+    {
+        send_job_t job{fr_id, state};
+        std::error_code dir_ec;
+        if (std::filesystem::is_directory(path, dir_ec))
+        {
+            TOXFS_LOG_INFO("Sending a directory {} to Friend#{}", path.native(), fr_id.id);
+            job.dir_it = std::filesystem::recursive_directory_iterator{path, dir_ec};
+            if (dir_ec)
+                TOXFS_LOG_ERROR("Cannot read directory {}: {}", path.native(), dir_ec.message());
+        }
+        else
+        {
+            job.file = path;
+        }
+
+        shard.send_jobs.emplace(job_id, std::move(job));
+        pump_send_job_(shard, job_id);
+    });
+
+    return send_handle_t{std::move(state)};
+}
+
+send_status_t send_handle_t::status() const noexcept
+{
+    send_status_t status;
+    if (state_)
+    {
+        status.files_found = state_->files_found;
+        status.files_started = state_->files_started;
+        status.files_done = state_->files_done;
+        status.files_failed = state_->files_failed;
+        status.done = state_->done;
+    }
+    return status;
+}
+
+void send_handle_t::cancel() noexcept
+{
+    if (state_)
+        state_->cancel = true;
+}
+
+void transfer_ctrl::pump_send_job_(shard_t& shard, uint64_t job_id)
+{
+    auto job_it = shard.send_jobs.find(job_id);
+    if (job_it == shard.send_jobs.end())
+        return;
+
+    send_job_t& job = job_it->second;
+    bool more_files = !job.cancelled;
+    while (more_files && job.outstanding < config_.send_max_outstanding)
+    {
+        auto send_file = next_send_file_(job);
+        if (!send_file)
+        {
+            more_files = false;
+            break;
+        }
+
+        std::error_code ec;
+        auto const filesize = std::filesystem::file_size(*send_file, ec);
+        if (ec)
+        {
+            TOXFS_LOG_ERROR("Cannot send {}: {}", send_file->native(), ec.message());
+            job.state->files_failed++;
+            continue;
+        }
+
+        auto filename = send_file->filename().string();
+        TOXFS_LOG_INFO("Sending a file to Friend#{} with name {} size {}", job.fr_id.id, filename, filesize);
+
+        job.outstanding++;
+        tox_if_->send_file(job.fr_id, tox::file_info_t{std::move(filename), filesize, make_file_hash(*send_file, filesize)},
+            [this, job_id, state = job.state, send_file = *send_file, filesize](std::future<tox::unique_file_id_t> result)
+        {
+            tox::unique_file_id_t id;
+            try
+            {
+                id = result.get();
+            }
+            catch (std::exception const& e)
+            {
+                TOXFS_LOG_ERROR("Cannot send {}: {}", send_file.native(), e.what());
+                auto& job_shard = job_shard_(job_id);
+                job_shard.queue.push([this, &job_shard, job_id]()
+                {
+                    send_job_file_finished_(job_shard, job_id, std::nullopt, false);
+                });
+                return;
+            }
+
+            // Registered from this thread so it is in place before any control for the file
+            shard_for_(id).queue.push([this, job_id, state, send_file, filesize, id]()
+            {
+                on_file_send_started_(job_id, state, send_file, filesize, id);
+            });
+        });
     }
-    else if (std::filesystem::is_directory(path))
+
+    if (!more_files && job.outstanding == 0)
     {
-        for (auto const& dir_entry : std::filesystem::recursive_directory_iterator{path})
+        TOXFS_LOG_INFO("Send job {} finished: {} sent, {} failed", job_id,
+                job.state->files_done.load(), job.state->files_failed.load());
+        job.state->done = true;
+        shard.send_jobs.erase(job_it);
+    }
+}
+
+std::optional<std::filesystem::path> transfer_ctrl::next_send_file_(send_job_t& job)
+{
+    if (job.file)
+        return std::exchange(job.file, std::nullopt);
+
+    std::error_code ec;
+    while (job.dir_it != std::filesystem::recursive_directory_iterator{})
+    {
+        auto const entry = *job.dir_it;
+        job.dir_it.increment(ec);
+        if (ec)
         {
-            if (dir_entry.is_directory())
-                continue;
+            TOXFS_LOG_ERROR("Error walking directory at {}: {}", entry.path().native(), ec.message());
+            job.dir_it = std::filesystem::recursive_directory_iterator{};
+        }
 
-            if (!dir_entry.is_regular_file())
-                throw TOXFS_EXCEPTION(runtime_error, "TODO: Cannot handle special files!");
+        if (entry.is_directory(ec))
+            continue;
 
-            send_files.push_back(dir_entry.path());
+        // Journals of received files are ours, not part of what is being sent
+        if (transfer_journal_t::is_journal(entry.path()))
+            continue;
+
+        job.state->files_found++;
+        if (!entry.is_regular_file(ec))
+        {
+            TOXFS_LOG_WARNING("Skipping special file {}", entry.path().native());
+            job.state->files_failed++;
+            continue;
         }
 
-        TOXFS_LOG_INFO("Sending a directory to Friend#{} with {} files", fr_id.id, send_files.size());
+        return entry.path();
+    }
+
+    return std::nullopt;
+}
+
+void transfer_ctrl::on_file_send_started_(uint64_t job_id, std::shared_ptr<send_handle_t::state_t> const& state,
+        std::filesystem::path const& path, uint64_t filesize, tox::unique_file_id_t id)
+{
+    auto& shard = shard_for_(id);
+    auto& job_shard = job_shard_(job_id);
+
+    bool ok = false;
+    if (state->cancel)
+    {
+        tox_if_->send_file_control(id, tox::file_control_t::cancel);
     }
     else
     {
-        send_files = {path};
+        try
+        {
+            auto [it, inserted] = shard.transfers.emplace(id,
+                    transfer_t{transfer_type_t::send, path, filesize, io::open_mode_t::read});
+            if (!inserted)
+                throw TOXFS_EXCEPTION(runtime_error, fmt::format("Transfer already exists: {}", id));
+
+            transfer_t& tr = it->second;
+            tr.send_job = job_id;
+            if (config_.mmap_send && filesize >= config_.mmap_min_size)
+                tr.mapping = io::mapped_file_t::map(*tr.file);
+
+            if (!tr.mapping && config_.read_ahead.enabled)
+            {
+                tr.read_ahead = std::make_shared<io::read_ahead_t>(tr.file, filesize, *io_engine_,
+                    [this, &shard](std::function<void()> func) { run_on_shard_(shard, std::move(func)); },
+                    config_.read_ahead);
+            }
+            ok = true;
+        }
+        catch (std::exception const& e)
+        {
+            TOXFS_LOG_ERROR("Cannot send {}: {}", path.native(), e.what());
+            tox_if_->send_file_control(id, tox::file_control_t::cancel);
+        }
     }
 
-    std::vector<std::tuple<std::filesystem::path, uintmax_t, std::future<tox::unique_file_id_t>>> send_results;
-    send_results.reserve(send_files.size());
-    for (auto const& send_file : send_files)
+    run_on_shard_(job_shard, [this, &job_shard, job_id, id, ok]()
     {
-        auto const filename = send_file.filename().string();
-        auto const filesize = std::filesystem::file_size(send_file);
+        if (ok)
+            send_job_file_started_(job_shard, job_id, id);
+        else
+            send_job_file_finished_(job_shard, job_id, id, false);
+    });
+}
 
-        TOXFS_LOG_INFO("Sending a file to Friend#{} with name {} size {}", fr_id.id, filename, filesize);
-        send_results.emplace_back(std::move(send_file), filesize,
-                tox_if_->send_file(fr_id, tox::file_info_t{std::move(filename), filesize}));
-    }
+void transfer_ctrl::send_job_file_started_(shard_t& shard, uint64_t job_id, tox::unique_file_id_t id)
+{
+    auto job_it = shard.send_jobs.find(job_id);
+    if (job_it == shard.send_jobs.end())
+        return;
+
+    send_job_t& job = job_it->second;
+    job.transfers.insert(id);
+    job.state->files_started++;
+}
+
+void transfer_ctrl::send_job_file_finished_(shard_t& shard, uint64_t job_id,
+        std::optional<tox::unique_file_id_t> id, bool completed)
+{
+    auto job_it = shard.send_jobs.find(job_id);
+    if (job_it == shard.send_jobs.end())
+        return;
+
+    send_job_t& job = job_it->second;
+    if (id)
+        job.transfers.erase(*id);
+
+    job.outstanding--;
+    if (completed)
+        job.state->files_done++;
+    else
+        job.state->files_failed++;
+
+    pump_send_job_(shard, job_id);
+}
 
-    for (auto& [send_file, filesize, future] : send_results)
+void transfer_ctrl::check_send_jobs_cancelled_(shard_t& shard)
+{
+    std::vector<tox::unique_file_id_t> ids;
+    for (auto& [job_id, job] : shard.send_jobs)
     {
-        // FIXME: this does a blocking operation
-        auto id = future.get();
+        if (job.cancelled || !job.state->cancel)
+            continue;
 
-        work_queue_.push([this, id, send_file = std::move(send_file), &filesize]()
+        TOXFS_LOG_INFO("Send job {} cancelled", job_id);
+        job.cancelled = true;
+        ids.insert(ids.end(), job.transfers.begin(), job.transfers.end());
+    }
+
+    // The transfers report back through send_job_file_finished_ once removed
+    for (auto const& id : ids)
+    {
+        auto& tr_shard = shard_for_(id);
+        run_on_shard_(tr_shard, [this, &tr_shard, id = id]()
         {
-            // TODO: handle not inserting
-            transfers_.emplace(id, transfer_t{transfer_type_t::send, send_file, filesize});
+            auto it = tr_shard.transfers.find(id);
+            if (it == tr_shard.transfers.end())
+                return;
+
+            tox_if_->send_file_control(id, tox::file_control_t::cancel);
+            erase_transfer_(tr_shard, it, false);
         });
     }
 }
 
+void transfer_ctrl::erase_transfer_(shard_t& shard, transfer_map_t::iterator it, bool completed)
+{
+    transfer_t& tr = it->second;
+    if (completed)
+        remove_journal_(tr);
+    else
+        commit_journal_(tr);
+
+    auto const job_id = tr.send_job;
+    auto const id = it->first;
+    if (tr.transfer_type == transfer_type_t::recv)
+        forget_recv_path_(tr.file->path(), id);
+    shard.transfers.erase(it);
+
+    if (job_id == 0)
+        return;
+
+    auto& job_shard = job_shard_(job_id);
+    run_on_shard_(job_shard, [this, &job_shard, job_id, id, completed]()
+    {
+        send_job_file_finished_(job_shard, job_id, id, completed);
+    });
+}
+
+void transfer_ctrl::forget_recv_path_(std::filesystem::path const& path, tox::unique_file_id_t id)
+{
+    std::lock_guard<std::mutex> lock(recv_paths_mutex_);
+    auto it = recv_paths_.find(path.native());
+    if (it != recv_paths_.end() && it->second == id)
+        recv_paths_.erase(it);
+}
+
 void transfer_ctrl::on_tox_file_recv(tox::unique_file_id_t id, tox::file_info_t info) noexcept
 {
     TOXFS_LOG_INFO("Received a file {} with name {} size {}", id, info.filename, info.filesize);
 
-    auto path = root_dir_ / info.filename;
+    auto path = config_.root_dir / info.filename;
+
+    auto& shard = shard_for_(id);
+    shard.queue.push([this, &shard, id, path = std::move(path), filesize = info.filesize, hash = info.hash]()
+    {
+        // Transfers of the same file would share its journal, a stale one is evicted first
+        std::optional<tox::unique_file_id_t> stale;
+        {
+            std::lock_guard<std::mutex> lock(recv_paths_mutex_);
+            auto [path_it, inserted] = recv_paths_.try_emplace(path.native(), id);
+            if (!inserted && !(path_it->second == id))
+            {
+                stale = path_it->second;
+                path_it->second = id;
+            }
+        }
+
+        if (!stale)
+        {
+            start_recv_(shard, id, path, filesize, hash);
+            return;
+        }
+
+        auto& stale_shard = shard_for_(*stale);
+        run_on_shard_(stale_shard, [this, &stale_shard, &shard, stale = *stale, id, path, filesize, hash]()
+        {
+            auto it = stale_shard.transfers.find(stale);
+            if (it != stale_shard.transfers.end())
+            {
+                TOXFS_LOG_WARNING("{} is received again by {}, cancelling {}", path.native(), id, stale);
+                tox_if_->send_file_control(stale, tox::file_control_t::cancel);
+                erase_transfer_(stale_shard, it, false);
+            }
+
+            // The stale journal is committed, the new transfer resumes from it once that is done
+            run_on_journal_([this, &shard, id, path, filesize, hash]()
+            {
+                run_on_shard_(shard, [this, &shard, id, path, filesize, hash]()
+                {
+                    start_recv_(shard, id, path, filesize, hash);
+                });
+            });
+        });
+    });
+}
+
+void transfer_ctrl::start_recv_(shard_t& shard, tox::unique_file_id_t id, std::filesystem::path const& path,
+        uint64_t filesize, tox::file_hash_t const& hash)
+{
+    // Random ids differ each time the file is offered, a journal keyed by one could never be resumed
+    bool const resumable = is_derived_hash(hash);
+    bool const exists = std::filesystem::exists(path);
+    auto const journal_path = transfer_journal_t::path_for(path);
+
+    std::optional<chunked_progress> resumed;
+    if (config_.resume && resumable && exists)
+        resumed = transfer_journal_t::load(journal_path, hash, filesize);
+
+    if (resumed && resumed->complete())
+    {
+        TOXFS_LOG_INFO("Already have all of {}, cancelling {}", path.native(), id);
+        std::error_code ec;
+        std::filesystem::remove(journal_path, ec);
+        tox_if_->send_file_control(id, tox::file_control_t::cancel);
+        forget_recv_path_(path, id);
+        return;
+    }
 
-    if (std::filesystem::exists(path))
+    if (resumed)
+    {
+        TOXFS_LOG_INFO("Resuming file {} with {} of {} bytes done", path.native(),
+                resumed->progress(), filesize);
+    }
+    else if (exists)
     {
         TOXFS_LOG_WARNING("Overwriting existing file: {}", path.native());
     }
@@ -133,32 +550,70 @@ void transfer_ctrl::on_tox_file_recv(tox::unique_file_id_t id, tox::file_info_t
         TOXFS_LOG_INFO("Saving file to: {}", path.native());
     }
 
-    work_queue_.push([this, id, path = std::move(path), filesize = info.filesize]()
+    auto [it, ok] = shard.transfers.emplace(id, transfer_t{transfer_type_t::recv, path, filesize,
+            resumed ? io::open_mode_t::write : io::open_mode_t::truncate});
+    if (!ok)
     {
-        auto [it, ok] = transfers_.emplace(id, transfer_t{transfer_type_t::recv, path, filesize});
-        if (!ok)
+        TOXFS_LOG_ERROR("Transfer already exists: {}", id);
+        return;
+    }
+    transfer_t& tr = it->second;
+    if (config_.preallocate)
+    {
+        try
         {
-            TOXFS_LOG_ERROR("Transfer already exists: {}", id);
-            return;
+            tr.file->allocate(filesize);
         }
-        it->second.active = true;
-        tox_if_->send_file_control(id, tox::file_control_t::resume);
-    });
+        catch (std::exception const& e)
+        {
+            // Receiving still works without it, writes fail later if the disk really is full
+            TOXFS_LOG_WARNING("Not preallocating {}: {}", id, e.what());
+        }
+    }
+
+    if (resumed)
+        tr.progress = std::move(*resumed);
+
+    if (config_.resume && resumable)
+    {
+        // Written by the first commit on the journal thread
+        tr.journal = std::make_shared<transfer_journal_t>(journal_path, hash, filesize);
+        tr.journal_commit = std::chrono::steady_clock::now();
+    }
+
+    if (config_.write_behind.enabled)
+    {
+        tr.write_behind = std::make_shared<io::write_behind_t>(tr.file, *io_engine_,
+            [this, &shard](std::function<void()> func) { run_on_shard_(shard, std::move(func)); },
+            [this, &shard, id](uint64_t pos, uint64_t size) { update_progress_(shard, id, pos, size); },
+            [this, &shard, id](int error) { fail_recv_(shard, id, error); },
+            config_.write_behind);
+    }
+
+    // Only the start of the file can be skipped, holes after it are received again
+    if (auto const offset = tr.progress.contiguous(); offset > 0)
+        tox_if_->send_file_seek(id, offset);
+
+    tr.active = true;
+    tox_if_->send_file_control(id, tox::file_control_t::resume);
 }
 
 void transfer_ctrl::on_tox_file_control(tox::unique_file_id_t id, tox::file_control_t control) noexcept
 {
-    work_queue_.push([this, id, control]()
+    auto& shard = shard_for_(id);
+    shard.queue.push([this, &shard, id, control]()
     {
-        auto it = transfers_.find(id);
-        if (it != transfers_.end())
+        auto it = shard.transfers.find(id);
+        if (it != shard.transfers.end())
         {
             transfer_t& tr = it->second;
             switch (control)
             {
             case tox::file_control_t::cancel:
                 TOXFS_LOG_INFO("Transfer {} has been cancelled", id);
-                transfers_.erase(it);
+                // The sender gave up on the file, nothing will resume it
+                remove_journal_(tr);
+                erase_transfer_(shard, it, false);
                 break;
             case tox::file_control_t::pause:
                 TOXFS_LOG_DEBUG("Transfer {} PAUSE", id);
@@ -179,66 +634,117 @@ void transfer_ctrl::on_tox_file_control(tox::unique_file_id_t id, tox::file_cont
 
 void transfer_ctrl::on_tox_file_chunk_request(tox::unique_file_id_t id, tox::file_chunk_request_t request) noexcept
 {
-    work_queue_.push([this, id, request]()
+    auto& shard = shard_for_(id);
+    shard.queue.push([this, &shard, id, request]()
     {
-        auto it = transfers_.find(id);
-        if (it != transfers_.end())
+        auto it = shard.transfers.find(id);
+        if (it != shard.transfers.end())
         {
             transfer_t& tr = it->second;
             if (tr.transfer_type != transfer_type_t::send)
             {
                 TOXFS_LOG_ERROR("Chunk requested for non-send transfer {}", id);
+                tox_if_->send_file_chunk(id, tox::file_chunk_t{request.position, buffer_chain_t{}});
                 return;
             }
 
             if (!tr.active)
             {
-                TOXFS_LOG_ERROR("Chunk requested for inactive transfer {}", id);
+                // Answered empty so tox hands the block out again once the transfer resumes
+                TOXFS_LOG_DEBUG("Chunk requested for inactive transfer {}", id);
+                tox_if_->send_file_chunk(id, tox::file_chunk_t{request.position, buffer_chain_t{}});
                 return;
             }
 
             if (request.size == 0)
             {
                 TOXFS_LOG_INFO("End of send transfer {}", id);
-                transfers_.erase(it);
+                erase_transfer_(shard, it, true);
                 return;
             }
 
-            auto chunk_pos = static_cast<std::streamoff>(request.position);
-            if (tr.lastPos != chunk_pos)
-                tr.stream.seekg(chunk_pos);
+            // Requests are whole blocks and can run past the end of the file
+            auto const filesize = tr.progress.total_size();
+            auto const size = static_cast<size_t>(
+                std::min<uint64_t>(request.size, filesize - std::min(request.position, filesize)));
+            if (size == 0)
+            {
+                tox_if_->send_file_chunk(id, tox::file_chunk_t{request.position, buffer_chain_t{}});
+                return;
+            }
+
+            if (tr.mapping)
+            {
+                auto view = tr.mapping->view(request.position, size);
+                if (!view)
+                {
+                    // Only once tox found the file truncated, it cancels the file itself
+                    TOXFS_LOG_DEBUG("{} was truncated while mapped", id);
+                    tox_if_->send_file_chunk(id, tox::file_chunk_t{request.position, buffer_chain_t{}});
+                    return;
+                }
+
+                tox_if_->send_file_chunk(id, tox::file_chunk_t{request.position, buffer_chain_t{std::move(*view)}});
+                tr.progress.update(request.position, size);
+                return;
+            }
+
+            // Runs on the shard, sending may block on tox's queue and must not stall the I/O engine
+            auto on_read = [this, &shard, id, size](io::read_result_t&& r)
+            {
+                if (r.error != 0 || r.data.size() != size)
+                {
+                    TOXFS_LOG_ERROR("Error reading {} at {} size {}: got {} ({})",
+                        id, r.position, size, r.data.size(), std::strerror(r.error));
+
+                    // Release the block in tox, then give up on the file rather than send it wrong
+                    tox_if_->send_file_chunk(id, tox::file_chunk_t{r.position, buffer_chain_t{}});
+                    auto tr_it = shard.transfers.find(id);
+                    if (tr_it == shard.transfers.end())
+                        return;
+
+                    tox_if_->send_file_control(id, tox::file_control_t::cancel);
+                    erase_transfer_(shard, tr_it, false);
+                    return;
+                }
 
-            buffer_t buf{request.size};
+                auto pos = r.position;
+                tox_if_->send_file_chunk(id, tox::file_chunk_t{pos, std::move(r.data)});
+                update_progress_(shard, id, pos, size);
+            };
 
-            auto chunk_size = static_cast<std::streamoff>(request.size);
-            tr.stream.read(reinterpret_cast<char*>(buf.data()), chunk_size);
-            if (tr.stream)
+            if (tr.read_ahead)
             {
-                buf.set_size(chunk_size);
-                tox_if_->send_file_chunk(id, tox::file_chunk_t{request.position, std::move(buf)});
-                tr.lastPos += chunk_size;
-                tr.progress.update(request.position, request.size);
+                tr.read_ahead->read(request.position, size, std::move(on_read));
             }
             else
             {
-                TOXFS_LOG_ERROR("Error reading stream of {} at {} size {}", id, request.position, request.size);
-                tr.lastPos = tr.stream.tellg();
-                tr.stream.clear();
+                io_engine_->submit_read(tr.file, request.position, buffer_t{size},
+                    [this, &shard, on_read = std::move(on_read)](io::io_completion_t&& c) mutable
+                {
+                    run_on_shard_(shard, [on_read = std::move(on_read), c = std::move(c)]() mutable
+                    {
+                        on_read(io::read_result_t{buffer_chain_t{std::move(c.buffer)}, c.position, c.error});
+                    });
+                });
             }
         }
         else
         {
             TOXFS_LOG_WARNING("Chunk requested for {} but this transfer does not exist!", id);
+            tox_if_->send_file_chunk(id, tox::file_chunk_t{request.position, buffer_chain_t{}});
+            tox_if_->send_file_control(id, tox::file_control_t::cancel);
         }
     });
 }
 
 void transfer_ctrl::on_tox_file_chunk_receive(tox::unique_file_id_t id, tox::file_chunk_t chunk) noexcept
 {
-    work_queue_.push([this, id, chunk = std::move(chunk)]()
+    auto& shard = shard_for_(id);
+    shard.queue.push([this, &shard, id, chunk = std::move(chunk)]() mutable
     {
-        auto it = transfers_.find(id);
-        if (it != transfers_.end())
+        auto it = shard.transfers.find(id);
+        if (it != shard.transfers.end())
         {
             transfer_t& tr = it->second;
             if (tr.transfer_type != transfer_type_t::recv)
@@ -256,26 +762,36 @@ void transfer_ctrl::on_tox_file_chunk_receive(tox::unique_file_id_t id, tox::fil
             if (chunk.data.size() == 0)
             {
                 TOXFS_LOG_INFO("End of recv transfer {}", id);
-                transfers_.erase(it);
+                tr.finishing = true;
+                if (tr.write_behind)
+                {
+                    // May finish right away and erase the transfer, which owns the write behind
+                    auto write_behind = tr.write_behind;
+                    write_behind->finish([this, &shard, id](int error) { finish_recv_(shard, id, error); });
+                }
+                else if (tr.writes_in_flight == 0)
+                {
+                    finish_recv_(shard, id, 0);
+                }
                 return;
             }
 
-            auto chunk_pos = static_cast<std::streamoff>(chunk.position);
-            if (tr.lastPos != chunk_pos)
-                tr.stream.seekg(chunk_pos);
-
-            auto chunk_size = static_cast<std::streamoff>(chunk.data.size());
-            tr.stream.write(reinterpret_cast<const char*>(chunk.data.data()), chunk_size);
-            if (tr.stream)
+            if (tr.write_behind)
             {
-                tr.lastPos += chunk_size;
-                tr.progress.update(chunk.position, chunk.data.size());
+                tr.write_behind->write(chunk.position, std::move(chunk.data));
+                return;
             }
-            else
+
+            auto const size = chunk.data.size();
+            tr.writes_in_flight++;
+            io_engine_->submit_writev(tr.file, chunk.position, std::move(chunk.data),
+                [this, &shard, id, size](io::io_completion_t&& c)
             {
-                TOXFS_LOG_ERROR("Error writing to stream of {}", id);
-                tr.lastPos = tr.stream.tellg();
-            }
+                run_on_shard_(shard, [this, &shard, id, pos = c.position, size, error = c.error]()
+                {
+                    on_recv_written_(shard, id, pos, size, error);
+                });
+            });
         }
         else
         {
@@ -284,17 +800,75 @@ void transfer_ctrl::on_tox_file_chunk_receive(tox::unique_file_id_t id, tox::fil
     });
 }
 
+void transfer_ctrl::on_recv_written_(shard_t& shard, tox::unique_file_id_t id, uint64_t pos, uint64_t size, int error)
+{
+    auto it = shard.transfers.find(id);
+    if (it == shard.transfers.end())
+        return;
+
+    transfer_t& tr = it->second;
+    tr.writes_in_flight--;
+    if (error != 0)
+    {
+        TOXFS_LOG_ERROR("Error writing {} at {} size {}: {}", id, pos, size, std::strerror(error));
+        fail_recv_(shard, id, error);
+        return;
+    }
+
+    update_progress_(shard, id, pos, size);
+    if (tr.finishing && tr.writes_in_flight == 0)
+        finish_recv_(shard, id, 0);
+}
+
+void transfer_ctrl::finish_recv_(shard_t& shard, tox::unique_file_id_t id, int error)
+{
+    if (error != 0)
+    {
+        fail_recv_(shard, id, error);
+        return;
+    }
+
+    auto it = shard.transfers.find(id);
+    if (it == shard.transfers.end())
+        return;
+
+    TOXFS_LOG_INFO("Received {} completely", id);
+    erase_transfer_(shard, it, true);
+}
+
+void transfer_ctrl::fail_recv_(shard_t& shard, tox::unique_file_id_t id, int error)
+{
+    auto it = shard.transfers.find(id);
+    if (it == shard.transfers.end())
+        return;
+
+    TOXFS_LOG_ERROR("Cancelling {}, writing it failed: {}", id, std::strerror(error));
+    // Once all data is received tox is done with the file, there is nothing to cancel
+    if (!it->second.finishing)
+        tox_if_->send_file_control(id, tox::file_control_t::cancel);
+    erase_transfer_(shard, it, false);
+}
+
 void transfer_ctrl::on_tox_file_error(tox::unique_file_id_t id, tox::tox_error err) noexcept
 {
     TOXFS_LOG_ERROR("{} file error: {}", id, err.what());
 }
 
-void transfer_ctrl::work_thread_run_() noexcept
+void transfer_ctrl::shard_run_(shard_t& shard) noexcept
 {
+    t_current_shard = &shard;
+
+    std::vector<std::function<void()>> batch;
+    batch.reserve(k_work_batch_size);
+
+    auto next_tick = std::chrono::steady_clock::now() + k_tick_interval;
     while (true)
     {
-        auto func = work_queue_.pop();
-        if (func)
+        batch.clear();
+        shard.queue.try_pop_up_to(batch, k_work_batch_size);
+
+        // A failing function must not take the rest of the batch with it
+        for (auto& func : batch)
         {
             try
             {
@@ -310,6 +884,145 @@ void transfer_ctrl::work_thread_run_() noexcept
             }
         }
 
+        try
+        {
+            while (auto msg = shard.mailbox.try_pop())
+                (*msg)();
+
+            if (std::chrono::steady_clock::now() >= next_tick)
+            {
+                tick_(shard);
+                next_tick = std::chrono::steady_clock::now() + k_tick_interval;
+            }
+        }
+        catch (toxfs::exception const& e)
+        {
+            TOXFS_LOG_ERROR("Error while running work function: {}", e.what());
+        }
+        catch (std::exception const& e)
+        {
+            TOXFS_LOG_ERROR("Error while running work function: {}", e.what());
+        }
+
+        if (shard.queue.empty() && shard.mailbox.empty())
+        {
+            // Only hand disk requests to the kernel once the burst of work is done
+            io_engine_->flush();
+
+            // Ticks only have work while there are transfers or send jobs
+            bool const idle = shard.transfers.empty() && shard.send_jobs.empty();
+            shard.wakeup.wait_until(idle ? std::chrono::steady_clock::time_point::max() : next_tick,
+                    [&shard]() { return !shard.queue.empty() || !shard.mailbox.empty(); });
+        }
+    }
+}
+
+transfer_ctrl::shard_t& transfer_ctrl::shard_for_(tox::unique_file_id_t id) noexcept
+{
+    return *shards_[mix_hash(std::hash<tox::unique_file_id_t>{}(id)) % shards_.size()];
+}
+
+transfer_ctrl::shard_t& transfer_ctrl::job_shard_(uint64_t job_id) noexcept
+{
+    return *shards_[job_id % shards_.size()];
+}
+
+void transfer_ctrl::tick_(shard_t& shard)
+{
+    check_send_jobs_cancelled_(shard);
+
+    auto const now = std::chrono::steady_clock::now();
+    for (auto& [id, tr] : shard.transfers)
+    {
+        if (tr.write_behind)
+            tr.write_behind->poll();
+
+        if (tr.journal && !tr.journal_pending.empty() && now - tr.journal_commit >= config_.journal_interval)
+            commit_journal_(tr);
+    }
+}
+
+void transfer_ctrl::commit_journal_(transfer_t& tr)
+{
+    tr.journal_commit = std::chrono::steady_clock::now();
+    if (!tr.journal)
+        return;
+
+    bool const sync_data = config_.write_behind.durability != io::durability_t::none;
+    run_on_journal_([journal = tr.journal, file = tr.file, ranges = std::exchange(tr.journal_pending, {}),
+            progress = tr.progress, sync_data]()
+    {
+        try
+        {
+            for (auto const& range : ranges)
+                journal->record(range.pos, range.size);
+            journal->commit(*file, progress, sync_data);
+        }
+        catch (std::exception const& e)
+        {
+            TOXFS_LOG_ERROR("Cannot update the journal of {}: {}", file->path().native(), e.what());
+        }
+    });
+}
+
+void transfer_ctrl::remove_journal_(transfer_t& tr)
+{
+    if (!tr.journal)
+        return;
+
+    tr.journal_pending.clear();
+    run_on_journal_([journal = std::move(tr.journal)]() { journal->remove(); });
+}
+
+void transfer_ctrl::run_on_journal_(std::function<void()> func)
+{
+    journal_queue_.push(std::move(func));
+    journal_wakeup_.notify();
+}
+
+void transfer_ctrl::journal_run_() noexcept
+{
+    while (true)
+    {
+        while (auto func = journal_queue_.try_pop())
+        {
+            try
+            {
+                (*func)();
+            }
+            catch (std::exception const& e)
+            {
+                TOXFS_LOG_ERROR("Error while running journal function: {}", e.what());
+            }
+        }
+
+        journal_wakeup_.wait([this]() { return !journal_queue_.empty(); });
+    }
+}
+
+void transfer_ctrl::update_progress_(shard_t& shard, tox::unique_file_id_t id, uint64_t pos, uint64_t size)
+{
+    auto it = shard.transfers.find(id);
+    if (it != shard.transfers.end())
+    {
+        it->second.progress.update(pos, size);
+        if (it->second.journal)
+            it->second.journal_pending.push_back(byte_range_t{pos, size});
+    }
+}
+
+void transfer_ctrl::run_on_shard_(shard_t& shard, std::function<void()> func)
+{
+    if (t_current_shard == &shard)
+    {
+        func();
+    }
+    else
+    {
+        // Never block on the bounded queue, the shard may itself be waiting on this thread,
+        // e.g. an I/O completion thread while the shard submits to a full ring
+        shard.mailbox.push(std::move(func));
+        shard.wakeup.notify();
     }
 }
 
@@ -0,0 +1,108 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "toxfs/util/buffer_chain.hh"
+
+#include <algorithm>
+#include <cstring>
+
+namespace toxfs
+{
+
+buffer_chain_t::buffer_chain_t(buffer_t buffer)
+{
+    append(std::move(buffer));
+}
+
+void buffer_chain_t::append(buffer_t buffer)
+{
+    if (buffer.size() == 0)
+        return;
+
+    size_ += buffer.size();
+    segments_.push_back(std::move(buffer));
+}
+
+void buffer_chain_t::append(buffer_chain_t chain)
+{
+    if (segments_.empty())
+    {
+        *this = std::move(chain);
+        return;
+    }
+
+    segments_.reserve(segments_.size() + chain.segments_.size());
+    for (auto& segment : chain.segments_)
+        segments_.push_back(std::move(segment));
+    size_ += chain.size_;
+}
+
+buffer_chain_t buffer_chain_t::slice(size_t offset, size_t size) const
+{
+    buffer_chain_t chain;
+    for (auto const& segment : segments_)
+    {
+        if (size == 0)
+            break;
+
+        if (offset >= segment.size())
+        {
+            offset -= segment.size();
+            continue;
+        }
+
+        auto const len = std::min(size, segment.size() - offset);
+        chain.append(segment.slice(offset, len));
+        offset = 0;
+        size -= len;
+    }
+    return chain;
+}
+
+std::vector<iovec> buffer_chain_t::iovecs() const
+{
+    std::vector<iovec> iov;
+    iov.reserve(segments_.size());
+    for (auto const& segment : segments_)
+        iov.push_back(iovec{const_cast<std::byte*>(segment.data()), segment.size()});
+    return iov;
+}
+
+void buffer_chain_t::copy_to(std::byte *out) const noexcept
+{
+    for (auto const& segment : segments_)
+    {
+        std::memcpy(out, segment.data(), segment.size());
+        out += segment.size();
+    }
+}
+
+buffer_t buffer_chain_t::flatten() const
+{
+    if (segments_.size() == 1)
+        return segments_.front();
+
+    buffer_t buffer{size_};
+    copy_to(buffer.data());
+    buffer.set_size(size_);
+    return buffer;
+}
+
+} // namespace toxfs
@@ -0,0 +1,319 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "toxfs/util/buffer_pool.hh"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <new>
+
+namespace toxfs
+{
+
+namespace
+{
+
+/* Slabs are one huge page */
+constexpr size_t k_slab_size = 2u << 20u;
+
+/* Only the sizes of bulk transfers come from slabs */
+constexpr size_t k_min_slab_class_shift = 16;
+
+/* Most free buffers of one class a thread keeps, however small they are */
+constexpr size_t k_max_thread_cache_count = 256;
+
+/**
+ * @brief map a slab, on a huge page if any are reserved and else on
+ *        memory aligned so transparent huge pages can back it
+ */
+std::byte* map_slab()
+{
+    void *mem = ::mmap(nullptr, k_slab_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED)
+        return static_cast<std::byte*>(mem);
+
+    // Map twice the size and trim it down to an aligned slab
+    mem = ::mmap(nullptr, 2 * k_slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        throw std::bad_alloc{};
+
+    auto const addr = reinterpret_cast<uintptr_t>(mem);
+    auto const aligned = (addr + k_slab_size - 1) & ~(uintptr_t{k_slab_size} - 1);
+    if (aligned > addr)
+        ::munmap(mem, aligned - addr);
+    ::munmap(reinterpret_cast<void*>(aligned + k_slab_size), addr + k_slab_size - aligned);
+
+    ::madvise(reinterpret_cast<void*>(aligned), k_slab_size, MADV_HUGEPAGE);
+    return reinterpret_cast<std::byte*>(aligned);
+}
+
+struct deleter_t
+{
+    size_t size;
+
+    void operator()(std::byte *p) const noexcept
+    {
+        buffer_pool_t::instance().deallocate(p, size);
+    }
+};
+
+} // namespace
+
+/**
+ * The free buffers a thread keeps, given back to the shared cache when the thread exits
+ */
+struct thread_cache_t
+{
+    std::array<std::vector<std::byte*>, buffer_pool_t::k_num_classes> free{};
+
+    ~thread_cache_t() noexcept;
+};
+
+namespace
+{
+
+thread_local thread_cache_t t_cache;
+/* Set once t_cache is gone, buffers freed after that go to the shared cache */
+thread_local bool t_cache_destroyed = false;
+
+thread_cache_t* thread_cache() noexcept
+{
+    return t_cache_destroyed ? nullptr : &t_cache;
+}
+
+} // namespace
+
+thread_cache_t::~thread_cache_t() noexcept
+{
+    t_cache_destroyed = true;
+    auto& pool = buffer_pool_t::instance();
+    for (size_t cls = 0; cls < free.size(); cls++)
+    {
+        if (!free[cls].empty())
+            pool.release_(cls, free[cls].data(), free[cls].size());
+    }
+}
+
+buffer_pool_t& buffer_pool_t::instance() noexcept
+{
+    // Never destroyed, buffers may still be freed while statics are torn down
+    static buffer_pool_t *pool = new buffer_pool_t;
+    return *pool;
+}
+
+void buffer_pool_t::configure(buffer_pool_config_t config) noexcept
+{
+    config_ = config;
+}
+
+buffer_pool_stats_t buffer_pool_t::stats() const noexcept
+{
+    buffer_pool_stats_t stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    stats.cached_bytes = cached_bytes_.load(std::memory_order_relaxed);
+    stats.slab_bytes = slab_bytes_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+std::byte* buffer_pool_t::allocate(size_t size)
+{
+    auto const cls = class_of_(size);
+    if (cls == k_num_classes)
+    {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return static_cast<std::byte*>(::operator new(size));
+    }
+
+    auto *cache = thread_cache();
+    if (!cache)
+    {
+        std::byte *p = nullptr;
+        if (acquire_(cls, &p, 1) == 1)
+        {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return p;
+        }
+
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return allocate_new_(cls);
+    }
+
+    auto& free = cache->free[cls];
+    if (free.empty())
+    {
+        // Refill half the cache at once, so the shared lock is taken rarely
+        auto const want = std::max<size_t>(1, thread_cache_count_(cls) / 2);
+        free.resize(want);
+        free.resize(acquire_(cls, free.data(), want));
+        if (free.empty())
+        {
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return allocate_new_(cls);
+        }
+    }
+
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    auto *p = free.back();
+    free.pop_back();
+    return p;
+}
+
+void buffer_pool_t::deallocate(std::byte *p, size_t size) noexcept
+{
+    if (!p)
+        return;
+
+    auto const cls = class_of_(size);
+    if (cls == k_num_classes)
+    {
+        ::operator delete(p);
+        return;
+    }
+
+    auto *cache = thread_cache();
+    if (!cache)
+    {
+        release_(cls, &p, 1);
+        return;
+    }
+
+    auto& free = cache->free[cls];
+    if (free.size() >= thread_cache_count_(cls))
+    {
+        // Hand half the cache over at once, so the shared lock is taken rarely
+        auto const n = free.size() / 2;
+        release_(cls, free.data() + free.size() - n, n);
+        free.resize(free.size() - n);
+    }
+
+    try
+    {
+        free.push_back(p);
+    }
+    catch (std::bad_alloc const&)
+    {
+        release_(cls, &p, 1);
+    }
+}
+
+std::shared_ptr<std::byte[]> buffer_pool_t::make_shared(size_t size)
+{
+    // If the control block cannot be allocated the deleter gives the memory back
+    return std::shared_ptr<std::byte[]>(allocate(size), deleter_t{size}, pool_allocator_t<std::byte>{});
+}
+
+size_t buffer_pool_t::class_of_(size_t size) noexcept
+{
+    if (size <= class_size_(0))
+        return 0;
+
+    auto const shift = static_cast<size_t>(64 - __builtin_clzll(static_cast<unsigned long long>(size - 1)));
+    return std::min(shift - k_min_class_shift, k_num_classes);
+}
+
+size_t buffer_pool_t::thread_cache_count_(size_t cls) const noexcept
+{
+    return std::clamp<size_t>(config_.thread_cache_bytes / class_size_(cls), 2, k_max_thread_cache_count);
+}
+
+bool buffer_pool_t::from_slab_(size_t cls) const noexcept
+{
+    return config_.huge_pages && cls + k_min_class_shift >= k_min_slab_class_shift;
+}
+
+std::byte* buffer_pool_t::allocate_new_(size_t cls)
+{
+    auto const size = class_size_(cls);
+    if (!from_slab_(cls))
+        return static_cast<std::byte*>(::operator new(size));
+
+    auto& size_class = classes_[cls];
+    auto const count = k_slab_size / size;
+    std::lock_guard<std::mutex> lock(size_class.mutex);
+
+    // Make room for the whole slab first, slab buffers must never need an allocation to be kept
+    size_class.free.reserve(size_class.slab_buffers + count);
+    auto *slab = map_slab();
+    slab_bytes_.fetch_add(k_slab_size, std::memory_order_relaxed);
+    size_class.slab_buffers += count;
+
+    // Keep the first buffer of the slab and cache the rest
+    for (size_t i = 1; i < count; i++)
+        size_class.free.push_back(slab + i * size);
+
+    return slab;
+}
+
+void buffer_pool_t::release_(size_t cls, std::byte **first, size_t count) noexcept
+{
+    auto& size_class = classes_[cls];
+    if (from_slab_(cls))
+    {
+        // Slab memory cannot be freed, there is always room for it (see allocate_new_)
+        std::lock_guard<std::mutex> lock(size_class.mutex);
+        size_class.free.insert(size_class.free.end(), first, first + count);
+        return;
+    }
+
+    auto const size = class_size_(cls);
+    size_t kept;
+    {
+        std::lock_guard<std::mutex> lock(size_class.mutex);
+        auto const cached = cached_bytes_.load(std::memory_order_relaxed);
+        auto const room = cached < config_.max_cached_bytes ? (config_.max_cached_bytes - cached) / size : 0;
+        kept = std::min(count, room);
+
+        try
+        {
+            size_class.free.insert(size_class.free.end(), first, first + kept);
+        }
+        catch (std::bad_alloc const&)
+        {
+            kept = 0;
+        }
+    }
+
+    cached_bytes_.fetch_add(kept * size, std::memory_order_relaxed);
+    for (size_t i = kept; i < count; i++)
+        ::operator delete(first[i]);
+}
+
+size_t buffer_pool_t::acquire_(size_t cls, std::byte **out, size_t count) noexcept
+{
+    auto& size_class = classes_[cls];
+    size_t n;
+    {
+        std::lock_guard<std::mutex> lock(size_class.mutex);
+        n = std::min(count, size_class.free.size());
+        std::copy(size_class.free.end() - static_cast<std::ptrdiff_t>(n), size_class.free.end(), out);
+        size_class.free.resize(size_class.free.size() - n);
+    }
+
+    if (!from_slab_(cls))
+        cached_bytes_.fetch_sub(n * class_size_(cls), std::memory_order_relaxed);
+    return n;
+}
+
+} // namespace toxfs
@@ -20,31 +20,58 @@
 #include "toxfs/util/chunked_progress.hh"
 #include "toxfs/logging.hh"
 
+#include <algorithm>
+#include <iterator>
+
 namespace toxfs
 {
 
 chunked_progress::chunked_progress(uint64_t size)
     : size_(size)
-    , pos_(0u)
 {
 }
 
-void chunked_progress::update(uint64_t pos, uint64_t size) noexcept
+void chunked_progress::update(uint64_t pos, uint64_t size)
 {
-    if (pos <= pos_ && pos + size > pos_)
+    if (pos >= size_ || size == 0)
     {
-        pos_ = pos + size;
+        if (size != 0)
+            TOXFS_LOG_WARNING("Progress at {} is past the end ({})", pos, size_);
+        return;
     }
-    else if (pos > pos_)
+
+    auto end = std::min(pos + size, size_);
+
+    // Join the range before if this overlaps or touches it
+    auto it = ranges_.upper_bound(pos);
+    if (it != ranges_.begin())
     {
-        TOXFS_LOG_DEBUG("Progress jumped from {} to {}", pos_, pos);
-        pos_ = pos + size;
+        auto prev = std::prev(it);
+        if (prev->second >= pos)
+        {
+            if (prev->second >= end)
+                return;
+
+            pos = prev->first;
+            it = prev;
+        }
     }
+
+    // Swallow every range that starts inside or right after this one
+    while (it != ranges_.end() && it->first <= end)
+    {
+        end = std::max(end, it->second);
+        done_ -= it->second - it->first;
+        it = ranges_.erase(it);
+    }
+
+    ranges_.emplace_hint(it, pos, end);
+    done_ += end - pos;
 }
 
 uint64_t chunked_progress::progress() const noexcept
 {
-    return pos_;
+    return done_;
 }
 
 uint64_t chunked_progress::total_size() const noexcept
@@ -52,4 +79,71 @@ uint64_t chunked_progress::total_size() const noexcept
     return size_;
 }
 
+uint64_t chunked_progress::contiguous() const noexcept
+{
+    if (ranges_.empty() || ranges_.begin()->first != 0)
+        return 0;
+
+    return ranges_.begin()->second;
+}
+
+bool chunked_progress::contains(uint64_t pos, uint64_t size) const noexcept
+{
+    if (size == 0)
+        return true;
+
+    auto it = ranges_.upper_bound(pos);
+    if (it == ranges_.begin())
+        return false;
+
+    --it;
+    return it->first <= pos && it->second >= pos + size;
+}
+
+std::optional<byte_range_t> chunked_progress::next_missing(uint64_t pos) const noexcept
+{
+    if (pos >= size_)
+        return std::nullopt;
+
+    auto it = ranges_.upper_bound(pos);
+    if (it != ranges_.begin())
+    {
+        auto prev = std::prev(it);
+        pos = std::max(pos, prev->second);
+    }
+
+    if (pos >= size_)
+        return std::nullopt;
+
+    auto gap_end = it == ranges_.end() ? size_ : it->first;
+    return byte_range_t{pos, gap_end - pos};
+}
+
+std::vector<byte_range_t> chunked_progress::missing() const
+{
+    std::vector<byte_range_t> ret;
+    uint64_t pos = 0;
+    for (auto const& [start, end] : ranges_)
+    {
+        if (start > pos)
+            ret.push_back(byte_range_t{pos, start - pos});
+        pos = end;
+    }
+
+    if (pos < size_)
+        ret.push_back(byte_range_t{pos, size_ - pos});
+
+    return ret;
+}
+
+std::vector<byte_range_t> chunked_progress::ranges() const
+{
+    std::vector<byte_range_t> ret;
+    ret.reserve(ranges_.size());
+    for (auto const& [start, end] : ranges_)
+        ret.push_back(byte_range_t{start, end - start});
+
+    return ret;
+}
+
 } // namespace toxfs
@@ -0,0 +1,89 @@
+/**
+ * Copyright (C) 2021 by The Toxfs Project Contributers
+ *
+ * This file is part of Toxfs.
+ *
+ * Toxfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Toxfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Toxfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "toxfs/util/wakeup.hh"
+#include "toxfs/exception.hh"
+#include "toxfs/logging.hh"
+
+#include <fmt/core.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+namespace toxfs
+{
+
+wakeup_t::wakeup_t()
+{
+    event_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd_ < 0)
+        throw TOXFS_EXCEPTION(runtime_error, fmt::format("eventfd failed: {}", std::strerror(errno)));
+
+    epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0)
+    {
+        auto const err = errno;
+        ::close(event_fd_);
+        throw TOXFS_EXCEPTION(runtime_error, fmt::format("epoll_create1 failed: {}", std::strerror(err)));
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = event_fd_;
+    if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev) != 0)
+    {
+        auto const err = errno;
+        ::close(epoll_fd_);
+        ::close(event_fd_);
+        throw TOXFS_EXCEPTION(runtime_error, fmt::format("epoll_ctl failed: {}", std::strerror(err)));
+    }
+}
+
+wakeup_t::~wakeup_t() noexcept
+{
+    ::close(epoll_fd_);
+    ::close(event_fd_);
+}
+
+void wakeup_t::signal_() noexcept
+{
+    uint64_t const one = 1;
+    // Only fails if the counter is about to overflow, which still wakes the thread
+    [[maybe_unused]] auto ret = ::write(event_fd_, &one, sizeof(one));
+}
+
+void wakeup_t::wait_(int timeout_ms) noexcept
+{
+    epoll_event ev{};
+    int ret = ::epoll_wait(epoll_fd_, &ev, 1, timeout_ms);
+    if (ret < 0 && errno != EINTR)
+        TOXFS_LOG_ERROR("epoll_wait failed: {}", std::strerror(errno));
+
+    // Reset the counter, notifies that came in while awake are seen by ready
+    uint64_t count = 0;
+    [[maybe_unused]] auto read_ret = ::read(event_fd_, &count, sizeof(count));
+}
+
+} // namespace toxfs
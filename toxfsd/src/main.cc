@@ -23,11 +23,15 @@
 #include "toxfs/logging.hh"
 #include "toxfs/exception.hh"
 #include "toxfs/util/string_helpers.hh"
+#include "toxfs/util/buffer_pool.hh"
 #include "toxfs/transfer/transfer_ctrl.hh"
+#include "toxfs/rpc/rpc.hh"
 
 #include <fmt/core.h>
 
 #include <algorithm>
+#include <string_view>
+#include <vector>
 
 class friend_acceptor : public toxfs::tox::friend_callback_if
 {
@@ -47,6 +51,27 @@ private:
 
 int main(int argc, char **argv)
 {
+    // Options may go anywhere, everything else is positional
+    bool huge_pages = false;
+    std::vector<char*> args;
+    for (int i = 0; i < argc; i++)
+    {
+        if (std::string_view{argv[i]} == "--huge-pages")
+            huge_pages = true;
+        else
+            args.push_back(argv[i]);
+    }
+    argc = static_cast<int>(args.size());
+    argv = args.data();
+
+    // Before anything allocates a buffer
+    if (huge_pages)
+    {
+        toxfs::buffer_pool_config_t pool_config;
+        pool_config.huge_pages = true;
+        toxfs::buffer_pool_t::instance().configure(pool_config);
+    }
+
     {
         auto [major, minor, patch, hash] = toxfs::get_version();
         TOXFS_LOG_INFO("version: {}.{}.{} {}", major, minor, patch, hash);
@@ -59,7 +84,7 @@ int main(int argc, char **argv)
     if (argc <= 2)
     {
         TOXFS_LOG_WARNING("Missing arguments, cannot start!");
-        TOXFS_LOG_WARNING("Usage: toxfsd <friend address> <root dir> [<savedata file>]");
+        TOXFS_LOG_WARNING("Usage: toxfsd [--huge-pages] <friend address> <root dir> [<savedata file>]");
         return 1;
     }
 
@@ -92,7 +117,12 @@ int main(int argc, char **argv)
     auto tox = std::make_shared<toxfs::tox::tox_t>(config);
     friend_acceptor fr_acceptor{friend_addr.public_key()};
     tox->get_interface()->register_friend_callback_if(fr_acceptor);
-    toxfs::transfer::transfer_ctrl tctrl{tox->get_interface(), config.root_dir};
+    toxfs::transfer::transfer_config_t transfer_config;
+    transfer_config.root_dir = config.root_dir;
+    toxfs::transfer::transfer_ctrl tctrl{tox->get_interface(), transfer_config};
+    toxfs::rpc::rpc_config_t rpc_config;
+    rpc_config.root_dir = config.root_dir;
+    toxfs::rpc::rpc_t rpc{tox->get_interface(), rpc_config};
     TOXFS_LOG_INFO("tox has initialized!");
     tox->start();
 
@@ -116,8 +146,8 @@ int main(int argc, char **argv)
                     auto path = message.substr(filename_start);
                     TOXFS_LOG_DEBUG("send_path Fr#{}: {}", fr_id.id, path);
                     tctrl.send_path(fr_id, path);
-                    TOXFS_LOG_DEBUG("done send_path Fr#{}: {}", fr_id.id, path);
-                    tox_if->send_message(fr_id, fmt::format("done {}", message)).get();
+                    TOXFS_LOG_DEBUG("started send_path Fr#{}: {}", fr_id.id, path);
+                    tox_if->send_message(fr_id, fmt::format("started {}", message)).get();
                 }
                 catch (toxfs::exception const& e)
                 {
@@ -128,6 +158,12 @@ int main(int argc, char **argv)
             {
                 tox->save();
             }
+            else if (message == "stats")
+            {
+                auto stats = toxfs::buffer_pool_t::instance().stats();
+                tox_if->send_message(fr_id, fmt::format("buffer pool: {} hits, {} misses, {} bytes cached, {} bytes in slabs",
+                        stats.hits, stats.misses, stats.cached_bytes, stats.slab_bytes)).get();
+            }
             else
             {
                 tox_if->send_message(fr_id, fmt::format("unknown command: {}", message)).get();